@@ -1276,6 +1276,105 @@ Script MakeGcPressure(const NodeRegistry& registry)
     return builder.Finish();
 }
 
+// Keeps BenchmarkSize objects alive, each with its own list, and then updates every one of them
+// while allocating a temporary list per update. The size of the live heap decides how long
+// a full collection has to mark, the temporaries keep the collector busy meanwhile.
+Script MakeHeapScaling(const NodeRegistry& registry)
+{
+    CaseBuilder builder(registry, 200'000.0);
+    ScriptClassPtr heapNode = std::make_shared<ScriptClass>(builder.ids.GetNextId(), "HeapNode");
+    ScriptPropertyPtr value = std::make_shared<ScriptProperty>(builder.ids.GetNextId(), "Value");
+    value->type = PinType::Float;
+    value->defaultValue = Value(0.0);
+    ScriptPropertyPtr items = std::make_shared<ScriptProperty>(builder.ids.GetNextId(), "Items");
+    items->type = TypeRef::List(PinType::Float);
+    items->defaultValue = MakeValueFromType(items->type);
+    heapNode->properties = { value, items };
+    builder.script.classes.push_back(heapNode);
+    const TypeRef nodeType = TypeRef::Object(heapNode->ID.id, heapNode->Name);
+    ScriptPropertyPtr nodes = builder.ListVariable("Nodes", nodeType);
+    ScriptPropertyPtr temporaryList = builder.ListVariable("TemporaryList", PinType::Float);
+
+    Graph& graph = builder.script.main->Graph;
+    NodePtr begin = BuildBeginNode(builder.ids, builder.script.main);
+    builder.Add(graph, begin);
+    const FreshList fresh = InitializeFreshList(builder, graph, begin, nodes);
+
+    NodePtr repeat = builder.Compiled("Flow::Repeat");
+    NodePtr getSize = builder.Get(builder.size);
+    NodePtr construct = BuildConstructObjectNode(builder.ids, heapNode);
+    NodePtr setInitialValue = BuildSetPropertyNode(builder.ids, value, value->ID, nodeType);
+    NodePtr makeItems = builder.Native("List::MakeList");
+    makeItems->TypeOverrides["T"] = PinType::Float;
+    makeItems->AddInput(builder.ids);
+    makeItems->AddInput(builder.ids);
+    makeItems->AddInput(builder.ids);
+    NodePtr addOne = AddNumber(builder, 1.0);
+    NodePtr addTwo = AddNumber(builder, 2.0);
+    NodePtr setItems = BuildSetPropertyNode(builder.ids, items, items->ID, nodeType);
+    NodePtr getNodesForPush = builder.Get(nodes);
+    NodePtr push = builder.Native("List::Push");
+    push->TypeOverrides["T"] = nodeType;
+    builder.Add(graph, { repeat, getSize, construct, setInitialValue, makeItems, addOne, addTwo, setItems, getNodesForPush, push });
+    builder.Link(graph, fresh.clearList->Outputs[0], repeat->Inputs[0]);
+    builder.Link(graph, getSize->Outputs[0], builder.Input(repeat, "Count"));
+    builder.Link(graph, repeat->Outputs[0], construct->Inputs[0]);
+    builder.Link(graph, construct->Outputs[0], setInitialValue->Inputs[0]);
+    builder.Link(graph, construct->Outputs[1], setInitialValue->Inputs[1]);
+    builder.Link(graph, repeat->Outputs[1], setInitialValue->Inputs[2]);
+    builder.Link(graph, repeat->Outputs[1], makeItems->Inputs[0]);
+    builder.Link(graph, repeat->Outputs[1], addOne->Inputs[0]);
+    builder.Link(graph, repeat->Outputs[1], addTwo->Inputs[0]);
+    builder.Link(graph, addOne->Outputs[0], makeItems->Inputs[1]);
+    builder.Link(graph, addTwo->Outputs[0], makeItems->Inputs[2]);
+    builder.Link(graph, setInitialValue->Outputs[0], setItems->Inputs[0]);
+    builder.Link(graph, construct->Outputs[1], setItems->Inputs[1]);
+    builder.Link(graph, builder.Output(makeItems, "List"), setItems->Inputs[2]);
+    builder.Link(graph, setItems->Outputs[0], push->Inputs[0]);
+    builder.Link(graph, getNodesForPush->Outputs[0], builder.Input(push, "List"));
+    builder.Link(graph, construct->Outputs[1], builder.Input(push, "Value"));
+
+    NodePtr forIn = builder.Compiled("Flow::For In");
+    NodePtr getNodesForIteration = builder.Get(nodes);
+    NodePtr getValue = BuildGetPropertyNode(builder.ids, value, value->ID, nodeType);
+    NodePtr multiply = MultiplyNumber(builder, 3.0);
+    NodePtr addUpdate = AddNumber(builder, 1.0);
+    NodePtr modulo = ModuloNumber(builder, Modulus);
+    NodePtr setValue = BuildSetPropertyNode(builder.ids, value, value->ID, nodeType);
+    NodePtr makeTemporary = builder.Native("List::MakeList");
+    makeTemporary->TypeOverrides["T"] = PinType::Float;
+    makeTemporary->AddInput(builder.ids);
+    makeTemporary->AddInput(builder.ids);
+    NodePtr setTemporary = builder.Set(temporaryList);
+    NodePtr getChecksum = builder.Get(builder.checksum);
+    NodePtr addChecksum = builder.Compiled("Math::Add");
+    NodePtr checksumModulo = ModuloNumber(builder, Modulus);
+    NodePtr setChecksum = builder.Set(builder.checksum);
+    builder.Add(graph, {
+        forIn, getNodesForIteration, getValue, multiply, addUpdate, modulo, setValue, makeTemporary, setTemporary, getChecksum,
+        addChecksum, checksumModulo, setChecksum
+    });
+    builder.Link(graph, repeat->Outputs[2], forIn->Inputs[0]);
+    builder.Link(graph, getNodesForIteration->Outputs[0], builder.Input(forIn, "Iterable"));
+    builder.Link(graph, forIn->Outputs[1], getValue->Inputs[0]);
+    builder.Link(graph, getValue->Outputs[0], multiply->Inputs[0]);
+    builder.Link(graph, multiply->Outputs[0], addUpdate->Inputs[0]);
+    builder.Link(graph, addUpdate->Outputs[0], modulo->Inputs[0]);
+    builder.Link(graph, forIn->Outputs[0], setValue->Inputs[0]);
+    builder.Link(graph, forIn->Outputs[1], setValue->Inputs[1]);
+    builder.Link(graph, modulo->Outputs[0], setValue->Inputs[2]);
+    builder.Link(graph, setValue->Outputs[0], setTemporary->Inputs[0]);
+    builder.Link(graph, getValue->Outputs[0], makeTemporary->Inputs[0]);
+    builder.Link(graph, setValue->Outputs[1], makeTemporary->Inputs[1]);
+    builder.Link(graph, builder.Output(makeTemporary, "List"), setTemporary->Inputs[1]);
+    builder.Link(graph, setTemporary->Outputs[0], setChecksum->Inputs[0]);
+    builder.Link(graph, getChecksum->Outputs[0], addChecksum->Inputs[0]);
+    builder.Link(graph, setValue->Outputs[1], addChecksum->Inputs[1]);
+    builder.Link(graph, addChecksum->Outputs[0], checksumModulo->Inputs[0]);
+    builder.Link(graph, checksumModulo->Outputs[0], setChecksum->Inputs[1]);
+    return builder.Finish();
+}
+
 Script MakePrimeSieve(const NodeRegistry& registry)
 {
     CaseBuilder builder(registry, 250'000.0);
@@ -1613,6 +1712,7 @@ void GenerateBenchmarkCases(const NodeRegistry& registry, const std::filesystem:
     ValidateAndSave(MakeDynamicValues(registry, true), outputDirectory / "dynamic-values-mixed.vlox");
     ValidateAndSave(MakeObjects(registry), outputDirectory / "objects.vlox");
     ValidateAndSave(MakeGcPressure(registry), outputDirectory / "gc-pressure.vlox");
+    ValidateAndSave(MakeHeapScaling(registry), outputDirectory / "heap-scaling.vlox");
     ValidateAndSave(MakePrimeSieve(registry), outputDirectory / "prime-sieve.vlox");
     ValidateAndSave(MakeMandelbrot(registry), outputDirectory / "mandelbrot.vlox");
 }
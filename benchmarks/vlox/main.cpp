@@ -4,6 +4,7 @@
 #include "runtime/standardLibrary.h"
 #include "script/scriptSerializer.h"
 
+#include <Jit.h>
 #include <Object.h>
 #include <Vm.h>
 
@@ -36,6 +37,13 @@ enum class BenchmarkMode
     Run
 };
 
+enum class GcMode
+{
+    StopTheWorld,
+    Incremental,
+    Concurrent
+};
+
 struct Options
 {
     std::string scriptPath;
@@ -47,10 +55,17 @@ struct Options
     int repeat = 10;
     BenchmarkMode mode = BenchmarkMode::Execute;
     bool enableConstantFolding = true;
+    bool enableSuperinstructions = true;
+    bool enableRegisterTier = false;
+    bool enableJit = false;
     bool enableGarbageCollection = false;
+    GcMode gcMode = GcMode::StopTheWorld;
     bool requireChecksum = true;
     bool disassemble = false;
     bool csv = false;
+    bool inlineCacheStats = false;
+    bool heapStats = false;
+    bool gcPauses = false;
 };
 
 struct Measurement
@@ -75,11 +90,21 @@ void PrintUsage()
         << "  --repeat N             Measured iterations (default: 10).\n"
         << "  --mode MODE            execute, compile, or run (default: execute).\n"
         << "  --folding on|off       Enable constant folding (default: on).\n"
+        << "  --superinstructions on|off\n"
+        << "                         Fuse common instruction sequences (default: on).\n"
+        << "  --registers on|off     Run supported functions on the register interpreter (default: off).\n"
+        << "  --jit on|off           Compile hot register functions to machine code; needs --registers on\n"
+        << "                         and a build with -DVLOX_JIT=ON (default: off).\n"
         << "  --gc on|off            Enable garbage collection (default: off).\n"
+        << "  --gc-mode MODE         stop-the-world, incremental, or concurrent full collections\n"
+        << "                         (default: stop-the-world).\n"
         << "  --checksum NAME        Checksum global name (default: BenchmarkChecksum).\n"
         << "  --no-checksum          Do not read or verify a checksum.\n"
         << "  --disassemble          Print bytecode during the initial compilation only.\n"
         << "  --csv                  Write one CSV row per measured iteration.\n"
+        << "  --ic-stats             Print inline cache hits and misses for the measured iterations.\n"
+        << "  --heap-stats           Print allocator throughput and fragmentation for the measured iterations.\n"
+        << "  --gc-pauses            Print the collector pauses of the measured iterations.\n"
         << "  -h, --help             Show this help.\n";
 }
 
@@ -128,6 +153,28 @@ BenchmarkMode ParseMode(const std::string& text)
     throw std::invalid_argument("--mode must be 'execute', 'compile', or 'run'.");
 }
 
+GcMode ParseGcMode(const std::string& text)
+{
+    if (text == "stop-the-world")
+        return GcMode::StopTheWorld;
+    if (text == "incremental")
+        return GcMode::Incremental;
+    if (text == "concurrent")
+        return GcMode::Concurrent;
+    throw std::invalid_argument("--gc-mode must be 'stop-the-world', 'incremental', or 'concurrent'.");
+}
+
+const char* GcModeName(GcMode mode)
+{
+    switch (mode)
+    {
+    case GcMode::StopTheWorld: return "stop-the-world";
+    case GcMode::Incremental: return "incremental";
+    case GcMode::Concurrent: return "concurrent";
+    }
+    return "unknown";
+}
+
 const char* ModeName(BenchmarkMode mode)
 {
     switch (mode)
@@ -164,8 +211,16 @@ Options ParseOptions(int argc, char** argv)
             options.mode = ParseMode(RequireValue(index, argc, argv, argument));
         else if (argument == "--folding")
             options.enableConstantFolding = ParseToggle(RequireValue(index, argc, argv, argument), argument);
+        else if (argument == "--superinstructions")
+            options.enableSuperinstructions = ParseToggle(RequireValue(index, argc, argv, argument), argument);
+        else if (argument == "--registers")
+            options.enableRegisterTier = ParseToggle(RequireValue(index, argc, argv, argument), argument);
+        else if (argument == "--jit")
+            options.enableJit = ParseToggle(RequireValue(index, argc, argv, argument), argument);
         else if (argument == "--gc")
             options.enableGarbageCollection = ParseToggle(RequireValue(index, argc, argv, argument), argument);
+        else if (argument == "--gc-mode")
+            options.gcMode = ParseGcMode(RequireValue(index, argc, argv, argument));
         else if (argument == "--checksum")
             options.checksumVariable = RequireValue(index, argc, argv, argument);
         else if (argument == "--no-checksum")
@@ -174,6 +229,12 @@ Options ParseOptions(int argc, char** argv)
             options.disassemble = true;
         else if (argument == "--csv")
             options.csv = true;
+        else if (argument == "--ic-stats")
+            options.inlineCacheStats = true;
+        else if (argument == "--heap-stats")
+            options.heapStats = true;
+        else if (argument == "--gc-pauses")
+            options.gcPauses = true;
         else if (!argument.empty() && argument[0] == '-')
             throw std::invalid_argument("Unknown option: " + argument);
         else if (options.scriptPath.empty())
@@ -186,6 +247,13 @@ Options ParseOptions(int argc, char** argv)
         throw std::invalid_argument("A .vlox script path is required.");
     if (options.repeat < 1)
         throw std::invalid_argument("--repeat must be at least 1.");
+    if (options.enableJit && !options.enableRegisterTier)
+        throw std::invalid_argument("--jit on requires --registers on.");
+    if (options.enableJit && !isJitAvailable())
+    {
+        std::cerr << "This build has no JIT, configure with -DVLOX_JIT=ON. Using the register interpreter.\n";
+        options.enableJit = false;
+    }
     if (options.benchmarkName.empty())
         options.benchmarkName = std::filesystem::path(options.scriptPath).stem().string();
     return options;
@@ -267,6 +335,9 @@ ScriptCompileResult Compile(VM& vm, const Script& script, const Options& options
 {
     ScriptCompileOptions compileOptions;
     compileOptions.enableConstantFolding = options.enableConstantFolding;
+    compileOptions.enableSuperinstructions = options.enableSuperinstructions;
+    compileOptions.enableRegisterTier = options.enableRegisterTier;
+    compileOptions.enableJit = options.enableJit;
     compileOptions.disassemble = initial && options.disassemble;
     ScriptCompileResult result = ScriptRuntime::Compile(vm, script, compileOptions);
     if (initial || !result)
@@ -342,13 +413,54 @@ void WriteResults(const Options& options, const std::string& size, const std::ve
 
     std::cout << "benchmark=" << options.benchmarkName << " language=vlox variant=" << options.variant << " size=" << size
               << " mode=" << ModeName(options.mode) << " gc=" << (options.enableGarbageCollection ? "on" : "off")
-              << " folding=" << (options.enableConstantFolding ? "on" : "off");
+              << " gc_mode=" << GcModeName(options.gcMode)
+              << " folding=" << (options.enableConstantFolding ? "on" : "off")
+              << " superinstructions=" << (options.enableSuperinstructions ? "on" : "off")
+              << " registers=" << (options.enableRegisterTier ? "on" : "off")
+              << " jit=" << (options.enableJit ? "on" : "off");
     if (!measurements.front().checksum.empty())
         std::cout << " checksum=" << measurements.front().checksum;
     std::cout << '\n';
     std::cout << std::fixed << std::setprecision(6) << "runs=" << measurements.size() << " median_ms=" << Median(elapsed) / 1'000'000.0
               << " min_ms=" << elapsed.front() / 1'000'000.0 << " p95_ms=" << elapsed[p95Index] / 1'000'000.0 << '\n';
 }
+
+void WriteInlineCacheStats(const Options& options, const InlineCacheStats& stats)
+{
+    // Keep CSV output parseable by writing the counters to stderr.
+    std::ostream& output = options.csv ? std::cerr : std::cout;
+    const uint64_t lookups = stats.hits + stats.misses + stats.megamorphic;
+    const double hitRate = lookups == 0 ? 0.0 : static_cast<double>(stats.hits) / static_cast<double>(lookups);
+    output << "ic_hits=" << stats.hits << " ic_misses=" << stats.misses << " ic_megamorphic=" << stats.megamorphic
+           << std::fixed << std::setprecision(4) << " ic_hit_rate=" << hitRate << '\n';
+}
+
+void WriteGcPauses(const Options& options, const GcPauseStats& stats)
+{
+    std::ostream& output = options.csv ? std::cerr : std::cout;
+    output << "gc_pauses=" << stats.pauses << std::fixed << std::setprecision(6)
+           << " gc_pause_total_ms=" << stats.total.count() / 1'000'000.0
+           << " gc_max_pause_ms=" << stats.longest.count() / 1'000'000.0 << '\n';
+}
+
+void WriteHeapStats(const Options& options, const AllocatorStats& before, const AllocatorStats& after, const std::vector<Measurement>& measurements)
+{
+    std::ostream& output = options.csv ? std::cerr : std::cout;
+    int64_t elapsed = 0;
+    for (const Measurement& measurement : measurements)
+        elapsed += measurement.elapsedNanoseconds;
+
+    // Allocations include the ones made by collections running during the measured iterations.
+    const uint64_t allocations = after.allocations - before.allocations;
+    const double allocationsPerSecond = elapsed == 0 ? 0.0 : static_cast<double>(allocations) * 1e9 / static_cast<double>(elapsed);
+    const double fragmentation = after.reservedBytes == 0 ? 0.0 : 1.0 - static_cast<double>(after.liveBytes) / static_cast<double>(after.reservedBytes);
+    output << "heap_allocations=" << allocations << " heap_frees=" << after.frees - before.frees
+           << std::fixed << std::setprecision(0) << " heap_allocations_per_sec=" << allocationsPerSecond
+           << " heap_live_bytes=" << after.liveBytes << " heap_reserved_bytes=" << after.reservedBytes
+           << " heap_peak_reserved_bytes=" << after.peakReservedBytes << " heap_slabs=" << after.slabCount
+           << " heap_slabs_released=" << after.slabsReleased
+           << std::setprecision(4) << " heap_fragmentation=" << fragmentation << '\n';
+}
 }
 
 int main(int argc, char** argv)
@@ -373,6 +485,10 @@ int main(int argc, char** argv)
                 vm.markObject(pinnedFunction);
         });
         vm.allowGarbageCollection(options.enableGarbageCollection);
+        // Both modes get the 1 ms budget of the editor, only the marking differs.
+        if (options.gcMode != GcMode::StopTheWorld)
+            vm.setGcPauseBudget(std::chrono::milliseconds(1));
+        vm.setConcurrentMarking(options.gcMode == GcMode::Concurrent);
 
         const SerializationResult loadResult = ScriptSerializer::Load(options.scriptPath, registry, script, ids);
         if (!loadResult)
@@ -382,6 +498,7 @@ int main(int argc, char** argv)
         std::vector<Measurement> measurements;
         measurements.reserve(static_cast<size_t>(options.repeat));
         std::string expectedChecksum;
+        AllocatorStats heapBefore;
 
         if (options.mode == BenchmarkMode::Execute)
         {
@@ -398,6 +515,9 @@ int main(int argc, char** argv)
                     throw std::runtime_error("Benchmark checksum changed during warm-up.");
             }
 
+            vm.resetInlineCacheStats();
+            heapBefore = vm.getHeap().getStats();
+            vm.resetGcPauseStats();
             for (int iteration = 0; iteration < options.repeat; ++iteration)
             {
                 Measurement measurement;
@@ -422,6 +542,8 @@ int main(int argc, char** argv)
                 pinnedFunction = compiled.function;
             }
 
+            heapBefore = vm.getHeap().getStats();
+            vm.resetGcPauseStats();
             for (int iteration = 0; iteration < options.repeat; ++iteration)
             {
                 Measurement measurement;
@@ -453,6 +575,9 @@ int main(int argc, char** argv)
                     throw std::runtime_error("Benchmark checksum changed during warm-up.");
             }
 
+            vm.resetInlineCacheStats();
+            heapBefore = vm.getHeap().getStats();
+            vm.resetGcPauseStats();
             for (int iteration = 0; iteration < options.repeat; ++iteration)
             {
                 Measurement measurement;
@@ -468,6 +593,12 @@ int main(int argc, char** argv)
         }
 
         WriteResults(options, size, measurements);
+        if (options.inlineCacheStats)
+            WriteInlineCacheStats(options, vm.getInlineCacheStats());
+        if (options.heapStats)
+            WriteHeapStats(options, heapBefore, vm.getHeap().getStats(), measurements);
+        if (options.gcPauses)
+            WriteGcPauses(options, vm.getGcPauseStats());
         vm.setExternalMarkingFunc([]() {});
         return 0;
     }
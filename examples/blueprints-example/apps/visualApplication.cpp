@@ -50,10 +50,10 @@ Value UiText(int, Value* args, VM*)
     return Value();
 }
 
-Value UiStart(int, Value* args, VM*)
+Value UiStart(int, Value* args, VM* vm)
 {
-    if (activeContext)
-        activeContext->SetUpdateFunction(args[0]);
+    if (activeContext && activeContext->SetUpdateFunction(args[0]))
+        vm->rememberValue(args[0]);
     return Value();
 }
 
@@ -8,6 +8,7 @@
 
 #include <application.h>
 
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -39,6 +40,8 @@ public:
             if (context)
                 context->MarkRoots(vm);
         });
+        // Collections run in steps between allocations rather than stalling a frame.
+        vm.setGcPauseBudget(std::chrono::milliseconds(1));
 
         if (GetArguments().empty())
         {
@@ -83,6 +86,7 @@ public:
         ClearStandardLibraryTimers(vm);
         context.reset();
         vm.setExternalMarkingFunc([]() {});
+        vm.setGcPauseBudget(std::chrono::nanoseconds::zero());
     }
 
     void OnFrame(float deltaTime) override
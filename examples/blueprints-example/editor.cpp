@@ -565,6 +565,8 @@ void Example::OnStart()
             pAction->MarkRoots();
         }
     });
+    // Scripts that update the visual application every frame get their collections in steps.
+    vm.setGcPauseBudget(std::chrono::milliseconds(1));
 
     RegisterStandardLibrary(m_NodeRegistry);
     RegisterVisualApplicationLibrary(m_NodeRegistry);
@@ -1136,11 +1138,11 @@ void Example::ShowCompilerInfo(float paneWidth)
 
     if (ImGui::CollapsingHeader("Globals"))
     {
-        const Table& table = vm.globalTable();
-        for (size_t i = 0; i < table.getEntriesSize(); ++i)
-            if (const Entry* entry = table.getEntryByIndex(i); entry && entry->key)
-                ImGui::BulletText("%s  %s", entry->key->chars.c_str(),
-                                  valueAsStr(entry->value).c_str());
+        const GlobalTable& globals = vm.globalTable();
+        for (uint32_t slot = 0; slot < globals.getSlotCount(); ++slot)
+            if (globals.isDefined(slot))
+                ImGui::BulletText("%s  %s", globals.getName(slot)->chars.c_str(),
+                                  valueAsStr(globals.getValue(slot)).c_str());
     }
 
     if (ImGui::CollapsingHeader("Folded nodes"))
@@ -253,6 +253,29 @@ void GraphCompiler::CompileInput(CompilerContext& compilerCtx, const Graph& grap
     emitInputValue(nullptr);
 }
 
+bool GraphCompiler::IsNumberInput(const Graph& graph, const Pin& input, const Value& value)
+{
+    const auto isNumberType = [](const TypeRef& type)
+    {
+        return type == PinType::Float || type == PinType::Int;
+    };
+
+    if (!isNumberType(input.Type))
+        return false;
+
+    // Mirrors CompileInput: unlinked inputs and inputs fed by nodes with errors compile the literal.
+    if (graph.IsPinLinked(input.ID))
+    {
+        if (const Pin* pOutput = GraphUtils::FindConnectedOutput(graph, input))
+        {
+            if (!HasFlag(pOutput->Node->InstanceFlags, NodeInstanceFlags::Error))
+                return isNumberType(pOutput->Type);
+        }
+    }
+
+    return isNumber(value);
+}
+
 void GraphCompiler::CompileOutput(CompilerContext& compilerCtx, const Graph& graph, const Pin& output)
 {
     Compiler& compiler = compilerCtx.compiler;
@@ -83,6 +83,8 @@ struct GraphCompiler
 
     static void CompileLiteral(Compiler& compiler, const Value& value);
     static void CompileInput(CompilerContext& compilerCtx, const Graph& graph, const Pin& input, const Value& value);
+    // True when the value compiled for this input is typed as a number. Nil can still arrive at runtime.
+    static bool IsNumberInput(const Graph& graph, const Pin& input, const Value& value);
     static void CompileOutput(CompilerContext& compilerCtx, const Graph& graph, const Pin& output);
     static void CompileCallResult(CompilerContext& compilerCtx, const Graph& graph,
                                   const std::vector<Pin>& outputs, size_t dataOutputStart);
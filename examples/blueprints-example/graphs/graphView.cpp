@@ -2182,8 +2182,12 @@ static void ForceMinWidth(double value, float minWidth, float padding = 20.0f)
 {
     if (pinType == PinType::Bool)
     {
-        bool& value = inputValue.as.boolean;
-        return ImGui::Checkbox("", &value);
+        bool value = asBoolean(inputValue);
+        if (ImGui::Checkbox("", &value))
+        {
+            inputValue = Value(value);
+            return true;
+        }
     }
     else if (pinType == PinType::String)
     {
@@ -2200,10 +2204,14 @@ static void ForceMinWidth(double value, float minWidth, float padding = 20.0f)
     }
     else if (pinType == PinType::Float)
     {
-        double& value = inputValue.as.number;
+        double value = asNumber(inputValue);
 
         ForceMinWidth(value, 30.0f);
-        return ImGui::InputDouble("##edit", &value, 0, 0, "%.15g");
+        if (ImGui::InputDouble("##edit", &value, 0, 0, "%.15g"))
+        {
+            inputValue = Value(value);
+            return true;
+        }
     }
     else if (pinType == PinType::Range)
     {
@@ -173,7 +173,7 @@ bool operator==(const TypeRef& lhs, const TypeRef& rhs)
 
 TypeRef TypeOfValue(const Value& value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::NIL: return TypeRef(PinType::Nil);
     case ValueType::BOOL: return TypeRef(PinType::Bool);
@@ -50,7 +50,9 @@ struct TwoOperationExpressionNode : public Node
             return;
         GraphCompiler::CompileInput(context, graph, Inputs[0], Inputs[0].LiteralValue);
         GraphCompiler::CompileInput(context, graph, Inputs[1], Inputs[1].LiteralValue);
-        context.compiler.emitByte(OpByte(FirstOperation));
+        const bool numbers = GraphCompiler::IsNumberInput(graph, Inputs[0], Inputs[0].LiteralValue) &&
+                             GraphCompiler::IsNumberInput(graph, Inputs[1], Inputs[1].LiteralValue);
+        context.compiler.emitByte(OpByte(numbers ? numberVariant(FirstOperation) : FirstOperation));
         context.compiler.emitByte(OpByte(SecondOperation));
         GraphCompiler::CompileOutput(context, graph, Outputs[0]);
     }
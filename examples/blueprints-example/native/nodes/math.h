@@ -49,7 +49,9 @@ struct BinaryOpNode : public Node
 
         GraphCompiler::CompileInput(compilerCtx, graph, Inputs[0], Inputs[0].LiteralValue);
         GraphCompiler::CompileInput(compilerCtx, graph, Inputs[1], Inputs[1].LiteralValue);
-        compiler.emitByte(OpByte(OP_CODE));
+        const bool numbers = GraphCompiler::IsNumberInput(graph, Inputs[0], Inputs[0].LiteralValue) &&
+                             GraphCompiler::IsNumberInput(graph, Inputs[1], Inputs[1].LiteralValue);
+        compiler.emitByte(OpByte(numbers ? numberVariant(OP_CODE) : OP_CODE));
 
         GraphCompiler::CompileOutput(compilerCtx, graph, Outputs[0]);
     }
@@ -89,11 +91,16 @@ struct VariadicOpNode : public VariadicInputNode
     {
         Compiler& compiler = compilerCtx.compiler;
         GraphCompiler::CompileInput(compilerCtx, graph, Inputs[0], Inputs[0].LiteralValue);
+        bool resultIsNumber = GraphCompiler::IsNumberInput(graph, Inputs[0], Inputs[0].LiteralValue);
 
         for (size_t inputIndex = 1; inputIndex < Inputs.size(); ++inputIndex)
         {
             GraphCompiler::CompileInput(compilerCtx, graph, Inputs[inputIndex], Inputs[inputIndex].LiteralValue);
-            compiler.emitByte(OpByte(OP_CODE));
+            const bool numbers = resultIsNumber &&
+                                 GraphCompiler::IsNumberInput(graph, Inputs[inputIndex], Inputs[inputIndex].LiteralValue);
+            compiler.emitByte(OpByte(numbers ? numberVariant(OP_CODE) : OP_CODE));
+            // Only add accepts operands other than numbers, every other operation fails on them
+            resultIsNumber = numbers || OP_CODE != OpCode::OP_ADD;
         }
 
         GraphCompiler::CompileOutput(compilerCtx, graph, Outputs[0]);
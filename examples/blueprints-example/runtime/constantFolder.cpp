@@ -36,10 +36,11 @@ bool ConstantFolder::Evaluate(VM& vm, const Graph& graph, const NodePtr& node, V
             current->Compile(graphCompiler.context, currentGraph, stage, portIdx);
         });
 
-    const std::string resultName = "__vlox_fold_" + std::to_string(node->ID.Get());
+    // Every fold reuses the same scratch global, global slots are never freed.
+    const std::string resultName = "__vlox_fold_result";
     const Token resultToken(TokenType::VAR, resultName.c_str(), resultName.length(), 0);
-    const uint32_t resultConstant = compiler.identifierConstant(resultToken);
-    compiler.emitOpWithValue(OpCode::OP_DEFINE_GLOBAL, OpCode::OP_DEFINE_GLOBAL_LONG, resultConstant);
+    const uint32_t resultSlot = compiler.globalSlot(resultToken);
+    compiler.emitOpWithValue(OpCode::OP_DEFINE_GLOBAL, OpCode::OP_DEFINE_GLOBAL_LONG, resultSlot);
     compiler.endScope();
     ObjFunction* function = compiler.endCompiler();
 
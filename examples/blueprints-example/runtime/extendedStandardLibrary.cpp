@@ -412,7 +412,7 @@ bool GetJsonValuePayload(const Value& source, VM* vm, Value& payload)
     if (!isInstance(source) || !vm->globalTable().get(copyString(JsonValueClassName, static_cast<int>(std::strlen(JsonValueClassName))), &classValue) ||
         !isClass(classValue) || asInstance(source)->klass != asClass(classValue))
         return false;
-    return asInstance(source)->fields.get(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), &payload);
+    return asInstance(source)->getField(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), &payload);
 }
 
 Value WrapJsonValue(const Value& payload, VM* vm)
@@ -427,7 +427,7 @@ Value WrapJsonValue(const Value& payload, VM* vm)
 
     ObjInstance* instance = newInstance(asClass(classValue));
     vm->push(Value(instance));
-    instance->fields.set(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), payload);
+    instance->setField(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), payload);
     vm->pop();
     vm->pop();
     return Value(instance);
@@ -476,7 +476,7 @@ Value JsonValueResult(VM* vm, const Value& value, bool success, std::string erro
 Value JsonValueInit(int, Value* args, VM*)
 {
     ObjInstance* instance = asInstance(args[0]);
-    instance->fields.set(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), Value());
+    instance->setField(copyString(JsonValuePayloadField, static_cast<int>(std::strlen(JsonValuePayloadField))), Value());
     return args[0];
 }
 
@@ -687,7 +687,7 @@ Value JsonEntriesToObject(int, Value* args, VM* vm)
         }
     }
     if (success)
-        result->items[0] = JsonValueFromJson(crude_json::value(std::move(object)), vm);
+        result->setValue(0, JsonValueFromJson(crude_json::value(std::move(object)), vm));
     result->append(Value(success));
     result->append(StringValue(std::move(error)));
     return EndList(vm, result);
@@ -2224,6 +2224,7 @@ Value AddTimer(Value* args, VM* vm, bool repeating)
     auto timer = std::make_shared<TimerState>();
     timer->owner = vm;
     timer->callback = args[1];
+    vm->rememberValue(args[1]);
     timer->deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(asNumber(args[0])));
     timer->interval = asNumber(args[0]);
     timer->repeating = repeating;
@@ -43,6 +43,23 @@ void EmitPropertyInitializer(CompilerContext& context, const ScriptProperty& pro
     compiler.emitByte(OpByte(OpCode::OP_POP));
 }
 
+// Every script global is known up front, so give them contiguous slots before any
+// graph is compiled. Global reads and writes then compile to slot indices.
+void ResolveGlobalSlots(Compiler& compiler, const Script& script)
+{
+    auto resolve = [&](const std::string& name)
+    {
+        compiler.globalSlot(Token(TokenType::IDENTIFIER, name.c_str(), name.length(), 0));
+    };
+
+    for (const ScriptPropertyPtr& property : script.variables)
+        resolve(property->Name);
+    for (const ScriptFunctionPtr& scriptFunction : script.functions)
+        resolve(scriptFunction->functionDef->name);
+    for (const ScriptClassPtr& scriptClass : script.classes)
+        resolve(scriptClass->Name);
+}
+
 void EmitLocalInitializer(CompilerContext& context, const ScriptProperty& variable)
 {
     Compiler& compiler = context.compiler;
@@ -108,6 +125,10 @@ ScriptCompileResult ScriptRuntime::Compile(VM& vm, const Script& script, const S
     if (validation.HasErrors())
         return { nullptr, InterpretResult::INTERPRET_COMPILE_ERROR, std::move(validation), {}, {}, {} };
 
+    vm.getCompiler().enableSuperinstructions = options.enableSuperinstructions;
+    vm.getCompiler().enableRegisterTier = options.enableRegisterTier && !options.enableDebugging;
+    vm.getCompiler().enableJit = options.enableJit;
+
     ConstantFoldingResult folding;
     if (options.enableConstantFolding && !options.enableDebugging)
     {
@@ -154,6 +175,7 @@ ScriptCompileResult ScriptRuntime::Compile(VM& vm, const Script& script, const S
     compiler.beginCompile();
     compiler.parser.hadError = false;
     compiler.parser.panicMode = false;
+    ResolveGlobalSlots(compiler, script);
 
     auto compileClosure = [&](const ScriptFunctionPtr& scriptFunction, FunctionType type, const ScriptClassPtr& classOwner = nullptr)
     {
@@ -208,7 +230,7 @@ ScriptCompileResult ScriptRuntime::Compile(VM& vm, const Script& script, const S
         GraphCompiler::CompileLiteral(compiler, property->defaultValue);
         GraphCompiler::EmitVariableProbe(globalDebugContext, nullptr, property->PersistentId, property->Name);
         const Token token(TokenType::VAR, property->Name.c_str(), property->Name.length(), 0);
-        compiler.defineVariable(compiler.identifierConstant(token));
+        compiler.defineVariable(compiler.globalSlot(token));
     }
 
     for (const ScriptFunctionPtr& scriptFunction : script.functions)
@@ -283,7 +305,12 @@ ScriptCompileResult ScriptRuntime::Compile(VM& vm, const Script& script, const S
     }
 
     if (options.disassemble)
-        disassembleChunk(function->chunk, function->name ? function->name->chars.c_str() : "<script>");
+    {
+        const char* name = function->name ? function->name->chars.c_str() : "<script>";
+        disassembleChunk(function->chunk, name);
+        if (!function->chunk.registers.empty())
+            disassembleRegisterChunk(function->chunk, name);
+    }
     vm.resetStack();
 
     return { function, InterpretResult::INTERPRET_OK, std::move(validation), std::move(folding.values), std::move(folding.nodeIds), std::move(debugInfo) };
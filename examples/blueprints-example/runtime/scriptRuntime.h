@@ -12,6 +12,13 @@
 struct ScriptCompileOptions
 {
     bool enableConstantFolding = true;
+    bool enableSuperinstructions = true;
+    // Runs functions on the register interpreter when they only use instructions it supports.
+    // Ignored when debugging, since the register interpreter has no probes.
+    bool enableRegisterTier = false;
+    // Compiles hot register tier functions to x86-64 machine code. Needs enableRegisterTier
+    // and a lox build with VLOX_JIT, ignored otherwise.
+    bool enableJit = false;
     bool enableDebugging = false;
     bool disassemble = false;
     std::vector<std::string> programArguments;
@@ -262,6 +262,7 @@ Value ListInsert(int, Value* args, VM*)
     const int index = static_cast<int>(asNumber(args[1]));
     if (index < 0 || index > static_cast<int>(list->items.size()))
         return Value();
+    appendBarrier(list, args[2]);
     list->items.insert(list->items.begin() + index, args[2]);
     return Value(static_cast<double>(list->items.size()));
 }
@@ -270,7 +271,9 @@ Value ListClear(int, Value* args, VM*)
 {
     if (!isList(args[0]))
         return Value();
-    asList(args[0])->items.clear();
+    ObjList* list = asList(args[0]);
+    snapshotBarrier(list);
+    list->items.clear();
     return Value(0.0);
 }
 
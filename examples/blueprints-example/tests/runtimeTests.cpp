@@ -16,16 +16,21 @@
 #include "../validation/scriptValidator.h"
 
 #include <Vm.h>
+#include <Jit.h>
 #include <Natives.h>
+#include <Superinstructions.h>
+#include <VMUtils.h>
 
 #include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 namespace
@@ -519,6 +524,570 @@ void LargeListLiteralsPreserveItems()
             "Large list literals should preserve every item in source order.");
 }
 
+void ValuesRoundTripThroughTheirEncoding()
+{
+    RuntimeFixture fixture;
+    ObjString* text = copyString("encoded", 7);
+    const double numbers[] = { 0.0, -0.0, 1.5, -1e300, std::numeric_limits<double>::infinity() };
+    for (double number : numbers)
+    {
+        const Value value(number);
+        Require(isNumber(value) && !isObject(value) && !isNil(value) && !isBoolean(value) &&
+                asNumber(value) == number && std::signbit(asNumber(value)) == std::signbit(number),
+                "Numbers should keep their exact bits and type.");
+    }
+    const Value nan(std::nan(""));
+    Require(isNumber(nan) && std::isnan(asNumber(nan)) && !(nan == nan),
+            "NaN should stay a number that is not equal to itself.");
+    Require(Value(0.0) == Value(-0.0), "Positive and negative zero should compare equal.");
+    Require(isNil(Value()) && valueType(Value()) == ValueType::NIL, "Default values should be nil.");
+    Require(isBoolean(Value(true)) && asBoolean(Value(true)) && isBoolean(Value(false)) &&
+            !asBoolean(Value(false)) && !(Value(true) == Value(false)),
+            "Booleans should keep their value.");
+    const Value object(static_cast<Obj*>(text));
+    Require(isObject(object) && isString(object) && asObject(object) == text &&
+            valueType(object) == ValueType::OBJ && object == Value(static_cast<Obj*>(text)),
+            "Objects should keep their address and type.");
+    Require(!(Value(1.0) == Value(true)) && !(Value() == Value(false)),
+            "Values of different types should not compare equal.");
+}
+
+void GlobalSlotsStayVisibleByName()
+{
+    RuntimeFixture fixture;
+    ObjString* name = copyString("slotCounter", 11);
+    Require(fixture.vm.interpret("var slotCounter = 1; slotCounter = slotCounter + 2;") ==
+                InterpretResult::INTERPRET_OK,
+            "Slot-indexed globals should be defined and assigned.");
+    Value value;
+    Require(fixture.vm.globalTable().get(name, &value) && isNumber(value) && asNumber(value) == 3.0,
+            "The name-keyed view should observe writes made through global slots.");
+
+    fixture.vm.globalTable().set(name, Value(10.0));
+    Require(fixture.vm.interpret("slotCounter = slotCounter * 2;") == InterpretResult::INTERPRET_OK &&
+                fixture.vm.globalTable().get(name, &value) && asNumber(value) == 20.0,
+            "Compiled code should observe writes made through the name-keyed view.");
+
+    fixture.vm.globalTable().remove(name);
+    Require(!fixture.vm.globalTable().get(name, &value) &&
+                fixture.vm.interpret("slotCounter = 1;") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+            "Removed globals should be undefined for both views.");
+    fixture.vm.resetStack();
+}
+
+void InstancesShareShapesUntilDictionaryMode()
+{
+    RuntimeFixture fixture;
+    Require(fixture.vm.interpret(
+                "class ShapePoint { init(x, y) { this.x = x; this.y = y; } }"
+                "var shapeA = ShapePoint(1, 2); var shapeB = ShapePoint(3, 4); shapeB.z = 5;"
+                "var shapeSum = shapeA.x + shapeA.y + shapeB.x + shapeB.y + shapeB.z;") ==
+                InterpretResult::INTERPRET_OK,
+            "Instances with declared and added fields should execute.");
+    Value a;
+    Value b;
+    Value sum;
+    Require(fixture.vm.globalTable().get(copyString("shapeA", 6), &a) &&
+                fixture.vm.globalTable().get(copyString("shapeB", 6), &b) &&
+                fixture.vm.globalTable().get(copyString("shapeSum", 8), &sum) &&
+                asNumber(sum) == 15.0,
+            "Fields should read back the values that were stored.");
+    ObjInstance* first = asInstance(a);
+    ObjInstance* second = asInstance(b);
+    Require(first->shape && second->shape && first->shape->names.size() == 2 &&
+                second->shape->names.size() == 3 && second->klass->slotHint == 3 &&
+                first->slots.size() == 2,
+            "Instances should keep their fields in shape slots.");
+
+    ObjInstance* wide = newInstance(first->klass);
+    ScopedGcRoot wideRoot(fixture.vm, Value(wide));
+    Require(wide->slots.isInline() && wide->slots.capacity() == 3,
+            "New instances should have inline room for the widest shape of their class.");
+    for (size_t i = 0; i <= ObjClass::MAX_SHAPE_SLOTS; ++i)
+    {
+        const std::string field = "field" + std::to_string(i);
+        wide->setField(copyString(field.c_str(), static_cast<int>(field.size())), Value(static_cast<double>(i)));
+    }
+    Value last;
+    Value firstField;
+    Require(!wide->shape && wide->dictionary &&
+                wide->getField(copyString("field0", 6), &firstField) && asNumber(firstField) == 0.0 &&
+                wide->getField(copyString("field64", 7), &last) && asNumber(last) == 64.0,
+            "Instances beyond the shape slot limit should fall back to a dictionary.");
+}
+
+void InlineCachesTrackPropertyAccess()
+{
+    RuntimeFixture fixture;
+    Require(fixture.vm.interpret(
+                "class CachedPoint { init(x) { this.x = x; } get() { return this.x; } }"
+                "fun cachedRead(p) { return p.get() + p.x; }"
+                "var cachedPoint = CachedPoint(2);") == InterpretResult::INTERPRET_OK,
+            "The cached access fixture should compile.");
+    fixture.vm.resetInlineCacheStats();
+    Require(fixture.vm.interpret(
+                "var cachedSum = 0;"
+                "for (var i = 0; i < 10; i = i + 1) { cachedSum = cachedSum + cachedRead(cachedPoint); }") ==
+                InterpretResult::INTERPRET_OK,
+            "Repeated property reads and invokes should execute.");
+    Value sum;
+    const InlineCacheStats& stats = fixture.vm.getInlineCacheStats();
+    Require(fixture.vm.globalTable().get(copyString("cachedSum", 9), &sum) && asNumber(sum) == 40.0,
+            "Cached accesses should read the right values.");
+    Require(stats.misses == 3 && stats.hits == 27 && stats.megamorphic == 0,
+            "Each access site should miss once and then hit its inline cache.");
+
+    fixture.vm.resetInlineCacheStats();
+    Require(fixture.vm.interpret(
+                "class ShapeA { init() { this.v = 1; } } class ShapeB { init() { this.w = 0; this.v = 2; } }"
+                "class ShapeC { init() { this.v = 3; } } class ShapeD { init() { this.v = 4; } }"
+                "class ShapeE { init() { this.v = 5; } }"
+                "fun readV(o) { return o.v; }"
+                "var polySum = readV(ShapeA()) + readV(ShapeB()) + readV(ShapeC()) + readV(ShapeD()) + readV(ShapeE()) + readV(ShapeA());") ==
+                InterpretResult::INTERPRET_OK &&
+                fixture.vm.globalTable().get(copyString("polySum", 7), &sum) && asNumber(sum) == 16.0,
+            "Polymorphic and megamorphic property reads should keep their values.");
+    Require(fixture.vm.getInlineCacheStats().megamorphic > 0,
+            "A site that sees more shapes than the cache holds should go megamorphic.");
+}
+
+void SuperinstructionsMatchPlainBytecode()
+{
+    RuntimeFixture fixture;
+    Compiler& compiler = fixture.vm.getCompiler();
+    const bool wasEnabled = compiler.enableSuperinstructions;
+
+    auto runVariant = [&](const std::string& prefix, bool enabled, double& sum, std::string& joined)
+    {
+        compiler.enableSuperinstructions = enabled;
+        const std::string source =
+            "fun " + prefix + "Sum(n) { var total = 0; var step = 2;"
+            "  for (var i = 0; i < n; i = i + 1) { var doubled = i * step; total = total + doubled;"
+            "    if (doubled - i < 5) { total = total - 1; } }"
+            "  return total; }"
+            "fun " + prefix + "Join(a, b) { return a + b; }"
+            "fun " + prefix + "Less(a, b) { return a < b; }"
+            "var " + prefix + "SumResult = " + prefix + "Sum(10);"
+            "var " + prefix + "JoinResult = " + prefix + "Join(\"a\", 1);";
+        Require(fixture.vm.interpret(source) == InterpretResult::INTERPRET_OK,
+                "Both bytecode variants should execute.");
+        Value value;
+        Require(fixture.vm.globalTable().get(copyString((prefix + "SumResult").c_str(), static_cast<int>(prefix.size()) + 9), &value),
+                "The loop result should be stored.");
+        sum = asNumber(value);
+        Require(fixture.vm.globalTable().get(copyString((prefix + "JoinResult").c_str(), static_cast<int>(prefix.size()) + 10), &value),
+                "The concatenation result should be stored.");
+        joined = asString(value)->chars;
+        Require(fixture.vm.interpret(prefix + "Less(\"a\", 1);") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+                "Comparing a string with a number should fail in both variants.");
+    };
+
+    double fusedSum = 0.0;
+    double plainSum = 0.0;
+    std::string fusedJoin;
+    std::string plainJoin;
+    runVariant("fused", true, fusedSum, fusedJoin);
+    runVariant("plain", false, plainSum, plainJoin);
+    compiler.enableSuperinstructions = wasEnabled;
+
+    Require(fusedSum == 85.0 && plainSum == 85.0 && fusedJoin == "a1" && plainJoin == "a1",
+            "Fused and plain bytecode should produce the same results.");
+
+    auto countFused = [&](const char* name, int nameLength)
+    {
+        Value function;
+        Require(fixture.vm.globalTable().get(copyString(name, nameLength), &function) && isClosure(function),
+                "The compiled function should be a global.");
+        const Chunk& chunk = asClosure(function)->function->chunk;
+        int fused = 0;
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset))
+        {
+            const uint8_t instruction = chunk.code[offset];
+            if (instruction >= OpByte(OpCode::OP_POPN) && instruction <= OpByte(OpCode::OP_RANGE_LOCALS_JUMP_IF_FALSE)) ++fused;
+        }
+        Require(chunk.lines.size() == chunk.code.size(), "Every code byte should keep a line.");
+        return fused;
+    };
+    Require(countFused("fusedSum", 8) >= 4 && countFused("plainSum", 8) == 0,
+            "Only the enabled variant should contain superinstructions.");
+}
+
+void NumberPinsUseNumberOpcodes()
+{
+    RuntimeFixture fixture;
+    Script script;
+    script.ID = fixture.ids.GetNextId();
+    script.main = std::make_shared<ScriptFunction>(fixture.ids.GetNextId(), "NumberOpcodesMain");
+
+    ScriptPropertyPtr numberSum = std::make_shared<ScriptProperty>(fixture.ids.GetNextId(), "NumberSum");
+    numberSum->type = PinType::Float;
+    numberSum->defaultValue = Value(0.0);
+    script.variables.push_back(numberSum);
+    ScriptPropertyPtr greeting = std::make_shared<ScriptProperty>(fixture.ids.GetNextId(), "DynamicGreeting");
+    greeting->defaultValue = Value(copyString("n=", 2));
+    script.variables.push_back(greeting);
+    ScriptPropertyPtr dynamicSum = std::make_shared<ScriptProperty>(fixture.ids.GetNextId(), "DynamicSum");
+    script.variables.push_back(dynamicSum);
+
+    NodePtr begin = BuildBeginNode(fixture.ids, script.main);
+    NodePtr numberAdd = fixture.registry.FindCompiled("Math::Add")->MakeNode(fixture.ids);
+    numberAdd->Inputs[0].LiteralValue = Value(2.0);
+    numberAdd->Inputs[1].LiteralValue = Value(3.0);
+    NodePtr dynamicAdd = fixture.registry.FindCompiled("Math::Add")->MakeNode(fixture.ids);
+    dynamicAdd->Inputs[1].LiteralValue = Value(4.0);
+    NodePtr getGreeting = BuildGetVariableNode(fixture.ids, greeting);
+    NodePtr storeNumber = BuildSetVariableNode(fixture.ids, numberSum);
+    NodePtr storeDynamic = BuildSetVariableNode(fixture.ids, dynamicSum);
+    for (const NodePtr& node : { begin, numberAdd, dynamicAdd, getGreeting, storeNumber, storeDynamic })
+        AttachNode(script.main->Graph, node);
+    script.main->Graph.AddLink(Link(fixture.ids.GetNextId(), begin->Outputs[0].ID, storeNumber->Inputs[0].ID));
+    script.main->Graph.AddLink(Link(fixture.ids.GetNextId(), numberAdd->Outputs[0].ID, storeNumber->Inputs[1].ID));
+    script.main->Graph.AddLink(Link(fixture.ids.GetNextId(), storeNumber->Outputs[0].ID, storeDynamic->Inputs[0].ID));
+    script.main->Graph.AddLink(Link(fixture.ids.GetNextId(), getGreeting->Outputs[0].ID, dynamicAdd->Inputs[0].ID));
+    script.main->Graph.AddLink(Link(fixture.ids.GetNextId(), dynamicAdd->Outputs[0].ID, storeDynamic->Inputs[1].ID));
+
+    fixture.vm.setExternalMarkingFunc([&]()
+    {
+        MarkNodeRegistryRoots(fixture.registry, fixture.vm);
+        ScriptUtils::MarkScriptRoots(script);
+    });
+    ScriptCompileOptions options;
+    options.enableConstantFolding = false;
+    options.enableSuperinstructions = false;
+    const ScriptCompileResult compiled = ScriptRuntime::Compile(fixture.vm, script, options);
+    Require(static_cast<bool>(compiled), "The typed arithmetic script should compile.");
+
+    int numberAdds = 0;
+    int genericAdds = 0;
+    const Chunk& chunk = compiled.function->chunk;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset))
+    {
+        if (chunk.code[offset] == OpByte(OpCode::OP_ADD_NUM)) ++numberAdds;
+        if (chunk.code[offset] == OpByte(OpCode::OP_ADD)) ++genericAdds;
+    }
+    Require(numberAdds == 1 && genericAdds == 1,
+            "Only the Add with two number inputs should use the number-only opcode.");
+
+    Require(ScriptRuntime::Execute(fixture.vm, compiled.function) == InterpretResult::INTERPRET_OK,
+            "The typed arithmetic script should execute.");
+    Value value;
+    Require(fixture.vm.globalTable().get(copyString("NumberSum", 9), &value) && isNumber(value) && asNumber(value) == 5.0,
+            "The number-only add should produce the sum.");
+    Require(fixture.vm.globalTable().get(copyString("DynamicSum", 10), &value) && isString(value) &&
+                asString(value)->chars == "n=4",
+            "An Any input should keep the generic add.");
+}
+
+void QuickenedInstructionsDeoptimizeOnNewTypes()
+{
+    RuntimeFixture fixture;
+    Compiler& compiler = fixture.vm.getCompiler();
+    const bool wasEnabled = compiler.enableSuperinstructions;
+    // Keep the plain instructions so the generic forms are the ones that run first.
+    compiler.enableSuperinstructions = false;
+    const InterpretResult defined = fixture.vm.interpret(
+        "class QuickPoint { init(x) { this.x = x; } }"
+        "class QuickOther { init(x) { this.y = 0; this.x = x; } }"
+        "fun quickAdd(a, b) { return a + b; }"
+        "fun quickIndex(source, index) { return source[index]; }"
+        "fun quickField(point) { return point.x; }"
+        "fun quickRemainder(a, b) { return a % b == 1; }");
+    compiler.enableSuperinstructions = wasEnabled;
+    Require(defined == InterpretResult::INTERPRET_OK, "The quickening fixture should compile.");
+
+    auto hasInstruction = [&](const char* name, OpCode instruction)
+    {
+        const Chunk& chunk = asClosure(ReadGlobal(fixture.vm, name))->function->chunk;
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset))
+        {
+            if (chunk.code[offset] == OpByte(instruction)) return true;
+        }
+        return false;
+    };
+
+    Require(fixture.vm.interpret(
+                "var quickSum = 0; var quickItem = nil; var quickX = 0; var quickList = [1, 2, 3]; var quickPoint = QuickPoint(5);"
+                "for (var i = 0; i < 20; i = i + 1) {"
+                "  quickSum = quickAdd(quickSum, i); quickItem = quickIndex(quickList, 1); quickX = quickField(quickPoint);"
+                "  quickRemainder(i, 4); }") ==
+                InterpretResult::INTERPRET_OK,
+            "Stable operand types should execute.");
+    Require(asNumber(ReadGlobal(fixture.vm, "quickSum")) == 190.0 && asNumber(ReadGlobal(fixture.vm, "quickItem")) == 2.0 && asNumber(ReadGlobal(fixture.vm, "quickX")) == 5.0,
+            "Quickened instructions should produce the generic results.");
+    Require(hasInstruction("quickAdd", OpCode::OP_ADD_NUM) && hasInstruction("quickIndex", OpCode::OP_INDEX_LIST) &&
+                hasInstruction("quickField", OpCode::OP_GET_PROPERTY_SLOT) && hasInstruction("quickRemainder", OpCode::OP_MODULO_NUM) &&
+                hasInstruction("quickRemainder", OpCode::OP_EQUAL_NUM),
+            "Instructions that keep seeing the same operand types should be quickened.");
+
+    Require(fixture.vm.interpret(
+                "var quickText = quickAdd(\"a\", \"b\");"
+                "var quickFieldItem = quickIndex(QuickPoint(7), \"x\");"
+                "var quickOtherX = quickField(QuickOther(9));"
+                "var quickOdd = quickRemainder(5, 2);") == InterpretResult::INTERPRET_OK,
+            "New operand types should execute after quickening.");
+    Require(fixture.vm.interpret("quickRemainder(nil, 2);") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+            "Operands the generic instruction rejects should still be runtime errors after quickening.");
+    Require(asString(ReadGlobal(fixture.vm, "quickText"))->chars == "ab" && asNumber(ReadGlobal(fixture.vm, "quickFieldItem")) == 7.0 &&
+                asNumber(ReadGlobal(fixture.vm, "quickOtherX")) == 9.0,
+            "A failed guard should fall back to the generic instruction.");
+    Require(hasInstruction("quickAdd", OpCode::OP_ADD) && hasInstruction("quickIndex", OpCode::OP_INDEX_SUBSCR) &&
+                hasInstruction("quickField", OpCode::OP_GET_PROPERTY) && hasInstruction("quickRemainder", OpCode::OP_MODULO) &&
+                asBoolean(ReadGlobal(fixture.vm, "quickOdd")),
+            "A failed guard should put the generic instruction back.");
+}
+
+void RegisterTierMatchesStackInterpreter()
+{
+    RuntimeFixture fixture;
+    Compiler& compiler = fixture.vm.getCompiler();
+    const bool wasEnabled = compiler.enableRegisterTier;
+
+    auto runVariant = [&](const std::string& prefix, bool registers)
+    {
+        compiler.enableRegisterTier = registers;
+        const std::string source =
+            "class " + prefix + "Point { init(x) { this.x = x; } }"
+            "fun " + prefix + "Fib(n) { if (n < 2) return n; return " + prefix + "Fib(n - 2) + " + prefix + "Fib(n - 1); }"
+            "fun " + prefix + "Loop(n) { var total = 0;"
+            "  for (var i = 0; i < n; i = i + 1) { if (i > 3 and !(i == 7)) total = total + i * 2; else total = total - 1; }"
+            "  return total; }"
+            "fun " + prefix + "Items(n) { var items = [1, 2, 3]; items[1] = n; return items[0] + items[1] + items[2]; }"
+            "fun " + prefix + "Field(point) { return point.x; }"
+            "fun " + prefix + "CallsStack(n) { return " + prefix + "Field(" + prefix + "Point(n)) + 1; }"
+            "var " + prefix + "Result = " + prefix + "Fib(15) + " + prefix + "Loop(20) + " + prefix + "Items(10) + " + prefix + "CallsStack(4);"
+            "fun " + prefix + "Join(a, b) { return a + b; }"
+            "var " + prefix + "Text = " + prefix + "Join(\"a\", 1);";
+        Require(fixture.vm.interpret(source) == InterpretResult::INTERPRET_OK, "Both interpreters should execute.");
+        Require(fixture.vm.interpret(prefix + "Loop(nil);") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+                "Comparing nil with a number should fail in both interpreters.");
+        Require(fixture.vm.getStackSize() == 0, "A runtime error should reset the stack.");
+
+        const Chunk& fib = asClosure(ReadGlobal(fixture.vm, (prefix + "Fib").c_str()))->function->chunk;
+        const Chunk& field = asClosure(ReadGlobal(fixture.vm, (prefix + "Field").c_str()))->function->chunk;
+        Require(fib.registers.empty() != registers, "Supported functions should only be lowered when the tier is enabled.");
+        Require(field.registers.empty(), "Functions with unsupported instructions should stay on the stack interpreter.");
+        return std::make_pair(asNumber(ReadGlobal(fixture.vm, (prefix + "Result").c_str())),
+                              asString(ReadGlobal(fixture.vm, (prefix + "Text").c_str()))->chars);
+    };
+
+    const auto stackResult = runVariant("stackTier", false);
+    const auto registerResult = runVariant("registerTier", true);
+    compiler.enableRegisterTier = wasEnabled;
+
+    Require(stackResult == registerResult && stackResult.first == 610.0 + 349.0 + 14.0 + 5.0 && stackResult.second == "a1",
+            "The register interpreter should produce the same results as the stack interpreter.");
+}
+
+void DeepMixedTierRecursionIsARuntimeError()
+{
+    RuntimeFixture fixture;
+    Compiler& compiler = fixture.vm.getCompiler();
+    const bool wasEnabled = compiler.enableRegisterTier;
+    compiler.enableRegisterTier = true;
+
+    // The property access keeps tierStack on the stack interpreter, so every call switches tiers.
+    Require(fixture.vm.interpret(
+                "class TierLimit { init() { this.floor = 0; } }"
+                "var tierLimit = TierLimit();"
+                "fun tierRegister(n) { if (n < 1) return 0; return tierStack(n - 1) + 1; }"
+                "fun tierStack(n) { if (n < tierLimit.floor) return 0; return tierRegister(n - 1) + 1; }"
+                "fun tierCount(n) { if (n < 1) return 0; return tierCount(n - 1) + 1; }") == InterpretResult::INTERPRET_OK,
+            "The mixed tier fixture should compile.");
+    compiler.enableRegisterTier = wasEnabled;
+
+    Require(!asClosure(ReadGlobal(fixture.vm, "tierRegister"))->function->chunk.registers.empty() &&
+                asClosure(ReadGlobal(fixture.vm, "tierStack"))->function->chunk.registers.empty(),
+            "The fixture should alternate between the register and stack interpreters.");
+
+    Require(fixture.vm.interpret("var tierShallow = tierRegister(20); var tierFlat = tierCount(60);") == InterpretResult::INTERPRET_OK &&
+                asNumber(ReadGlobal(fixture.vm, "tierShallow")) == 20.0 && asNumber(ReadGlobal(fixture.vm, "tierFlat")) == 60.0,
+            "Recursion within the limits should work across tiers.");
+    Require(fixture.vm.interpret("tierRegister(100000);") == InterpretResult::INTERPRET_RUNTIME_ERROR &&
+                fixture.vm.interpret("tierCount(100000);") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+            "Unbounded recursion should be a stack overflow, not a host crash.");
+    Require(fixture.vm.getStackSize() == 0, "A stack overflow should reset the stack.");
+
+    Require(fixture.vm.interpret("var tierAgain = tierRegister(10) + tierCount(3);") == InterpretResult::INTERPRET_OK &&
+                asNumber(ReadGlobal(fixture.vm, "tierAgain")) == 13.0,
+            "The VM should keep working after a stack overflow.");
+}
+
+void JitMatchesRegisterInterpreter()
+{
+    RuntimeFixture fixture;
+    Compiler& compiler = fixture.vm.getCompiler();
+    const bool wasRegisterTierEnabled = compiler.enableRegisterTier;
+    const bool wasJitEnabled = compiler.enableJit;
+
+    // Enough calls and loop iterations for the JIT threshold, so hot functions are compiled
+    // both on entry and halfway through a loop.
+    auto runVariant = [&](const std::string& prefix, bool jit)
+    {
+        compiler.enableRegisterTier = true;
+        compiler.enableJit = jit;
+        const std::string source =
+            "fun " + prefix + "Fib(n) { if (n < 2) return n; return " + prefix + "Fib(n - 2) + " + prefix + "Fib(n - 1); }"
+            "fun " + prefix + "Loop(n) { var total = 0; var nan = 0 / 0; var items = [1, 2, 3];"
+            "  for (var i = 0; i < n; i = i + 1) {"
+            "    if (i > 3 and !(i == 7)) total = total + i * 2 - items[(i > 5) and 1 or 2] / 4; else total = total - 1;"
+            "    if (i < nan or nan == nan or -i > 0) total = total + 1000; items[1] = -total; }"
+            "  return total; }"
+            "fun " + prefix + "Join(text, n) { var result = text; for (var i = 0; i < n; i = i + 1) { result = result + \"x\"; } return result; }"
+            "var " + prefix + "Result = " + prefix + "Fib(18) + " + prefix + "Loop(3000);"
+            "var " + prefix + "Text = " + prefix + "Join(\"a\", 1500);";
+        Require(fixture.vm.interpret(source) == InterpretResult::INTERPRET_OK, "Both tiers should execute.");
+        Require(fixture.vm.interpret(prefix + "Loop(nil);") == InterpretResult::INTERPRET_RUNTIME_ERROR,
+                "Comparing nil with a number should fail in compiled code too.");
+        Require(fixture.vm.getStackSize() == 0, "A runtime error should reset the stack.");
+
+        const Chunk& fib = asClosure(ReadGlobal(fixture.vm, (prefix + "Fib").c_str()))->function->chunk;
+        const Chunk& loop = asClosure(ReadGlobal(fixture.vm, (prefix + "Loop").c_str()))->function->chunk;
+        const bool compiled = jit && isJitAvailable();
+        Require((fib.registers.jit != nullptr) == compiled && (loop.registers.jit != nullptr) == compiled,
+                "Hot functions should only be compiled when the JIT is enabled and available.");
+        return std::make_pair(asNumber(ReadGlobal(fixture.vm, (prefix + "Result").c_str())),
+                              asString(ReadGlobal(fixture.vm, (prefix + "Text").c_str()))->chars);
+    };
+
+    const auto interpreted = runVariant("interpretedTier", false);
+    const auto compiled = runVariant("compiledTier", true);
+    compiler.enableRegisterTier = wasRegisterTierEnabled;
+    compiler.enableJit = wasJitEnabled;
+
+    Require(interpreted == compiled && interpreted.second.size() == 1501,
+            "Compiled code should produce the same results as the register interpreter.");
+}
+
+void HeapAllocatorReusesAndReleasesSlabs()
+{
+    HeapAllocator heap;
+    void* first = heap.allocate(40);
+    void* second = heap.allocate(40);
+    Require(first != second && reinterpret_cast<uintptr_t>(second) % HeapAllocator::GRANULARITY == 0,
+            "Small objects should get distinct aligned slots.");
+    heap.deallocate(second, 40);
+    Require(heap.allocate(40) == second, "A freed slot should be reused by the next allocation of its size class.");
+    Require(heap.reallocate(first, 40, 48) == first, "Growing within the size class should keep the slot.");
+
+    std::vector<void*> objects;
+    for (int i = 0; i < 5000; ++i)
+        objects.push_back(heap.allocate(100));
+    void* large = heap.allocate(HeapAllocator::MAX_SMALL_SIZE + 1);
+    Require(heap.getStats().slabCount > 2 && heap.getStats().liveBytes == 48 + 40 + 5000 * 100 + HeapAllocator::MAX_SMALL_SIZE + 1,
+            "Allocations should spread over several slabs.");
+
+    for (void* object : objects)
+        heap.deallocate(object, 100);
+    heap.deallocate(large, HeapAllocator::MAX_SMALL_SIZE + 1);
+    heap.deallocate(first, 48);
+    heap.deallocate(second, 40);
+    const AllocatorStats beforeRelease = heap.getStats();
+    heap.releaseEmptySlabs(HeapAllocator::SLAB_SIZE);
+    Require(beforeRelease.liveBytes == 0 && beforeRelease.slabsReleased == 0 && beforeRelease.reservedBytes == beforeRelease.peakReservedBytes - HeapAllocator::MAX_SMALL_SIZE - 1,
+            "Empty slabs should be kept until they are released.");
+    Require(heap.getStats().slabCount == 1 && heap.getStats().reservedBytes == HeapAllocator::SLAB_SIZE,
+            "Releasing should only keep the requested amount of empty slabs.");
+
+    RuntimeFixture fixture;
+    fixture.vm.allowGarbageCollection(true);
+    Require(fixture.vm.interpret("var heapGarbage = 0; for (var i = 0; i < 2000; i = i + 1) { heapGarbage = [i, [i, i]]; }") ==
+                InterpretResult::INTERPRET_OK,
+            "The allocation loop should execute.");
+    fixture.vm.collectGarbage();
+    Require(fixture.vm.getHeap().getStats().liveBytes == fixture.vm.getAllocatedBytes(),
+            "The VM heap should account for exactly the objects the collector tracks.");
+}
+
+void YoungCollectionsKeepObjectsReachableFromOldOnes()
+{
+    RuntimeFixture fixture;
+    fixture.vm.allowGarbageCollection(true);
+    // Everything the first script leaves behind is old once it returns.
+    Require(fixture.vm.interpret(
+                "class YoungBox { init() { this.value = nil; } }"
+                "var youngBox = YoungBox(); var youngList = [nil, nil];"
+                "fun makeYoungCell() { var cell = nil; fun set(value) { cell = value; } fun get() { return cell; } youngBox.value = get; return set; }"
+                "var setYoungCell = makeYoungCell(); var getYoungCell = youngBox.value;"
+                "fun allocateYoungObjects() {"
+                "  for (var i = 0; i < 20000; i = i + 1) {"
+                "    var garbage = [i, [i, i], \"young\" + i];"
+                "    if (i == 100) { youngBox.value = [i, \"box\" + i]; youngList[1] = YoungBox(); setYoungCell([i, \"cell\" + i]); } } }") ==
+                InterpretResult::INTERPRET_OK,
+            "The old objects should be created.");
+
+    // Called directly so that compiling a script doesn't count as a collection of its own.
+    const uint64_t youngBefore = fixture.vm.getYoungCollectionCount();
+    const uint64_t fullBefore = fixture.vm.getFullCollectionCount();
+    callFunction(&fixture.vm, ReadGlobal(fixture.vm, "allocateYoungObjects"));
+    fixture.vm.resetStack();
+    // What survives a young collection is promoted, which can still add up to a full one now and then.
+    const uint64_t youngCollections = fixture.vm.getYoungCollectionCount() - youngBefore;
+    const uint64_t fullCollections = fixture.vm.getFullCollectionCount() - fullBefore;
+    Require(youngCollections > 0 && fullCollections * 100 < youngCollections,
+            "Short-lived garbage should mostly need young collections.");
+
+    const Value boxed = asInstance(ReadGlobal(fixture.vm, "youngBox"))->slots[0];
+    const Value listed = asList(ReadGlobal(fixture.vm, "youngList"))->getValue(1);
+    Require(isList(boxed) && asNumber(asList(boxed)->getValue(0)) == 100.0 && asString(asList(boxed)->getValue(1))->chars == "box100" &&
+                isInstance(listed) && asInstance(listed)->klass == asClass(ReadGlobal(fixture.vm, "YoungBox")),
+            "Young objects stored into old ones should survive young collections.");
+    Require(fixture.vm.interpret("var youngCell = getYoungCell();") == InterpretResult::INTERPRET_OK &&
+                asString(asList(ReadGlobal(fixture.vm, "youngCell"))->getValue(1))->chars == "cell100",
+            "Young objects stored into a closed upvalue should survive young collections.");
+
+    fixture.vm.collectGarbage();
+    Require(fixture.vm.getHeap().getStats().liveBytes == fixture.vm.getAllocatedBytes(),
+            "Promoted objects should still be accounted for by the heap.");
+}
+
+void IncrementalCollectionsBoundTheirPauses()
+{
+    RuntimeFixture fixture;
+    fixture.vm.setExternalMarkingFunc([&]()
+    {
+        MarkNodeRegistryRoots(fixture.registry, fixture.vm);
+    });
+    fixture.vm.allowGarbageCollection(true);
+    Require(fixture.vm.interpret(
+                "class Cell { init(value, next) { this.value = value; this.next = next; } }"
+                "var cells = nil;"
+                "var checksum = 0;"
+                "fun growCells(count) { for (var i = 0; i < count; i = i + 1) { cells = Cell([i, i * 2], cells); } }"
+                "fun countCells() { var count = 0; var total = 0; for (var cell = cells; cell != nil; cell = cell.next) {"
+                "  count = count + 1; total = total + cell.value[0]; } checksum = count * 1000000000 + total; }"
+                "growCells(200000);") == InterpretResult::INTERPRET_OK,
+            "The heap should be built.");
+
+    // Growing the heap starts full collections on its own, which now run in steps.
+    fixture.vm.setGcPauseBudget(std::chrono::microseconds(500));
+    const Value growCells = ReadGlobal(fixture.vm, "growCells");
+    const uint64_t fullBefore = fixture.vm.getFullCollectionCount();
+    double cellCount = 200000.0;
+    while (fixture.vm.getFullCollectionCount() < fullBefore + 2 && cellCount < 2000000.0)
+    {
+        callFunction(&fixture.vm, growCells, Value(10000.0));
+        fixture.vm.resetStack();
+        cellCount += 10000.0;
+    }
+    const std::chrono::nanoseconds incrementalPause = fixture.vm.getLastGcMaxPause();
+    fixture.vm.setGcPauseBudget(std::chrono::nanoseconds::zero());
+    fixture.vm.collectGarbage();
+    const std::chrono::nanoseconds stopTheWorldPause = fixture.vm.getLastGcMaxPause();
+
+    Require(fixture.vm.getFullCollectionCount() >= fullBefore + 2, "Growing the heap should finish incremental collections.");
+    Require(incrementalPause * 3 < stopTheWorldPause,
+            "Incremental collections should pause for a fraction of a whole collection of the same heap.");
+    const double expected = cellCount * 1000000000.0 + (200000.0 * 199999.0 + (cellCount - 200000.0) * 9999.0) / 2.0;
+    callFunction(&fixture.vm, ReadGlobal(fixture.vm, "countCells"));
+    fixture.vm.resetStack();
+    const double checksum = asNumber(ReadGlobal(fixture.vm, "checksum"));
+    // The VM is shared with the later tests.
+    fixture.vm.interpret("cells = nil;");
+    fixture.vm.resetStack();
+    Require(checksum == expected,
+            "Objects reachable while a collection marked in steps should survive it.");
+}
+
 void InstanceErrorsDoNotChangeDefinitionCapabilities()
 {
     RuntimeFixture fixture;
@@ -871,6 +1440,14 @@ void PureNodesAreConstantFolded()
     Require(ScriptRuntime::Execute(fixture.vm, compiled.function) ==
                 InterpretResult::INTERPRET_OK,
             "The folded script should execute successfully.");
+
+    // Folding a new node, as the editor does after every edit, reuses the scratch global.
+    const size_t globalSlots = fixture.vm.globalTable().getSlotCount();
+    add->ID = fixture.ids.GetNextId();
+    const ScriptCompileResult recompiled = ScriptRuntime::Compile(fixture.vm, script);
+    Require(static_cast<bool>(recompiled) && !recompiled.foldedNodeIds.empty() &&
+                fixture.vm.globalTable().getSlotCount() == globalSlots,
+            "Constant folding should not leave a global slot behind for every folded node.");
 }
 
 void ForInKeepsConstantStackFootprint()
@@ -3341,6 +3918,19 @@ void AddRuntimeTests(Tests::Runner& runner)
         runner.Test("GC tracks concrete object sizes", GarbageCollectionTracksConcreteObjectSizes);
         runner.Test("compiler temporaries survive GC", CompilerTemporariesSurviveGarbageCollection);
         runner.Test("large list literals preserve their items", LargeListLiteralsPreserveItems);
+        runner.Test("values round-trip through their encoding", ValuesRoundTripThroughTheirEncoding);
+        runner.Test("global slots stay visible by name", GlobalSlotsStayVisibleByName);
+        runner.Test("instances share shapes until dictionary mode", InstancesShareShapesUntilDictionaryMode);
+        runner.Test("inline caches track property access", InlineCachesTrackPropertyAccess);
+        runner.Test("superinstructions match plain bytecode", SuperinstructionsMatchPlainBytecode);
+        runner.Test("number pins use number opcodes", NumberPinsUseNumberOpcodes);
+        runner.Test("quickened instructions deoptimize on new types", QuickenedInstructionsDeoptimizeOnNewTypes);
+        runner.Test("register tier matches the stack interpreter", RegisterTierMatchesStackInterpreter);
+        runner.Test("deep mixed tier recursion is a runtime error", DeepMixedTierRecursionIsARuntimeError);
+        runner.Test("JIT matches the register interpreter", JitMatchesRegisterInterpreter);
+        runner.Test("heap allocator reuses and releases slabs", HeapAllocatorReusesAndReleasesSlabs);
+        runner.Test("young collections keep objects reachable from old ones", YoungCollectionsKeepObjectsReachableFromOldOnes);
+        runner.Test("incremental collections bound their pauses", IncrementalCollectionsBoundTheirPauses);
         runner.Test("Flow For In keeps a constant stack footprint", ForInKeepsConstantStackFootprint);
         runner.Test("Flow For In iterates ranges and strings",
             ForInIteratesRangesAndStrings);
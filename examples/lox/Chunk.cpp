@@ -38,3 +38,50 @@ uint32_t Chunk::addConstant(Value value)
     VM::getInstance().pop();
     return static_cast<uint32_t>(constants.values.size() - 1);
 }
+
+InlineCache& Chunk::addInlineCache(size_t offset)
+{
+    inlineCacheOffsets.insert(findInlineCacheOffset(offset),
+        { static_cast<uint32_t>(offset), static_cast<uint32_t>(inlineCaches.size()) });
+    inlineCaches.emplace_back();
+    return inlineCaches.back();
+}
+
+void Chunk::countQuickening(size_t offset, OpCode specialized)
+{
+    if (quickening.size() != code.size())
+    {
+        quickening.resize(code.size());
+    }
+
+    QuickeningState& state = quickening[offset];
+    if (state.candidate != specialized)
+    {
+        state.candidate = specialized;
+        state.hits = 0;
+    }
+
+    if (++state.hits < QuickeningState::WARMUP)
+    {
+        return;
+    }
+
+    state.hits = 0;
+    code[offset] = static_cast<uint8_t>(specialized);
+}
+
+void Chunk::deoptimize(size_t offset, OpCode generic)
+{
+    if (quickening.size() != code.size())
+    {
+        quickening.resize(code.size());
+    }
+
+    QuickeningState& state = quickening[offset];
+    state.hits = 0;
+    if (state.deopts < QuickeningState::MAX_DEOPTS)
+    {
+        state.deopts++;
+    }
+    code[offset] = static_cast<uint8_t>(generic);
+}
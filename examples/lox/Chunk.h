@@ -2,9 +2,12 @@
 #define loxcpp_chunk_h
 
 #include <vector>
+#include <array>
+#include <algorithm>
 
 #include "Common.h"
 #include "Value.h"
+#include "RegisterChunk.h"
 
 enum class OpCode : uint8_t
 {
@@ -75,11 +78,101 @@ enum class OpCode : uint8_t
     OP_DEBUG_BREAK,
     OP_DEBUG_VALUE,
 
+    // Superinstructions, only emitted by fuseSuperinstructions()
+    OP_POPN,
+    OP_INCREMENT_LOCAL,
+    OP_ADD_LOCALS,
+    OP_SUBTRACT_LOCALS,
+    OP_MULTIPLY_LOCALS,
+    OP_LESS_LOCALS,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_LESS_LOCALS_JUMP_IF_FALSE,
+    OP_RANGE_LOCALS_JUMP_IF_FALSE,
+
+    // Emitted when both operands are statically numbers
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+
+    // Quickened forms, rewritten in place at runtime by Chunk::quicken()
+    OP_ADD_STRING,
+    OP_INDEX_LIST,
+    OP_GET_PROPERTY_SLOT,
+    OP_MODULO_NUM,
+    OP_EQUAL_NUM,
+
     COUNT
 };
 
 typedef std::vector<uint8_t> ChunkInstructions;
 
+struct Shape;
+struct ObjClass;
+
+struct InlineCacheEntry
+{
+    const Shape* shape = nullptr;
+    // Set when a property store adds the field and moves the instance to a new shape.
+    Shape* nextShape = nullptr;
+    // Field slot, or -1 when the name resolved to a class method.
+    int slot = -1;
+    // Keeps the class that owns the shape alive, so the shape address can't be reused.
+    ObjClass* klass = nullptr;
+    Value method;
+};
+
+// Remembers how a property or invoke instruction resolved for the last few
+// shapes it has seen. After that it goes megamorphic and stops caching.
+struct InlineCache
+{
+    static constexpr uint8_t MAX_ENTRIES = 4;
+
+    const InlineCacheEntry* find(const Shape* shape) const
+    {
+        for (uint8_t i = 0; i < count; ++i)
+        {
+            if (entries[i].shape == shape) return &entries[i];
+        }
+        return nullptr;
+    }
+
+    void add(const InlineCacheEntry& entry)
+    {
+        if (count == MAX_ENTRIES)
+        {
+            megamorphic = true;
+            return;
+        }
+        entries[count++] = entry;
+    }
+
+    std::array<InlineCacheEntry, MAX_ENTRIES> entries;
+    uint8_t count = 0;
+    bool megamorphic = false;
+};
+
+// Points the instruction at offset to its entry in Chunk::inlineCaches.
+struct InlineCacheOffset
+{
+    uint32_t offset;
+    uint32_t cache;
+};
+
+// Tracks how often a generic instruction saw operands its quickened form could handle.
+struct QuickeningState
+{
+    static constexpr uint8_t WARMUP = 8;
+    // Sites that keep failing their guards stay generic.
+    static constexpr uint8_t MAX_DEOPTS = 4;
+
+    uint8_t hits = 0;
+    uint8_t deopts = 0;
+    // The specialized instruction the hits were counted for.
+    OpCode candidate = OpCode::COUNT;
+};
+
 struct Chunk
 {
     Chunk();
@@ -89,9 +182,48 @@ struct Chunk
 
     uint32_t addConstant(Value value);
 
+    // Caches are added the first time the instruction at the given offset runs.
+    InlineCache* findInlineCache(size_t offset)
+    {
+        const auto found = findInlineCacheOffset(offset);
+        if (found != inlineCacheOffsets.end() && found->offset == offset)
+        {
+            return &inlineCaches[found->cache];
+        }
+        return nullptr;
+    }
+    InlineCache& addInlineCache(size_t offset);
+    std::vector<InlineCacheOffset>::iterator findInlineCacheOffset(size_t offset)
+    {
+        return std::lower_bound(inlineCacheOffsets.begin(), inlineCacheOffsets.end(), offset,
+            [](const InlineCacheOffset& entry, size_t offset) { return entry.offset < offset; });
+    }
+
+    // Rewrites the generic instruction at offset into the specialized one once it has seen
+    // matching operands WARMUP times in a row. Passing the instruction itself resets the count.
+    void quicken(size_t offset, OpCode specialized)
+    {
+        if (offset < quickening.size() && quickening[offset].deopts >= QuickeningState::MAX_DEOPTS) return;
+        if (static_cast<uint8_t>(specialized) == code[offset])
+        {
+            if (offset < quickening.size()) quickening[offset].hits = 0;
+            return;
+        }
+        countQuickening(offset, specialized);
+    }
+    void countQuickening(size_t offset, OpCode specialized);
+    void deoptimize(size_t offset, OpCode generic);
+
     ChunkInstructions code;
     std::vector<int> lines;
     ValueArray constants;
+    std::vector<InlineCache> inlineCaches;
+    // Which cache belongs to which instruction, sorted by offset. Only instructions that ran have one.
+    std::vector<InlineCacheOffset> inlineCacheOffsets;
+    // One entry per code byte, only instruction starts are used.
+    std::vector<QuickeningState> quickening;
+    // Empty unless the function was lowered with lowerToRegisters().
+    RegisterChunk registers;
 };
 
 #endif
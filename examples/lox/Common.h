@@ -7,6 +7,7 @@
 //#define DEBUG_LOG_GC
 
 //#define FORCE_LONG_OPS
+//#define NAN_BOXING
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
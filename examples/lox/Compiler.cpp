@@ -5,6 +5,8 @@
 
 #include "Debug.h"
 #include "Object.h"
+#include "RegisterChunk.h"
+#include "Superinstructions.h"
 #include "Vm.h"
 
 Precedence nextPrecedence(Precedence precedence) { return static_cast<Precedence>(static_cast<int>(precedence) + 1); }
@@ -32,7 +34,9 @@ CompilerScope::CompilerScope(FunctionType type, CompilerScope* enclosing, Token*
 
     if (type != FunctionType::SCRIPT)
     {
-        function->name = copyString(token->start, token->length);
+        ObjString* name = copyString(token->start, token->length);
+        writeBarrier(function, name);
+        function->name = name;
     }
 
     local.depth = 0;
@@ -238,6 +242,7 @@ void Compiler::emitReturn()
 
 uint32_t Compiler::makeConstant(Value value)
 {
+    writeBarrier(current->function, value);
     return currentChunk()->addConstant(value);
 }
 
@@ -278,7 +283,7 @@ void Compiler::emitVariable(const Token& name, bool shouldAssign, bool ignoreCon
     }
     else
     {
-        arg = identifierConstant(name);
+        arg = globalSlot(name);
         getOp = OpCode::OP_GET_GLOBAL;
         getOpLong = OpCode::OP_GET_GLOBAL_LONG;
         setOp = OpCode::OP_SET_GLOBAL;
@@ -335,6 +340,22 @@ ObjFunction* Compiler::endCompiler()
 {
     emitReturn();
     ObjFunction* function = current->function;
+    // Both passes rewrite the constants and caches a concurrent marker may be reading.
+    snapshotBarrier(function);
+
+    // Lowered from the plain stack code, before it is fused.
+    if (enableRegisterTier && !parser.hadError)
+    {
+        if (lowerToRegisters(*currentChunk(), function->arity))
+        {
+            currentChunk()->registers.jitEnabled = enableJit;
+        }
+    }
+
+    if (enableSuperinstructions && !parser.hadError)
+    {
+        fuseSuperinstructions(*currentChunk());
+    }
 
     #ifdef DEBUG_PRINT_CODE
         if (!parser.hadError)
@@ -490,7 +511,7 @@ void Compiler::namedVariable(const Token& name, bool canAssign)
     }
     else
     {
-        arg = identifierConstant(name);
+        arg = globalSlot(name);
         getOp = OpCode::OP_GET_GLOBAL;
         getOpLong = OpCode::OP_GET_GLOBAL_LONG;
         setOp = OpCode::OP_SET_GLOBAL;
@@ -616,6 +637,11 @@ uint32_t Compiler::identifierConstant(const Token& name)
     return makeConstant(Value(copyString(name.start, name.length)));
 }
 
+uint32_t Compiler::globalSlot(const Token& name)
+{
+    return VM::getInstance().globalTable().resolveSlot(copyString(name.start, name.length));
+}
+
 bool Compiler::identifiersEqual(const Token& a, const Token& b)
 {
     if (a.length != b.length) return false;
@@ -711,9 +737,9 @@ bool Compiler::isUpvalueConst(const CompilerScope& compilerScope, int index)
     return false;
 }
 
-bool Compiler::isGlobalConst(uint8_t index)
+bool Compiler::isGlobalConst(uint32_t slot)
 {
-    return constGlobals.find(index) != constGlobals.end();
+    return constGlobals.find(slot) != constGlobals.end();
 }
 
 void Compiler::addLocal(const Token& name, bool isConstant)
@@ -782,13 +808,13 @@ void Compiler::declareVariableDirectly(bool isConstant, const Token& name)
     declareVariable(isConstant);
     if (current->scopeDepth > 0) return 0;
 
-    const uint32_t constant = identifierConstant(parser.previous);
+    const uint32_t slot = globalSlot(parser.previous);
     if (isConstant)
     {
-        constGlobals.insert(constant);
+        constGlobals.insert(slot);
     }
 
-    return constant;
+    return slot;
 }
 
  uint32_t Compiler::parseVariableDirectly(bool isConstant, const Token& name)
@@ -796,13 +822,13 @@ void Compiler::declareVariableDirectly(bool isConstant, const Token& name)
      declareVariableDirectly(isConstant, name);
      if (current->scopeDepth > 0) return 0;
 
-     const uint32_t constant = identifierConstant(name);
+     const uint32_t slot = globalSlot(name);
      if (isConstant)
      {
-         constGlobals.insert(constant);
+         constGlobals.insert(slot);
      }
 
-     return constant;
+     return slot;
  }
 
  void Compiler::markInitialized()
@@ -932,7 +958,7 @@ inline void Compiler::classDeclaration()
     declareVariable(false);
 
     emitOpWithValue(OpCode::OP_CLASS, OpCode::OP_CLASS_LONG, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(globalSlot(className));
 
     ClassCompilerScope classCompilerScope;
     classCompilerScope.enclosing = currentClass;
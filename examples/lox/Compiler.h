@@ -78,6 +78,20 @@ struct ClassCompilerScope
 
 inline uint8_t OpByte(OpCode opCode) { return static_cast<uint8_t>(opCode); }
 
+// Number-only variant of an operation, or the operation itself when it has none.
+inline OpCode numberVariant(OpCode opCode)
+{
+    switch (opCode)
+    {
+    case OpCode::OP_ADD:      return OpCode::OP_ADD_NUM;
+    case OpCode::OP_SUBTRACT: return OpCode::OP_SUBTRACT_NUM;
+    case OpCode::OP_MULTIPLY: return OpCode::OP_MULTIPLY_NUM;
+    case OpCode::OP_LESS:     return OpCode::OP_LESS_NUM;
+    case OpCode::OP_GREATER:  return OpCode::OP_GREATER_NUM;
+    default:                  return opCode;
+    }
+}
+
 class Compiler
 {
     using ParseFn = void (Compiler::*)(bool canAssign);
@@ -194,13 +208,14 @@ public:
     void list(bool canAssign);
     void parsePrecedence(Precedence precedence);
     uint32_t identifierConstant(const Token& name);
+    uint32_t globalSlot(const Token& name);
     bool identifiersEqual(const Token& a, const Token& b);
     int resolveLocal(const CompilerScope& compilerScope, const Token& name);
     int addUpvalue(CompilerScope& compilerScope, uint8_t index, bool isLocal);
     int resolveUpvalue(CompilerScope& compilerScope, const Token& name);
     bool isLocalConst(const CompilerScope& compilerScope, int index);
     bool isUpvalueConst(const CompilerScope& compilerScope, int index);
-    bool isGlobalConst(uint8_t index);
+    bool isGlobalConst(uint32_t slot);
     void addLocal(const Token& name, bool isConstant);
     void declareVariable(bool isConstant);
     void declareVariableDirectly(bool isConstant, const Token& name);
@@ -243,6 +258,12 @@ public:
     Parser parser;
     CompilerScope compilerData;
     std::set<uint32_t> constGlobals;
+    // Runs fuseSuperinstructions() on every finished function.
+    bool enableSuperinstructions = true;
+    // Runs lowerToRegisters() on every finished function.
+    bool enableRegisterTier = false;
+    // Lets hot lowered functions be compiled to machine code, when lox is built with VLOX_JIT.
+    bool enableJit = false;
 
     CompilerScope* current;
     ClassCompilerScope* currentClass;
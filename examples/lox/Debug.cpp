@@ -4,6 +4,7 @@
 #include "Debug.h"
 #include "Value.h"
 #include "Object.h"
+#include "Vm.h"
 
 uint32_t longConstant(const Chunk& chunk, size_t offset)
 {
@@ -46,6 +47,24 @@ size_t jumpInstruction(const char* name, int sign, const Chunk& chunk, size_t of
     return offset + 3;
 }
 
+size_t localsInstruction(const char* name, const Chunk& chunk, size_t offset)
+{
+    const uint8_t a = chunk.code[offset + 1];
+    const uint8_t b = chunk.code[offset + 2];
+    std::cout << name << " " << +a << " " << +b << std::endl;
+    return offset + 3;
+}
+
+size_t localsJumpInstruction(const char* name, const Chunk& chunk, size_t offset)
+{
+    const uint8_t a = chunk.code[offset + 1];
+    const uint8_t b = chunk.code[offset + 2];
+    const uint16_t jump = *reinterpret_cast<const uint16_t*>(&chunk.code[offset + 3]);
+
+    std::cout << name << " " << +a << " " << +b << " " << +offset << " -> " << (offset + 5 + jump) << std::endl;
+    return offset + 5;
+}
+
 size_t constantInstruction(const std::string& name, const Chunk& chunk, size_t offset)
 {
     const uint8_t constant = chunk.code[offset + 1];
@@ -69,6 +88,27 @@ size_t constantLongInstruction(const std::string& name, const Chunk& chunk, size
     return offset + 5;
 }
 
+size_t globalInstruction(const std::string& name, uint32_t slot, size_t offset)
+{
+    std::cout << name << "  " << +slot << "  ";
+    GlobalTable& globals = VM::getInstance().globalTable();
+    if (slot < globals.getSlotCount())
+        std::cout << globals.getName(slot)->chars;
+
+    std::cout << std::endl;
+    return offset;
+}
+
+size_t globalInstruction(const std::string& name, const Chunk& chunk, size_t offset)
+{
+    return globalInstruction(name, chunk.code[offset + 1], offset + 2);
+}
+
+size_t globalLongInstruction(const std::string& name, const Chunk& chunk, size_t offset)
+{
+    return globalInstruction(name, longConstant(chunk, offset), offset + 5);
+}
+
 size_t invokeInstruction(const std::string& name, const Chunk& chunk, size_t offset)
 {
     uint8_t constant = chunk.code[offset + 1];
@@ -145,17 +185,17 @@ size_t disassembleInstruction(const Chunk& chunk, size_t offset)
     case OpCode::OP_SET_LOCAL_LONG:
         return dwordInstruction("OP_SET_LOCAL_LONG", chunk, offset);
     case OpCode::OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OpCode::OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OpCode::OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OpCode::OP_GET_GLOBAL_LONG:
-        return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        return globalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OpCode::OP_DEFINE_GLOBAL_LONG:
-        return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        return globalLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OpCode::OP_SET_GLOBAL_LONG:
-        return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        return globalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OpCode::OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OpCode::OP_SET_UPVALUE:
@@ -295,10 +335,148 @@ size_t disassembleInstruction(const Chunk& chunk, size_t offset)
         return dwordInstruction("OP_DEBUG_BREAK", chunk, offset);
     case OpCode::OP_DEBUG_VALUE:
         return dwordInstruction("OP_DEBUG_VALUE", chunk, offset);
+    case OpCode::OP_POPN:
+        return byteInstruction("OP_POPN", chunk, offset);
+    case OpCode::OP_INCREMENT_LOCAL:
+        return byteInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OpCode::OP_ADD_LOCALS:
+        return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OpCode::OP_SUBTRACT_LOCALS:
+        return localsInstruction("OP_SUBTRACT_LOCALS", chunk, offset);
+    case OpCode::OP_MULTIPLY_LOCALS:
+        return localsInstruction("OP_MULTIPLY_LOCALS", chunk, offset);
+    case OpCode::OP_LESS_LOCALS:
+        return localsInstruction("OP_LESS_LOCALS", chunk, offset);
+    case OpCode::OP_LESS_JUMP_IF_FALSE:
+        return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OpCode::OP_LESS_LOCALS_JUMP_IF_FALSE:
+        return localsJumpInstruction("OP_LESS_LOCALS_JUMP_IF_FALSE", chunk, offset);
+    case OpCode::OP_RANGE_LOCALS_JUMP_IF_FALSE:
+        return localsJumpInstruction("OP_RANGE_LOCALS_JUMP_IF_FALSE", chunk, offset);
+    case OpCode::OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OpCode::OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OpCode::OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OpCode::OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OpCode::OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OpCode::OP_ADD_STRING:
+        return simpleInstruction("OP_ADD_STRING", offset);
+    case OpCode::OP_INDEX_LIST:
+        return simpleInstruction("OP_INDEX_LIST", offset);
+    case OpCode::OP_MODULO_NUM:
+        return simpleInstruction("OP_MODULO_NUM", offset);
+    case OpCode::OP_EQUAL_NUM:
+        return simpleInstruction("OP_EQUAL_NUM", offset);
+    case OpCode::OP_GET_PROPERTY_SLOT:
+        return constantInstruction("OP_GET_PROPERTY_SLOT", chunk, offset);
     default:
         std::cout << "Unknown opcode " << static_cast<uint8_t>(instruction) << std::endl;
         return offset + 1;
     }
 
-    static_assert(static_cast<int>(OpCode::COUNT) == 66, "Missing operations in the Debug");
+    static_assert(static_cast<int>(OpCode::COUNT) == 85, "Missing operations in the Debug");
+}
+
+void printRegisterOperand(const Chunk& chunk, uint16_t operand)
+{
+    if (operand & RegisterChunk::CONSTANT_OPERAND)
+    {
+        const Value& constant = chunk.constants.values[operand & ~RegisterChunk::CONSTANT_OPERAND];
+        std::cout << " k" << (operand & ~RegisterChunk::CONSTANT_OPERAND) << "(";
+        printValue(constant);
+        std::cout << ")";
+    }
+    else
+    {
+        std::cout << " r" << operand;
+    }
+}
+
+void disassembleRegisterChunk(const Chunk& chunk, const char* name)
+{
+    static const char* names[] =
+    {
+        "MOVE", "GET_GLOBAL", "SET_GLOBAL", "DEFINE_GLOBAL",
+        "EQUAL", "LESS", "GREATER", "ADD", "SUBTRACT", "MULTIPLY", "DIVIDE", "MODULO", "MIN", "MAX",
+        "NEGATE", "NOT", "INCREMENT", "TO_STRING",
+        "BUILD_LIST", "APPEND_LIST", "INDEX_SUBSCR", "STORE_SUBSCR", "RANGE_IN_BOUNDS",
+        "JUMP", "JUMP_IF_FALSE", "JUMP_IF_NOT_LESS", "CALL", "RETURN",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(RegisterOp::COUNT),
+        "Missing operations in disassembleRegisterChunk");
+
+    const RegisterChunk& registers = chunk.registers;
+    std::cout << "==" << name << " (" << registers.registerCount << " registers)==" << std::endl;
+
+    for (size_t index = 0; index < registers.code.size(); ++index)
+    {
+        const RegisterInstruction& instruction = registers.code[index];
+        std::cout << std::setfill('0') << std::setw(4) << index << " ";
+        if (index > 0 && registers.lines[index] == registers.lines[index - 1])
+        {
+            std::cout << "   | ";
+        }
+        else
+        {
+            std::cout << std::setfill('0') << std::setw(4) << registers.lines[index] << " ";
+        }
+        std::cout << names[static_cast<size_t>(instruction.op)];
+
+        switch (instruction.op)
+        {
+        case RegisterOp::GET_GLOBAL:
+            std::cout << " r" << instruction.a << " g" << (instruction.b | (static_cast<uint32_t>(instruction.c) << 16));
+            break;
+        case RegisterOp::SET_GLOBAL:
+        case RegisterOp::DEFINE_GLOBAL:
+            std::cout << " g" << (instruction.b | (static_cast<uint32_t>(instruction.c) << 16));
+            printRegisterOperand(chunk, instruction.a);
+            break;
+        case RegisterOp::MOVE:
+        case RegisterOp::NEGATE:
+        case RegisterOp::NOT:
+        case RegisterOp::INCREMENT:
+        case RegisterOp::TO_STRING:
+        case RegisterOp::APPEND_LIST:
+            std::cout << " r" << instruction.a;
+            printRegisterOperand(chunk, instruction.b);
+            break;
+        case RegisterOp::BUILD_LIST:
+            std::cout << " r" << instruction.a;
+            break;
+        case RegisterOp::STORE_SUBSCR:
+            printRegisterOperand(chunk, instruction.a);
+            printRegisterOperand(chunk, instruction.b);
+            printRegisterOperand(chunk, instruction.c);
+            break;
+        case RegisterOp::JUMP:
+            std::cout << " -> " << instruction.a;
+            break;
+        case RegisterOp::JUMP_IF_FALSE:
+            printRegisterOperand(chunk, instruction.a);
+            std::cout << " -> " << instruction.b;
+            break;
+        case RegisterOp::JUMP_IF_NOT_LESS:
+            printRegisterOperand(chunk, instruction.a);
+            printRegisterOperand(chunk, instruction.b);
+            std::cout << " -> " << instruction.c;
+            break;
+        case RegisterOp::CALL:
+            std::cout << " r" << instruction.a << " " << instruction.b;
+            break;
+        case RegisterOp::RETURN:
+            printRegisterOperand(chunk, instruction.a);
+            break;
+        default:
+            std::cout << " r" << instruction.a;
+            printRegisterOperand(chunk, instruction.b);
+            printRegisterOperand(chunk, instruction.c);
+            break;
+        }
+        std::cout << std::endl;
+    }
 }
@@ -5,5 +5,6 @@
 
 void disassembleChunk(const Chunk& chunk, const char* name);
 size_t disassembleInstruction(const Chunk& chunk, size_t offset);
+void disassembleRegisterChunk(const Chunk& chunk, const char* name);
 
 #endif
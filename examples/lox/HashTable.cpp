@@ -240,3 +240,59 @@ void TableLox::Clear()
     count = 0;
     capacity = 0;
 }
+
+uint32_t GlobalTable::resolveSlot(ObjString* name)
+{
+    uint32_t slot = 0;
+    if (findSlot(name, &slot)) return slot;
+
+    slot = static_cast<uint32_t>(slots.size());
+    slots.push_back({ Value(), name, false });
+    slotsByName.set(name, Value(static_cast<double>(slot)));
+    return slot;
+}
+
+bool GlobalTable::findSlot(ObjString* name, uint32_t* slot)
+{
+    Value index;
+    if (!slotsByName.get(name, &index)) return false;
+
+    *slot = static_cast<uint32_t>(asNumber(index));
+    return true;
+}
+
+bool GlobalTable::set(ObjString* name, const Value& value)
+{
+    const uint32_t slot = resolveSlot(name);
+    const bool isNewKey = !slots[slot].defined;
+    define(slot, value);
+    return isNewKey;
+}
+
+bool GlobalTable::get(ObjString* name, Value* value)
+{
+    uint32_t slot = 0;
+    if (!findSlot(name, &slot) || !slots[slot].defined) return false;
+
+    *value = slots[slot].value;
+    return true;
+}
+
+bool GlobalTable::remove(ObjString* name)
+{
+    uint32_t slot = 0;
+    if (!findSlot(name, &slot) || !slots[slot].defined) return false;
+
+    // Compiled code may still refer to the slot, so it stays reserved for the name.
+    slots[slot].value = Value();
+    slots[slot].defined = false;
+    return true;
+}
+
+void GlobalTable::mark()
+{
+    VM& vm = VM::getInstance();
+    slotsByName.mark();
+    for (Slot& slot : slots)
+        vm.markValue(slot.value);
+}
@@ -102,4 +102,41 @@ private:
 
 using Table = TableLox;
 
+// Global variables live in a flat array indexed by slot. The compiler resolves
+// each global name to a slot once, and the name table keeps name-based lookups
+// working for natives, the embedding API and the debugger.
+struct GlobalTable
+{
+    uint32_t resolveSlot(ObjString* name);
+    bool findSlot(ObjString* name, uint32_t* slot);
+
+    bool isDefined(uint32_t slot) const { return slots[slot].defined; }
+    const Value& getValue(uint32_t slot) const { return slots[slot].value; }
+    ObjString* getName(uint32_t slot) const { return slots[slot].name; }
+    void define(uint32_t slot, const Value& value)
+    {
+        slots[slot].value = value;
+        slots[slot].defined = true;
+    }
+    void assign(uint32_t slot, const Value& value) { slots[slot].value = value; }
+    size_t getSlotCount() const { return slots.size(); }
+
+    // Name-keyed view with the same semantics as Table.
+    bool set(ObjString* name, const Value& value);
+    bool get(ObjString* name, Value* value);
+    bool remove(ObjString* name);
+    void mark();
+
+private:
+    struct Slot
+    {
+        Value value;
+        ObjString* name = nullptr;
+        bool defined = false;
+    };
+
+    Table slotsByName;
+    std::vector<Slot> slots;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,728 @@
+#include "Jit.h"
+
+#include "Chunk.h"
+#include "Vm.h"
+
+#ifdef VLOX_JIT
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "The JIT only supports x86-64 Linux."
+#endif
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "Object.h"
+#include "VMUtils.h"
+
+namespace
+{
+    enum Register : uint8_t
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+    };
+
+    enum Condition : uint8_t
+    {
+        BELOW_OR_EQUAL = 0x6,
+        EQUAL_TO = 0x4,
+        NOT_EQUAL = 0x5,
+        ABOVE = 0x7,
+        NO_PARITY = 0xb,
+    };
+
+    // Pinned for the whole function.
+    constexpr Register VM_REGISTER = RBX;
+    constexpr Register FRAME_REGISTER = R12;
+    constexpr Register STOP_REGISTER = R13;
+    constexpr Register QNAN_REGISTER = R15;
+
+    // movsd with the F2 prefix, movups without it.
+    constexpr uint8_t MOV_LOAD = 0x10;
+    constexpr uint8_t MOV_STORE = 0x11;
+    constexpr uint8_t ADDSD = 0x58;
+    constexpr uint8_t MULSD = 0x59;
+    constexpr uint8_t SUBSD = 0x5c;
+    constexpr uint8_t MINSD = 0x5d;
+    constexpr uint8_t DIVSD = 0x5e;
+    constexpr uint8_t MAXSD = 0x5f;
+    constexpr uint8_t UCOMISD = 0x2e;
+    // Not an SSE opcode, numberOperation() calls std::fmod for it.
+    constexpr uint8_t FMOD_CALL = 0;
+
+#ifdef NAN_BOXING
+    constexpr int32_t VALUE_SIZE = 8;
+#else
+    static_assert(sizeof(Value) == 16, "The templates assume 16-byte tagged values.");
+    constexpr int32_t VALUE_SIZE = 16;
+    constexpr int32_t TYPE_OFFSET = offsetof(Value, type);
+#endif
+
+    uint64_t numberBits(double number)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &number, sizeof(double));
+        return bits;
+    }
+
+    // Just the encodings the templates need. Memory operands are always [base + disp32]
+    // and jumps always take a rel32 displacement.
+    class Assembler
+    {
+    public:
+        size_t position() const { return code.size(); }
+
+        void emit8(uint8_t value) { code.push_back(value); }
+        void emit32(uint32_t value)
+        {
+            for (int i = 0; i < 4; ++i) emit8(static_cast<uint8_t>(value >> (8 * i)));
+        }
+        void emit64(uint64_t value)
+        {
+            for (int i = 0; i < 8; ++i) emit8(static_cast<uint8_t>(value >> (8 * i)));
+        }
+
+        // Return the offset of the displacement to patch().
+        size_t jump() { emit8(0xe9); return placeholder(); }
+        size_t jumpIf(Condition condition) { emit8(0x0f); emit8(0x80 | condition); return placeholder(); }
+        void jumpTo(size_t target) { patch(jump(), target); }
+        void jumpIfTo(Condition condition, size_t target) { patch(jumpIf(condition), target); }
+        void patch(size_t displacement, size_t target)
+        {
+            const int32_t relative = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(displacement + 4));
+            std::memcpy(&code[displacement], &relative, sizeof(relative));
+        }
+
+        void push(Register r) { if (r & 8) emit8(0x41); emit8(0x50 | (r & 7)); }
+        void pop(Register r) { if (r & 8) emit8(0x41); emit8(0x58 | (r & 7)); }
+        void ret() { emit8(0xc3); }
+        void callRax() { emit8(0xff); emit8(0xd0); }
+        void jumpToRdx() { emit8(0xff); emit8(0xe2); }
+
+        void movImmediate(Register r, uint64_t value) { rex(true, 0, r); emit8(0xb8 | (r & 7)); emit64(value); }
+        void movEax(uint32_t value) { emit8(0xb8); emit32(value); }
+        void mov(Register destination, Register source) { rex(true, source, destination); emit8(0x89); direct(source, destination); }
+        void load(Register r, Register base, int32_t displacement) { rex(true, r, base); emit8(0x8b); memory(r, base, displacement); }
+        void loadAddress(Register r, Register base, int32_t displacement) { rex(true, r, base); emit8(0x8d); memory(r, base, displacement); }
+        void store(Register base, int32_t displacement, Register r) { rex(true, r, base); emit8(0x89); memory(r, base, displacement); }
+        void add(Register destination, Register source) { rex(true, source, destination); emit8(0x01); direct(source, destination); }
+        void bitAnd(Register destination, Register source) { rex(true, source, destination); emit8(0x21); direct(source, destination); }
+        void compare(Register destination, Register source) { rex(true, source, destination); emit8(0x39); direct(source, destination); }
+        void complementSignBit(Register r) { rex(true, 0, r); emit8(0x0f); emit8(0xba); direct(7, r); emit8(63); }
+
+        // Byte registers are limited to AL and CL, which need no REX prefix to be addressed.
+        void loadByte(Register r, Register base, int32_t displacement) { rex(false, r, base); emit8(0x0f); emit8(0xb6); memory(r, base, displacement); }
+        void storeByte(Register base, int32_t displacement, Register r) { rex(false, r, base); emit8(0x88); memory(r, base, displacement); }
+        void storeByte(Register base, int32_t displacement, uint8_t value) { rex(false, 0, base); emit8(0xc6); memory(0, base, displacement); emit8(value); }
+        void compareByte(Register base, int32_t displacement, uint8_t value) { rex(false, 0, base); emit8(0x80); memory(7, base, displacement); emit8(value); }
+        void compareAl(uint8_t value) { emit8(0x3c); emit8(value); }
+        void setIf(Condition condition, Register r) { emit8(0x0f); emit8(0x90 | condition); direct(0, r); }
+        void andAlCl() { emit8(0x20); emit8(0xc8); }
+        void zeroExtendAl() { emit8(0x0f); emit8(0xb6); emit8(0xc0); }
+        void clearEax() { emit8(0x31); emit8(0xc0); }
+        void testEax() { emit8(0x85); emit8(0xc0); }
+        void testAl() { emit8(0x84); emit8(0xc0); }
+
+        // SSE2 scalar doubles, a zero prefix emits the unprefixed packed form.
+        void sse(uint8_t prefix, uint8_t opcode, uint8_t xmm, Register base, int32_t displacement)
+        {
+            if (prefix) emit8(prefix);
+            rex(false, xmm, base);
+            emit8(0x0f);
+            emit8(opcode);
+            memory(xmm, base, displacement);
+        }
+        void sse(uint8_t prefix, uint8_t opcode, uint8_t xmm, uint8_t source)
+        {
+            if (prefix) emit8(prefix);
+            rex(false, xmm, source);
+            emit8(0x0f);
+            emit8(opcode);
+            direct(xmm, source);
+        }
+        void movqToXmm(uint8_t xmm, Register r) { emit8(0x66); rex(true, xmm, r); emit8(0x0f); emit8(0x6e); direct(xmm, r); }
+
+        std::vector<uint8_t> code;
+
+    private:
+        size_t placeholder()
+        {
+            const size_t offset = code.size();
+            emit32(0);
+            return offset;
+        }
+        void rex(bool wide, uint8_t reg, uint8_t base)
+        {
+            const uint8_t prefix = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+            if (prefix != 0x40) emit8(prefix);
+        }
+        void direct(uint8_t reg, uint8_t rm) { emit8(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+        void memory(uint8_t reg, uint8_t base, int32_t displacement)
+        {
+            emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+            if ((base & 7) == RSP) emit8(0x24);
+            emit32(static_cast<uint32_t>(displacement));
+        }
+    };
+
+    // Fast paths the compiled code calls directly. They return false when the operands need
+    // the whole instruction, which then runs through the step function and reports any error.
+    bool getGlobal(VM* vm, uint32_t slot, Value* destination)
+    {
+        const GlobalTable& globals = vm->globalTable();
+        if (!globals.isDefined(slot)) return false;
+        *destination = globals.getValue(slot);
+        return true;
+    }
+
+    bool setGlobal(VM* vm, uint32_t slot, const Value* value)
+    {
+        GlobalTable& globals = vm->globalTable();
+        if (!globals.isDefined(slot)) return false;
+        globals.assign(slot, *value);
+        return true;
+    }
+
+    bool indexList(const Value* source, const Value* index, Value* destination)
+    {
+        if (!isList(*source) || !isNumber(*index)) return false;
+        ObjList* list = asList(*source);
+        const int position = static_cast<int>(asNumber(*index));
+        *destination = list->isInBounds(position) ? list->getValue(position) : Value();
+        return true;
+    }
+
+    bool storeList(const Value* source, const Value* index, const Value* item)
+    {
+        if (!isList(*source) || !isNumber(*index)) return false;
+        ObjList* list = asList(*source);
+        const int position = static_cast<int>(asNumber(*index));
+        if (!list->isInBounds(position)) return false;
+        list->setValue(position, *item);
+        return true;
+    }
+
+    struct Address
+    {
+        Register base;
+        int32_t displacement;
+    };
+
+    struct PendingJump
+    {
+        size_t displacement;
+        uint16_t target;
+    };
+
+    class TemplateCompiler
+    {
+    public:
+        TemplateCompiler(const Chunk& chunk, JitStepFunction step)
+            : code(chunk.registers.code)
+            , constants(chunk.constants.values)
+            , step(step)
+        {}
+
+        std::vector<uint8_t> compile(std::vector<uint32_t>& entries);
+
+    private:
+        void compileInstruction(size_t index);
+
+        bool isConstant(uint16_t operand) const { return (operand & RegisterChunk::CONSTANT_OPERAND) != 0; }
+        const Value& constant(uint16_t operand) const { return constants[operand & ~RegisterChunk::CONSTANT_OPERAND]; }
+        bool neverNumber(uint16_t operand) const { return isConstant(operand) && !isNumber(constant(operand)); }
+        static int32_t slot(uint16_t reg) { return static_cast<int32_t>(reg) * VALUE_SIZE; }
+
+        Address address(uint16_t operand, Register scratch);
+        void loadAddress(Register r, uint16_t operand);
+        void guardNumber(uint16_t operand, std::vector<size_t>& slowPath);
+        void loadNumber(uint8_t xmm, uint16_t operand);
+        void storeNumber(uint16_t reg, uint8_t xmm);
+        void storeBoolean(uint16_t reg);
+        void jumpIfFalsey(uint16_t operand, std::vector<size_t>& falsey);
+        void bind(const std::vector<size_t>& jumps);
+
+        void callStep(const RegisterInstruction& instruction);
+        void stepOrExit(const RegisterInstruction& instruction);
+        void fastPathOrStep(const void* helper, const RegisterInstruction& instruction);
+        void numberOperation(const RegisterInstruction& instruction, uint8_t opcode, bool reversed);
+        void comparison(const RegisterInstruction& instruction, Condition condition, bool reversed);
+
+        const std::vector<RegisterInstruction>& code;
+        const std::vector<Value>& constants;
+        JitStepFunction step;
+
+        Assembler assembler;
+        size_t stopExit = 0;
+        size_t epilogue = 0;
+        std::vector<PendingJump> jumps;
+    };
+
+    std::vector<uint8_t> TemplateCompiler::compile(std::vector<uint32_t>& entries)
+    {
+        // int (VM* vm, Value* registers, const uint8_t* entry, const std::atomic<bool>* stopRequested)
+        // R14 is only saved to keep the stack 16-byte aligned for the calls into the VM.
+        assembler.push(RBX);
+        assembler.push(R12);
+        assembler.push(R13);
+        assembler.push(R14);
+        assembler.push(R15);
+        assembler.mov(VM_REGISTER, RDI);
+        assembler.mov(FRAME_REGISTER, RSI);
+        assembler.mov(STOP_REGISTER, RCX);
+#ifdef NAN_BOXING
+        assembler.movImmediate(QNAN_REGISTER, QNAN);
+#endif
+        assembler.jumpToRdx();
+
+        stopExit = assembler.position();
+        assembler.movEax(static_cast<uint32_t>(InterpretResult::INTERPRET_RUNTIME_ERROR));
+
+        epilogue = assembler.position();
+        assembler.pop(R15);
+        assembler.pop(R14);
+        assembler.pop(R13);
+        assembler.pop(R12);
+        assembler.pop(RBX);
+        assembler.ret();
+
+        entries.resize(code.size() + 1);
+        for (size_t index = 0; index < code.size(); ++index)
+        {
+            entries[index] = static_cast<uint32_t>(assembler.position());
+            compileInstruction(index);
+        }
+
+        // The lowering always ends in RETURN, this is never reached.
+        entries[code.size()] = static_cast<uint32_t>(assembler.position());
+        assembler.jumpTo(stopExit);
+
+        for (const PendingJump& jump : jumps)
+        {
+            assembler.patch(jump.displacement, entries[jump.target]);
+        }
+
+        return std::move(assembler.code);
+    }
+
+    void TemplateCompiler::compileInstruction(size_t index)
+    {
+        const RegisterInstruction& instruction = code[index];
+        switch (instruction.op)
+        {
+        case RegisterOp::MOVE:
+        {
+            const Address source = address(instruction.b, RSI);
+#ifdef NAN_BOXING
+            assembler.load(RAX, source.base, source.displacement);
+            assembler.store(FRAME_REGISTER, slot(instruction.a), RAX);
+#else
+            assembler.sse(0, MOV_LOAD, 0, source.base, source.displacement);
+            assembler.sse(0, MOV_STORE, 0, FRAME_REGISTER, slot(instruction.a));
+#endif
+            break;
+        }
+        case RegisterOp::ADD:       numberOperation(instruction, ADDSD, false); break;
+        case RegisterOp::SUBTRACT:  numberOperation(instruction, SUBSD, false); break;
+        case RegisterOp::MULTIPLY:  numberOperation(instruction, MULSD, false); break;
+        case RegisterOp::DIVIDE:    numberOperation(instruction, DIVSD, false); break;
+        case RegisterOp::MODULO:    numberOperation(instruction, FMOD_CALL, false); break;
+        // minsd and maxsd return their second operand when the first doesn't win, which matches
+        // std::min and std::max with the operands swapped, NaNs included.
+        case RegisterOp::MIN:       numberOperation(instruction, MINSD, true); break;
+        case RegisterOp::MAX:       numberOperation(instruction, MAXSD, true); break;
+        // Unordered compares set CF, so only "above" is false for NaNs.
+        case RegisterOp::LESS:      comparison(instruction, ABOVE, true); break;
+        case RegisterOp::GREATER:   comparison(instruction, ABOVE, false); break;
+        case RegisterOp::EQUAL:     comparison(instruction, EQUAL_TO, false); break;
+        case RegisterOp::INCREMENT:
+        case RegisterOp::NEGATE:
+        {
+            if (neverNumber(instruction.b))
+            {
+                stepOrExit(instruction);
+                break;
+            }
+
+            std::vector<size_t> slowPath;
+            guardNumber(instruction.b, slowPath);
+            if (instruction.op == RegisterOp::INCREMENT)
+            {
+                loadNumber(0, instruction.b);
+                assembler.movImmediate(RAX, numberBits(1.0));
+                assembler.movqToXmm(1, RAX);
+                assembler.sse(0xf2, ADDSD, 0, 1);
+                storeNumber(instruction.a, 0);
+            }
+            else
+            {
+                if (isConstant(instruction.b))
+                    assembler.movImmediate(RAX, numberBits(asNumber(constant(instruction.b))));
+                else
+                    assembler.load(RAX, FRAME_REGISTER, slot(instruction.b));
+                assembler.complementSignBit(RAX);
+                assembler.store(FRAME_REGISTER, slot(instruction.a), RAX);
+#ifndef NAN_BOXING
+                assembler.storeByte(FRAME_REGISTER, slot(instruction.a) + TYPE_OFFSET, static_cast<uint8_t>(ValueType::NUMBER));
+#endif
+            }
+            const size_t done = assembler.jump();
+            bind(slowPath);
+            stepOrExit(instruction);
+            assembler.patch(done, assembler.position());
+            break;
+        }
+        case RegisterOp::NOT:
+        {
+            std::vector<size_t> falsey;
+            jumpIfFalsey(instruction.b, falsey);
+            assembler.clearEax();
+            const size_t done = assembler.jump();
+            bind(falsey);
+            assembler.movEax(1);
+            assembler.patch(done, assembler.position());
+            storeBoolean(instruction.a);
+            break;
+        }
+        case RegisterOp::JUMP:
+            if (instruction.a <= index)
+            {
+                assembler.compareByte(STOP_REGISTER, 0, 0);
+                assembler.jumpIfTo(NOT_EQUAL, stopExit);
+            }
+            jumps.push_back({ assembler.jump(), instruction.a });
+            break;
+        case RegisterOp::JUMP_IF_FALSE:
+        {
+            std::vector<size_t> falsey;
+            jumpIfFalsey(instruction.a, falsey);
+            for (const size_t displacement : falsey)
+            {
+                jumps.push_back({ displacement, instruction.b });
+            }
+            break;
+        }
+        case RegisterOp::JUMP_IF_NOT_LESS:
+        {
+            // The slow path only runs for operands that aren't numbers, which is always an error.
+            std::vector<size_t> slowPath;
+            if (!neverNumber(instruction.a) && !neverNumber(instruction.b))
+            {
+                guardNumber(instruction.a, slowPath);
+                guardNumber(instruction.b, slowPath);
+                loadNumber(0, instruction.b);
+                loadNumber(1, instruction.a);
+                assembler.sse(0x66, UCOMISD, 0, 1);
+                jumps.push_back({ assembler.jumpIf(BELOW_OR_EQUAL), instruction.c });
+                const size_t done = assembler.jump();
+                bind(slowPath);
+                callStep(instruction);
+                assembler.jumpTo(epilogue);
+                assembler.patch(done, assembler.position());
+            }
+            else
+            {
+                callStep(instruction);
+                assembler.jumpTo(epilogue);
+            }
+            break;
+        }
+        case RegisterOp::GET_GLOBAL:
+        case RegisterOp::SET_GLOBAL:
+        {
+            assembler.mov(RDI, VM_REGISTER);
+            assembler.movImmediate(RSI, instruction.b | (static_cast<uint32_t>(instruction.c) << 16));
+            if (instruction.op == RegisterOp::GET_GLOBAL)
+            {
+                assembler.loadAddress(RDX, FRAME_REGISTER, slot(instruction.a));
+                fastPathOrStep(reinterpret_cast<const void*>(&getGlobal), instruction);
+            }
+            else
+            {
+                loadAddress(RDX, instruction.a);
+                fastPathOrStep(reinterpret_cast<const void*>(&setGlobal), instruction);
+            }
+            break;
+        }
+        case RegisterOp::INDEX_SUBSCR:
+            loadAddress(RDI, instruction.b);
+            loadAddress(RSI, instruction.c);
+            assembler.loadAddress(RDX, FRAME_REGISTER, slot(instruction.a));
+            fastPathOrStep(reinterpret_cast<const void*>(&indexList), instruction);
+            break;
+        case RegisterOp::STORE_SUBSCR:
+            loadAddress(RDI, instruction.a);
+            loadAddress(RSI, instruction.b);
+            loadAddress(RDX, instruction.c);
+            fastPathOrStep(reinterpret_cast<const void*>(&storeList), instruction);
+            break;
+        case RegisterOp::RETURN:
+            callStep(instruction);
+            assembler.jumpTo(epilogue);
+            break;
+        default:
+            stepOrExit(instruction);
+            break;
+        }
+
+        static_assert(static_cast<int>(RegisterOp::COUNT) == 28, "Missing operations in the JIT templates");
+    }
+
+    // Constants live outside the frame, so their address goes through the scratch register.
+    Address TemplateCompiler::address(uint16_t operand, Register scratch)
+    {
+        if (isConstant(operand))
+        {
+            assembler.movImmediate(scratch, reinterpret_cast<uint64_t>(&constant(operand)));
+            return { scratch, 0 };
+        }
+        return { FRAME_REGISTER, slot(operand) };
+    }
+
+    void TemplateCompiler::loadAddress(Register r, uint16_t operand)
+    {
+        if (isConstant(operand))
+            assembler.movImmediate(r, reinterpret_cast<uint64_t>(&constant(operand)));
+        else
+            assembler.loadAddress(r, FRAME_REGISTER, slot(operand));
+    }
+
+    // Constant operands are known numbers here, callers check neverNumber() first.
+    void TemplateCompiler::guardNumber(uint16_t operand, std::vector<size_t>& slowPath)
+    {
+        if (isConstant(operand)) return;
+
+#ifdef NAN_BOXING
+        assembler.load(RAX, FRAME_REGISTER, slot(operand));
+        assembler.bitAnd(RAX, QNAN_REGISTER);
+        assembler.compare(RAX, QNAN_REGISTER);
+        slowPath.push_back(assembler.jumpIf(EQUAL_TO));
+#else
+        assembler.compareByte(FRAME_REGISTER, slot(operand) + TYPE_OFFSET, static_cast<uint8_t>(ValueType::NUMBER));
+        slowPath.push_back(assembler.jumpIf(NOT_EQUAL));
+#endif
+    }
+
+    void TemplateCompiler::loadNumber(uint8_t xmm, uint16_t operand)
+    {
+        if (isConstant(operand))
+        {
+            assembler.movImmediate(RAX, numberBits(asNumber(constant(operand))));
+            assembler.movqToXmm(xmm, RAX);
+            return;
+        }
+        assembler.sse(0xf2, MOV_LOAD, xmm, FRAME_REGISTER, slot(operand));
+    }
+
+    void TemplateCompiler::storeNumber(uint16_t reg, uint8_t xmm)
+    {
+        assembler.sse(0xf2, MOV_STORE, xmm, FRAME_REGISTER, slot(reg));
+#ifndef NAN_BOXING
+        assembler.storeByte(FRAME_REGISTER, slot(reg) + TYPE_OFFSET, static_cast<uint8_t>(ValueType::NUMBER));
+#endif
+    }
+
+    // Stores AL, which must be 0 or 1.
+    void TemplateCompiler::storeBoolean(uint16_t reg)
+    {
+#ifdef NAN_BOXING
+        assembler.zeroExtendAl();
+        assembler.movImmediate(RCX, FALSE_VAL);
+        assembler.add(RAX, RCX);
+        assembler.store(FRAME_REGISTER, slot(reg), RAX);
+#else
+        assembler.storeByte(FRAME_REGISTER, slot(reg), RAX);
+        assembler.storeByte(FRAME_REGISTER, slot(reg) + TYPE_OFFSET, static_cast<uint8_t>(ValueType::BOOL));
+#endif
+    }
+
+    // Adds the jumps taken for nil and false, everything else falls through.
+    void TemplateCompiler::jumpIfFalsey(uint16_t operand, std::vector<size_t>& falsey)
+    {
+        if (isConstant(operand))
+        {
+            if (isFalsey(constant(operand))) falsey.push_back(assembler.jump());
+            return;
+        }
+
+#ifdef NAN_BOXING
+        assembler.load(RAX, FRAME_REGISTER, slot(operand));
+        assembler.movImmediate(RCX, NIL_VAL);
+        assembler.compare(RAX, RCX);
+        falsey.push_back(assembler.jumpIf(EQUAL_TO));
+        assembler.movImmediate(RCX, FALSE_VAL);
+        assembler.compare(RAX, RCX);
+        falsey.push_back(assembler.jumpIf(EQUAL_TO));
+#else
+        assembler.loadByte(RAX, FRAME_REGISTER, slot(operand) + TYPE_OFFSET);
+        assembler.compareAl(static_cast<uint8_t>(ValueType::NIL));
+        falsey.push_back(assembler.jumpIf(EQUAL_TO));
+        assembler.compareAl(static_cast<uint8_t>(ValueType::BOOL));
+        const size_t truthy = assembler.jumpIf(NOT_EQUAL);
+        assembler.compareByte(FRAME_REGISTER, slot(operand), 0);
+        falsey.push_back(assembler.jumpIf(EQUAL_TO));
+        assembler.patch(truthy, assembler.position());
+#endif
+    }
+
+    void TemplateCompiler::bind(const std::vector<size_t>& pending)
+    {
+        for (const size_t displacement : pending)
+        {
+            assembler.patch(displacement, assembler.position());
+        }
+    }
+
+    void TemplateCompiler::callStep(const RegisterInstruction& instruction)
+    {
+        assembler.mov(RDI, VM_REGISTER);
+        assembler.movImmediate(RSI, reinterpret_cast<uint64_t>(&instruction));
+        assembler.movImmediate(RAX, reinterpret_cast<uint64_t>(step));
+        assembler.callRax();
+    }
+
+    void TemplateCompiler::stepOrExit(const RegisterInstruction& instruction)
+    {
+        callStep(instruction);
+        assembler.testEax();
+        assembler.jumpIfTo(NOT_EQUAL, epilogue);
+    }
+
+    // The helper's arguments are already loaded.
+    void TemplateCompiler::fastPathOrStep(const void* helper, const RegisterInstruction& instruction)
+    {
+        assembler.movImmediate(RAX, reinterpret_cast<uint64_t>(helper));
+        assembler.callRax();
+        assembler.testAl();
+        const size_t done = assembler.jumpIf(NOT_EQUAL);
+        stepOrExit(instruction);
+        assembler.patch(done, assembler.position());
+    }
+
+    // Numbers run inline, anything else (string concatenation, errors) goes through the VM.
+    void TemplateCompiler::numberOperation(const RegisterInstruction& instruction, uint8_t opcode, bool reversed)
+    {
+        if (neverNumber(instruction.b) || neverNumber(instruction.c))
+        {
+            stepOrExit(instruction);
+            return;
+        }
+
+        std::vector<size_t> slowPath;
+        guardNumber(instruction.b, slowPath);
+        guardNumber(instruction.c, slowPath);
+        loadNumber(0, reversed ? instruction.c : instruction.b);
+        loadNumber(1, reversed ? instruction.b : instruction.c);
+        if (opcode == FMOD_CALL)
+        {
+            // Both operands and the result are already where the C calling convention wants them.
+            assembler.movImmediate(RAX, reinterpret_cast<uint64_t>(static_cast<double (*)(double, double)>(&std::fmod)));
+            assembler.callRax();
+        }
+        else
+        {
+            assembler.sse(0xf2, opcode, 0, 1);
+        }
+        storeNumber(instruction.a, 0);
+        const size_t done = assembler.jump();
+        bind(slowPath);
+        stepOrExit(instruction);
+        assembler.patch(done, assembler.position());
+    }
+
+    void TemplateCompiler::comparison(const RegisterInstruction& instruction, Condition condition, bool reversed)
+    {
+        if (neverNumber(instruction.b) || neverNumber(instruction.c))
+        {
+            stepOrExit(instruction);
+            return;
+        }
+
+        std::vector<size_t> slowPath;
+        guardNumber(instruction.b, slowPath);
+        guardNumber(instruction.c, slowPath);
+        loadNumber(0, reversed ? instruction.c : instruction.b);
+        loadNumber(1, reversed ? instruction.b : instruction.c);
+        assembler.sse(0x66, UCOMISD, 0, 1);
+        assembler.setIf(condition, RAX);
+        if (condition == EQUAL_TO)
+        {
+            // NaN compares as equal with the parity flag set.
+            assembler.setIf(NO_PARITY, RCX);
+            assembler.andAlCl();
+        }
+        storeBoolean(instruction.a);
+        const size_t done = assembler.jump();
+        bind(slowPath);
+        stepOrExit(instruction);
+        assembler.patch(done, assembler.position());
+    }
+}
+
+JitCode::~JitCode()
+{
+    if (memory) munmap(memory, size);
+}
+
+int JitCode::run(VM* vm, Value* registers, size_t instruction, const std::atomic<bool>* stopRequested) const
+{
+    using Function = int (*)(VM*, Value*, const uint8_t*, const std::atomic<bool>*);
+    const Function function = reinterpret_cast<Function>(memory);
+    return function(vm, registers, memory + entries[instruction], stopRequested);
+}
+
+bool isJitAvailable()
+{
+    return true;
+}
+
+std::shared_ptr<const JitCode> compileJit(const Chunk& chunk, JitStepFunction step)
+{
+    if (chunk.registers.empty()) return nullptr;
+
+    TemplateCompiler compiler(chunk, step);
+    std::vector<uint32_t> entries;
+    const std::vector<uint8_t> code = compiler.compile(entries);
+
+    // Written first and only then made executable, never both at once.
+    void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, code.size());
+        return nullptr;
+    }
+
+    std::shared_ptr<JitCode> jit = std::make_shared<JitCode>();
+    jit->memory = static_cast<uint8_t*>(memory);
+    jit->size = code.size();
+    jit->entries = std::move(entries);
+    return jit;
+}
+
+#else
+
+JitCode::~JitCode() = default;
+
+int JitCode::run(VM*, Value*, size_t, const std::atomic<bool>*) const
+{
+    return static_cast<int>(InterpretResult::INTERPRET_RUNTIME_ERROR);
+}
+
+bool isJitAvailable()
+{
+    return false;
+}
+
+std::shared_ptr<const JitCode> compileJit(const Chunk&, JitStepFunction)
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef loxcpp_jit_h
+#define loxcpp_jit_h
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "Common.h"
+
+struct Chunk;
+struct RegisterInstruction;
+struct Value;
+class VM;
+
+// Runs one register instruction of the innermost frame. Returns 0 (INTERPRET_OK) to carry on,
+// anything else is the InterpretResult the compiled code has to return.
+using JitStepFunction = int (*)(VM* vm, const RegisterInstruction* instruction);
+
+// x86-64 machine code for the register code of one function. Every register instruction is
+// copied from a template: number operations, moves and jumps run inline and everything else
+// calls back into the VM through the step function.
+struct JitCode
+{
+    JitCode() = default;
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    ~JitCode();
+
+    // Starts running at the given register instruction, loops enter the compiled code halfway.
+    int run(VM* vm, Value* registers, size_t instruction, const std::atomic<bool>* stopRequested) const;
+
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    // Machine code offset of every register instruction.
+    std::vector<uint32_t> entries;
+};
+
+// False unless lox was built with VLOX_JIT on a supported platform.
+bool isJitAvailable();
+
+// Returns null when the JIT isn't available or the executable memory can't be allocated.
+// The compiled code points at the chunk's register code and constants, so neither may change afterwards.
+std::shared_ptr<const JitCode> compileJit(const Chunk& chunk, JitStepFunction step);
+
+#endif
@@ -0,0 +1,295 @@
+#include "Memory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    static_assert((HeapAllocator::SLAB_SIZE & (HeapAllocator::SLAB_SIZE - 1)) == 0, "Slabs are found by masking, their size must be a power of two");
+
+    // Slabs come straight from the OS: an aligned operator new leaves most of a second slab
+    // unused next to every one of them.
+    void* mapSlab()
+    {
+        constexpr size_t size = HeapAllocator::SLAB_SIZE;
+#ifdef _WIN32
+        // Windows already aligns allocations to 64 KB.
+        static_assert(size == 64 * 1024, "Slabs are aligned by VirtualAlloc");
+        void* memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (!memory)
+            throw std::bad_alloc();
+        return memory;
+#else
+        // Map twice the size and unmap whatever sticks out of the aligned slab.
+        void* mapping = mmap(nullptr, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            throw std::bad_alloc();
+
+        uint8_t* start = static_cast<uint8_t*>(mapping);
+        uint8_t* slab = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(start) + size - 1) & ~(uintptr_t)(size - 1));
+        if (slab > start)
+            munmap(start, slab - start);
+        if (slab + size < start + size * 2)
+            munmap(slab + size, start + size * 2 - (slab + size));
+        return slab;
+#endif
+    }
+
+    void unmapSlab(void* slab)
+    {
+#ifdef _WIN32
+        VirtualFree(slab, 0, MEM_RELEASE);
+#else
+        munmap(slab, HeapAllocator::SLAB_SIZE);
+#endif
+    }
+
+    template<class Node>
+    void unlink(Node* node, Node*& head)
+    {
+        if (node->previous)
+            node->previous->next = node->next;
+        else
+            head = node->next;
+
+        if (node->next)
+            node->next->previous = node->previous;
+
+        node->previous = nullptr;
+        node->next = nullptr;
+    }
+
+    template<class Node>
+    void pushFront(Node* node, Node*& head)
+    {
+        node->previous = nullptr;
+        node->next = head;
+        if (head)
+            head->previous = node;
+        head = node;
+    }
+
+    template<class Node, class Function>
+    void forEachNode(Node* head, Function function)
+    {
+        while (head)
+        {
+            Node* next = head->next;
+            function(head);
+            head = next;
+        }
+    }
+}
+
+HeapAllocator::~HeapAllocator()
+{
+    for (SizeClass& sizeClass : classes)
+    {
+        const auto release = [](Slab* slab)
+        {
+            slab->~Slab();
+            unmapSlab(slab);
+        };
+        forEachNode(sizeClass.available, release);
+        forEachNode(sizeClass.full, release);
+    }
+}
+
+void* HeapAllocator::allocate(size_t size)
+{
+    size = std::max<size_t>(size, 1);
+    stats.allocations++;
+    stats.liveBytes += size;
+
+    if (size > MAX_SMALL_SIZE)
+    {
+        reserve(size);
+        return ::operator new(size);
+    }
+
+    const uint32_t classIndex = static_cast<uint32_t>((size - 1) / GRANULARITY);
+    const size_t slot = slotSize(classIndex);
+
+    Slab* slab = classes[classIndex].available;
+    if (!slab)
+    {
+        slab = createSlab(classIndex);
+    }
+
+    if (slab->live == 0)
+    {
+        classes[classIndex].emptySlabs--;
+    }
+
+    void* result;
+    if (slab->freeSlots)
+    {
+        result = slab->freeSlots;
+        slab->freeSlots = slab->freeSlots->next;
+    }
+    else
+    {
+        result = slab->bump;
+        slab->bump += slot;
+    }
+    slab->live++;
+
+    if (!slab->freeSlots && slab->bump + slot > slab->end)
+    {
+        setFull(slab, true);
+    }
+
+    return result;
+}
+
+void HeapAllocator::deallocate(void* pointer, size_t size)
+{
+    if (!pointer)
+        return;
+
+    size = std::max<size_t>(size, 1);
+    stats.frees++;
+    stats.liveBytes -= size;
+
+    if (size > MAX_SMALL_SIZE)
+    {
+        ::operator delete(pointer);
+        stats.reservedBytes -= size;
+        return;
+    }
+
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(pointer) & ~(uintptr_t)(SLAB_SIZE - 1));
+    slab->live--;
+
+    if (slab->live == 0)
+    {
+        // Back to bump allocation, the free list only has slots of this slab.
+        classes[slab->sizeClass].emptySlabs++;
+        slab->freeSlots = nullptr;
+        slab->bump = firstSlot(slab);
+    }
+    else
+    {
+        FreeSlot* freeSlot = static_cast<FreeSlot*>(pointer);
+        freeSlot->next = slab->freeSlots;
+        slab->freeSlots = freeSlot;
+    }
+
+    if (slab->full)
+    {
+        setFull(slab, false);
+    }
+}
+
+void* HeapAllocator::reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    if (newSize == 0)
+    {
+        deallocate(pointer, oldSize);
+        return nullptr;
+    }
+
+    if (!pointer)
+        return allocate(newSize);
+
+    // Growing or shrinking within the same size class keeps the slot.
+    if (oldSize <= MAX_SMALL_SIZE && newSize <= MAX_SMALL_SIZE && (std::max<size_t>(oldSize, 1) - 1) / GRANULARITY == (newSize - 1) / GRANULARITY)
+    {
+        stats.liveBytes += newSize;
+        stats.liveBytes -= std::max<size_t>(oldSize, 1);
+        return pointer;
+    }
+
+    void* result = allocate(newSize);
+    std::memcpy(result, pointer, std::min(oldSize, newSize));
+    deallocate(pointer, oldSize);
+    return result;
+}
+
+void HeapAllocator::releaseEmptySlabs(size_t keepBytes)
+{
+    size_t kept = 0;
+    for (SizeClass& sizeClass : classes)
+    {
+        if (sizeClass.emptySlabs == 0)
+            continue;
+
+        forEachNode(sizeClass.available, [&](Slab* slab)
+        {
+            if (slab->live != 0)
+                return;
+
+            if (kept + SLAB_SIZE <= keepBytes)
+            {
+                kept += SLAB_SIZE;
+                return;
+            }
+
+            sizeClass.emptySlabs--;
+            releaseSlab(slab);
+        });
+    }
+}
+
+uint8_t* HeapAllocator::firstSlot(Slab* slab)
+{
+    constexpr size_t headerSize = (sizeof(Slab) + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+    return reinterpret_cast<uint8_t*>(slab) + headerSize;
+}
+
+HeapAllocator::Slab* HeapAllocator::createSlab(uint32_t sizeClass)
+{
+    void* memory = mapSlab();
+    Slab* slab = new (memory) Slab();
+    slab->sizeClass = sizeClass;
+    slab->bump = firstSlot(slab);
+
+    const size_t slot = slotSize(sizeClass);
+    const size_t slots = (SLAB_SIZE - (slab->bump - reinterpret_cast<uint8_t*>(slab))) / slot;
+    slab->end = slab->bump + slots * slot;
+
+    SizeClass& owner = classes[sizeClass];
+    pushFront(slab, owner.available);
+    owner.slabCount++;
+    owner.emptySlabs++;
+
+    stats.slabCount++;
+    reserve(SLAB_SIZE);
+    return slab;
+}
+
+void HeapAllocator::releaseSlab(Slab* slab)
+{
+    SizeClass& owner = classes[slab->sizeClass];
+    unlink(slab, slab->full ? owner.full : owner.available);
+    owner.slabCount--;
+
+    stats.slabCount--;
+    stats.slabsReleased++;
+    stats.reservedBytes -= SLAB_SIZE;
+
+    slab->~Slab();
+    unmapSlab(slab);
+}
+
+void HeapAllocator::setFull(Slab* slab, bool full)
+{
+    SizeClass& owner = classes[slab->sizeClass];
+    unlink(slab, slab->full ? owner.full : owner.available);
+    pushFront(slab, full ? owner.full : owner.available);
+    slab->full = full;
+}
+
+void HeapAllocator::reserve(size_t bytes)
+{
+    stats.reservedBytes += bytes;
+    stats.peakReservedBytes = std::max(stats.peakReservedBytes, stats.reservedBytes);
+}
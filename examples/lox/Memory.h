@@ -1,21 +1,92 @@
 #ifndef loxcpp_memory_h
 #define loxcpp_memory_h
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
 #include "Common.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+struct AllocatorStats
+{
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    // Bytes requested by the live objects.
+    size_t liveBytes = 0;
+    // Bytes held in slabs and large allocations, free slots and headers included.
+    size_t reservedBytes = 0;
+    size_t peakReservedBytes = 0;
+    size_t slabCount = 0;
+    uint64_t slabsReleased = 0;
+};
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+// Where the VM gets the memory for its managed objects. Small objects are carved out of 64 KB
+// slabs mapped from the OS, each holding a single size class. A slab bump-allocates until it is
+// full and reuses its free list afterwards. Slabs left empty by a sweep stay around until
+// releaseEmptySlabs() gives back the ones the next allocations won't need. Bigger objects use
+// operator new.
+class HeapAllocator
 {
-    if (newSize == 0)
+public:
+    static constexpr size_t SLAB_SIZE = 64 * 1024;
+    static constexpr size_t GRANULARITY = 16;
+    static constexpr size_t MAX_SMALL_SIZE = 512;
+
+    HeapAllocator() = default;
+    HeapAllocator(const HeapAllocator&) = delete;
+    HeapAllocator& operator=(const HeapAllocator&) = delete;
+    ~HeapAllocator();
+
+    void* allocate(size_t size);
+    // The size must match the one the pointer was allocated with.
+    void deallocate(void* pointer, size_t size);
+    // Like realloc(): a null pointer allocates and a zero size frees.
+    void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+    // Keeps empty slabs for up to keepBytes of future allocations and returns the rest to the OS.
+    void releaseEmptySlabs(size_t keepBytes);
+
+    const AllocatorStats& getStats() const { return stats; }
+
+private:
+    struct FreeSlot
     {
-        free(pointer);
-        return nullptr;
-    }
+        FreeSlot* next;
+    };
+
+    // Lives at the start of its slab, so any object address finds it by masking.
+    struct Slab
+    {
+        // Links the slabs of a size class, either the ones with room left or the full ones.
+        Slab* previous = nullptr;
+        Slab* next = nullptr;
+        FreeSlot* freeSlots = nullptr;
+        uint8_t* bump = nullptr;
+        uint8_t* end = nullptr;
+        uint32_t live = 0;
+        uint32_t sizeClass = 0;
+        bool full = false;
+    };
+
+    struct SizeClass
+    {
+        Slab* available = nullptr;
+        Slab* full = nullptr;
+        size_t slabCount = 0;
+        size_t emptySlabs = 0;
+    };
+
+    static constexpr size_t CLASS_COUNT = MAX_SMALL_SIZE / GRANULARITY;
+
+    static size_t slotSize(size_t sizeClass) { return (sizeClass + 1) * GRANULARITY; }
+    static uint8_t* firstSlot(Slab* slab);
+
+    Slab* createSlab(uint32_t sizeClass);
+    void releaseSlab(Slab* slab);
+    void setFull(Slab* slab, bool full);
+    void reserve(size_t bytes);
 
-    void* result = realloc(pointer, newSize);
-    return result;
-}
+    std::array<SizeClass, CLASS_COUNT> classes;
+    AllocatorStats stats;
+};
 
-#endif
\ No newline at end of file
+#endif
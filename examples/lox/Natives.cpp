@@ -155,6 +155,7 @@ Value pop(int argCount, Value* args, VM* vm)
     }
 
     Value value = list->items.back();
+    snapshotBarrier(list);
     list->items.pop_back();
     return value;
 }
@@ -3,24 +3,46 @@
 #include <iostream>
 #include <string_view>
 #include <functional>
+#include <algorithm>
+#include <new>
 
 #include "Memory.h"
 #include "VM.h"
 
+// Size is sizeof(T) plus whatever the object keeps right after itself.
 template<class T, class... Args>
-T* allocate(Args&&... args)
+T* allocateSized(size_t size, Args&&... args)
 {
-    T* obj = new T(std::forward<Args>(args)...);
+    HeapAllocator& heap = VM::getInstance().getHeap();
+    void* memory = heap.allocate(size);
+    T* obj;
+    try
+    {
+        obj = new (memory) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        // A member such as a std::string can still throw, its slot must not leak.
+        heap.deallocate(memory, size);
+        throw;
+    }
 #ifdef DEBUG_LOG_GC
-    std::cout << obj << " allocate " << sizeof(*obj) << " for " << objTypeToString(obj->type) << std::endl;
+    std::cout << obj << " allocate " << size << " for " << objTypeToString(obj->type) << std::endl;
 #endif
 #ifdef DEBUG_STRESS_GC
-    VM::getInstance().collectGarbage();
+    // Young collections are the ones a missing write barrier breaks.
+    VM::getInstance().collectYoungGarbage();
 #endif
-    VM::getInstance().addObject(obj, sizeof(T));
+    VM::getInstance().addObject(obj, size);
     return obj;
 }
 
+template<class T, class... Args>
+T* allocate(Args&&... args)
+{
+    return allocateSized<T>(sizeof(T), std::forward<Args>(args)...);
+}
+
 
 uint32_t hashString(const char* key, int length)
 {
@@ -44,11 +66,23 @@ ObjString* allocateString(const char* chars, int length, uint32_t hash)
     return string;
 }
 
+namespace
+{
+    // The intern table doesn't keep its strings alive. One that was unreachable when a concurrent
+    // marking began is live again once it's found, and nothing would mark it otherwise.
+    ObjString* shadeInterned(ObjString* string)
+    {
+        if (concurrentMarkingActive)
+            string->isMarked = true;
+        return string;
+    }
+}
+
 ObjString* copyString(const char* chars, int length)
 {
     const uint32_t hash = hashString(chars, length);
     ObjString* interned = VM::getInstance().stringTable().findString(chars, length, hash);
-    if (interned != nullptr) return interned;
+    if (interned != nullptr) return shadeInterned(interned);
 
     return allocateString(chars, length, hash);
 }
@@ -57,7 +91,7 @@ ObjString* takeString(const char* chars, int length)
 {
     const uint32_t hash = hashString(chars, length);
     ObjString* interned = VM::getInstance().stringTable().findString(chars, length, hash);
-    if (interned != nullptr) return interned;
+    if (interned != nullptr) return shadeInterned(interned);
 
     return allocateString(chars, length, hash);
 }
@@ -71,7 +105,7 @@ ObjString* takeString(std::string_view chars)
 {
     const uint32_t hash = hashString(chars.data(), chars.length());
     ObjString* interned = VM::getInstance().stringTable().findString(chars.data(), chars.length(), hash);
-    if (interned != nullptr) return interned;
+    if (interned != nullptr) return shadeInterned(interned);
 
     return allocateString(chars.data(), static_cast<int>(chars.length()), hash);
 }
@@ -80,7 +114,7 @@ ObjString* takeString(std::string&& chars)
 {
     const uint32_t hash = hashString(chars.c_str(), chars.length());
     ObjString* interned = VM::getInstance().stringTable().findString(chars.c_str(), chars.length(), hash);
-    if (interned != nullptr) return interned;
+    if (interned != nullptr) return shadeInterned(interned);
 
     ObjString* string = allocate<ObjString>(std::move(chars));
     string->hash = hash;
@@ -89,6 +123,21 @@ ObjString* takeString(std::string&& chars)
     return string;
 }
 
+void recordWrite(Obj* owner, Obj* stored)
+{
+    VM::getInstance().recordWrite(owner, stored);
+}
+
+void recordAppend(Obj* owner, Obj* stored)
+{
+    VM::getInstance().recordAppend(owner, stored);
+}
+
+void snapshotObject(Obj* owner)
+{
+    VM::getInstance().snapshotObject(owner);
+}
+
 ObjUpvalue* newUpvalue(Value* slot)
 {
     return allocate<ObjUpvalue>(slot);
@@ -96,7 +145,10 @@ ObjUpvalue* newUpvalue(Value* slot)
 
 ObjInstance* newInstance(ObjClass* klass)
 {
-    return allocate<ObjInstance>(klass);
+    static_assert(sizeof(ObjInstance) % alignof(Value) == 0, "Inline slots follow the instance");
+    // Room for as many fields as the widest instance of the class had so far.
+    const size_t inlineCapacity = klass->slotHint;
+    return allocateSized<ObjInstance>(sizeof(ObjInstance) + inlineCapacity * sizeof(Value), klass, inlineCapacity);
 }
 
 ObjBoundMethod* newBoundMethod(const Value& receiver, Value& method)
@@ -109,6 +161,124 @@ ObjClass* newClass(ObjString* name)
     return allocate<ObjClass>(name);
 }
 
+Shape* ObjClass::transition(Shape* shape, ObjString* field)
+{
+    for (auto& [name, next] : shape->transitions)
+    {
+        if (name == field) return next.get();
+    }
+
+    if (shapeCount >= MAX_SHAPES || shape->names.size() >= MAX_SHAPE_SLOTS) return nullptr;
+
+    writeBarrier(this, field);
+    std::unique_ptr<Shape> next = std::make_unique<Shape>();
+    next->names = shape->names;
+    next->names.push_back(field);
+    shape->transitions.emplace_back(field, std::move(next));
+    shapeCount++;
+    slotHint = std::max(slotHint, shape->names.size() + 1);
+    return shape->transitions.back().second.get();
+}
+
+void ObjClass::markShapes(VM& vm) const
+{
+    // Every shape name was added by a transition, so marking the transition keys is enough.
+    std::vector<const Shape*> pending = { &rootShape };
+    while (!pending.empty())
+    {
+        const Shape* shape = pending.back();
+        pending.pop_back();
+        for (const auto& [name, next] : shape->transitions)
+        {
+            vm.markObject(name);
+            pending.push_back(next.get());
+        }
+    }
+}
+
+bool ObjInstance::getField(ObjString* name, Value* value) const
+{
+    if (shape)
+    {
+        const int slot = shape->findSlot(name);
+        if (slot < 0) return false;
+
+        *value = slots[slot];
+        return true;
+    }
+
+    return dictionary->get(name, value);
+}
+
+void ObjInstance::setField(ObjString* name, const Value& value)
+{
+    writeBarrier(this, name);
+    writeBarrier(this, value);
+    if (shape)
+    {
+        const int slot = shape->findSlot(name);
+        if (slot >= 0)
+        {
+            slots[slot] = value;
+            return;
+        }
+
+        if (Shape* next = klass->transition(shape, name))
+        {
+            shape = next;
+            slots.push_back(value);
+            return;
+        }
+
+        dictionary = std::make_unique<Table>();
+        for (size_t i = 0; i < slots.size(); ++i)
+        {
+            dictionary->set(shape->names[i], slots[i]);
+        }
+        shape = nullptr;
+        slots.clear();
+    }
+
+    dictionary->set(name, value);
+}
+
+void InstanceSlots::clear()
+{
+    heapValues.reset();
+    data = nullptr;
+    count = 0;
+    allocated = 0;
+}
+
+void InstanceSlots::grow()
+{
+    allocated = std::max<uint32_t>(allocated * 2, 4);
+    std::unique_ptr<Value[]> values = std::make_unique<Value[]>(allocated);
+    std::copy(data, data + count, values.get());
+    heapValues = std::move(values);
+    data = heapValues.get();
+}
+
+void ObjInstance::markFields(VM& vm)
+{
+    for (Value& value : slots)
+    {
+        vm.markValue(value);
+    }
+
+    if (dictionary) dictionary->mark();
+}
+
+size_t ObjInstance::getFieldsSize() const
+{
+    size_t fieldsSize = slots.capacity() * sizeof(Value);
+    for (const Value& value : slots)
+    {
+        fieldsSize += sizeOf(value) - sizeof(Value);
+    }
+    return fieldsSize + (dictionary ? dictionary->getSize() : 0);
+}
+
 ObjClosure* newClosure(ObjFunction* function)
 {
     return allocate<ObjClosure>(function);
@@ -142,9 +312,9 @@ ObjMap* newMap()
 
 size_t ValueHasher::operator()(const Value& value) const
 {
-    const size_t typeHash = std::hash<unsigned int>{}(static_cast<unsigned int>(value.type));
+    const size_t typeHash = std::hash<unsigned int>{}(static_cast<unsigned int>(valueType(value)));
     size_t valueHash = 0;
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::NIL: break;
     case ValueType::BOOL: valueHash = std::hash<bool>{}(asBoolean(value)); break;
@@ -159,10 +329,13 @@ bool ObjMap::set(const Value& key, const Value& value)
     const auto found = indices.find(key);
     if (found != indices.end())
     {
+        writeBarrier(this, value);
         entries[found->second].value = value;
         return false;
     }
 
+    appendBarrier(this, key);
+    appendBarrier(this, value);
     const size_t index = entries.size();
     entries.push_back({ key, value, true });
     indices.emplace(key, index);
@@ -184,6 +357,7 @@ bool ObjMap::remove(const Value& key, Value* value)
     const auto found = indices.find(key);
     if (found == indices.end())
         return false;
+    snapshotBarrier(this);
     MapEntry& entry = entries[found->second];
     if (value)
         *value = entry.value;
@@ -202,6 +376,7 @@ bool ObjMap::replaceKey(const Value& oldKey, const Value& newKey)
     if (indices.find(newKey) != indices.end())
         return false;
 
+    writeBarrier(this, newKey);
     const size_t index = oldEntry->second;
     indices.erase(oldEntry);
     entries[index].key = newKey;
@@ -211,6 +386,7 @@ bool ObjMap::replaceKey(const Value& oldKey, const Value& newKey)
 
 void ObjMap::clear()
 {
+    snapshotBarrier(this);
     entries.clear();
     indices.clear();
 }
@@ -369,7 +545,7 @@ size_t sizeOfObject(const Value& value)
         return sizeof(ObjClass)
             + asClass(value)->methods.getSize()
             + sizeOf(asClass(value)->initializer) - sizeof(Value);
-    case ObjType::INSTANCE: return sizeof(ObjInstance) + asInstance(value)->fields.getSize();
+    case ObjType::INSTANCE: return sizeof(ObjInstance) + asInstance(value)->getFieldsSize();
     }
 
     static_assert(static_cast<int>(ObjType::COUNT) == 11, "Missing enum value");
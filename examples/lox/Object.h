@@ -6,6 +6,10 @@
 #include <iostream>
 #include <cmath>
 #include <unordered_map>
+#include <memory>
+#include <new>
+#include <vector>
+#include <atomic>
 
 #include "Common.h"
 #include "Chunk.h"
@@ -51,12 +55,44 @@ inline const char* objTypeToString(const ObjType type)
     static_assert(static_cast<int>(ObjType::COUNT) == 11, "Missing enum value");
 }
 
+// Mark bit of an object. The background marker sets it while the script runs, so it is a
+// relaxed atomic. That compiles to a plain load or store.
+class GcMark
+{
+public:
+    GcMark(bool marked = false) : marked(marked) {}
+    GcMark(const GcMark&) = delete;
+    GcMark& operator=(const GcMark&) = delete;
+
+    operator bool() const { return marked.load(std::memory_order_relaxed); }
+    GcMark& operator=(bool value)
+    {
+        marked.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+
+private:
+    std::atomic<bool> marked;
+};
+
+// Progress of an object through a concurrent marking. Whoever moves it out of UNSCANNED,
+// the marker or the script, reads its references. Only SCANNED objects may change.
+enum class ScanState : uint8_t
+{
+    UNSCANNED,
+    SCANNING,
+    SCANNED
+};
+
 struct Obj
 {
     Obj(ObjType type)
         : type(type)
         , hash(0)
         , isMarked(false)
+        , isOld(false)
+        , isRemembered(false)
+        , scanState(ScanState::UNSCANNED)
         , allocationSize(0)
     {}
 
@@ -64,10 +100,61 @@ struct Obj
 
     ObjType type;
     uint32_t hash;
-    bool isMarked;
+    GcMark isMarked;
+    // Survived a young collection, or was made outside of run().
+    bool isOld;
+    // Old object in the remembered set, it may point to young objects.
+    bool isRemembered;
+    std::atomic<ScanState> scanState;
     size_t allocationSize;
 };
 
+void recordWrite(Obj* owner, Obj* stored);
+void recordAppend(Obj* owner, Obj* stored);
+void snapshotObject(Obj* owner);
+
+// Set while a marker thread traces the heap as it was when the collection began.
+inline bool concurrentMarkingActive = false;
+
+// Every change to an object the marker could still read goes through this first, numbers and
+// removals included. The object is scanned before it changes, so the marker only ever sees the
+// references it had when the collection began.
+inline void snapshotBarrier(Obj* owner)
+{
+    if (concurrentMarkingActive && owner->scanState.load(std::memory_order_acquire) != ScanState::SCANNED)
+        snapshotObject(owner);
+}
+
+// Every store of an object into another one goes through this. Young collections have to find
+// the young objects only an old one points to, and while a full collection is marking, a marked
+// object must not hide an unmarked one from it.
+inline void writeBarrier(Obj* owner, Obj* stored)
+{
+    snapshotBarrier(owner);
+    if (stored && ((owner->isOld && !owner->isRemembered && !stored->isOld) || (owner->isMarked && !stored->isMarked)))
+        recordWrite(owner, stored);
+}
+
+inline void writeBarrier(Obj* owner, const Value& stored)
+{
+    if (isObject(stored))
+        writeBarrier(owner, asObject(stored));
+    else
+        snapshotBarrier(owner);
+}
+
+// Stores that grow the owner remember the value instead, which spares young collections
+// a walk over all of a big list or map.
+inline void appendBarrier(Obj* owner, const Value& stored)
+{
+    snapshotBarrier(owner);
+    if (!isObject(stored)) return;
+
+    Obj* object = asObject(stored);
+    if ((owner->isOld && !object->isOld) || (owner->isMarked && !object->isMarked))
+        recordAppend(owner, object);
+}
+
 struct ObjString : Obj
 {
     ObjString(const char* chars, int length)
@@ -140,6 +227,23 @@ struct ObjClosure : Obj
     std::vector<ObjUpvalue*> upvalues;
 };
 
+// Hidden class shared by the instances that received the same fields in the
+// same order. Each field lives at a fixed index of the instance slot array.
+struct Shape
+{
+    int findSlot(const ObjString* name) const
+    {
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            if (names[i] == name) return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    std::vector<ObjString*> names;
+    std::vector<std::pair<ObjString*, std::unique_ptr<Shape>>> transitions;
+};
+
 struct ObjClass : Obj
 {
     ObjClass(ObjString* name)
@@ -148,20 +252,85 @@ struct ObjClass : Obj
         , initializer()
     {}
 
+    Shape* transition(Shape* shape, ObjString* field);
+    void markShapes(VM& vm) const;
+
+    // Classes that keep growing shapes, or very wide instances, are cheaper as dictionaries.
+    static constexpr size_t MAX_SHAPES = 64;
+    static constexpr size_t MAX_SHAPE_SLOTS = 64;
+
     ObjString* name;
     Table methods;
     Value initializer;
+    Shape rootShape;
+    size_t shapeCount = 1;
+    size_t slotHint = 0;
+};
+
+// Field values of an instance in shape slot order. The first few live right after the
+// ObjInstance, in the same allocation. Growing past them moves every value to the heap.
+class InstanceSlots
+{
+public:
+    InstanceSlots(Value* inlineStorage, size_t inlineCapacity)
+        : data(inlineStorage)
+        , count(0)
+        , allocated(static_cast<uint32_t>(inlineCapacity))
+    {}
+    InstanceSlots(const InstanceSlots&) = delete;
+    InstanceSlots& operator=(const InstanceSlots&) = delete;
+
+    Value& operator[](size_t index) { return data[index]; }
+    const Value& operator[](size_t index) const { return data[index]; }
+    size_t size() const { return count; }
+    size_t capacity() const { return allocated; }
+    bool isInline() const { return !heapValues; }
+    Value* begin() { return data; }
+    Value* end() { return data + count; }
+    const Value* begin() const { return data; }
+    const Value* end() const { return data + count; }
+
+    void push_back(const Value& value)
+    {
+        if (count == allocated)
+        {
+            grow();
+        }
+        new (data + count) Value(value);
+        count++;
+    }
+    // Used when the instance switches to dictionary mode.
+    void clear();
+
+private:
+    void grow();
+
+    Value* data;
+    uint32_t count;
+    uint32_t allocated;
+    std::unique_ptr<Value[]> heapValues;
 };
 
 struct ObjInstance : Obj
 {
-    ObjInstance(ObjClass* klass)
+    // Allocated by newInstance() with room for inlineCapacity values after the object.
+    ObjInstance(ObjClass* klass, size_t inlineCapacity)
         : Obj(ObjType::INSTANCE)
         , klass(klass)
+        , shape(&klass->rootShape)
+        , slots(reinterpret_cast<Value*>(this + 1), inlineCapacity)
     {}
 
+    bool getField(ObjString* name, Value* value) const;
+    void setField(ObjString* name, const Value& value);
+    void markFields(VM& vm);
+    size_t getFieldsSize() const;
+
     ObjClass* klass;
-    Table fields;
+    // Null once the instance has switched to dictionary mode.
+    Shape* shape;
+    InstanceSlots slots;
+    std::unique_ptr<Table> dictionary;
 };
 
 struct ObjBoundMethod  : Obj
@@ -265,11 +434,13 @@ struct ObjList : Obj
 
     void append(Value value)
     {
+        appendBarrier(this, value);
         items.push_back(value);
     }
 
     void setValue(int index, Value value)
     {
+        writeBarrier(this, value);
         items[index] = value;
     }
 
@@ -280,6 +451,7 @@ struct ObjList : Obj
 
     void deleteValue(int index)
     {
+        snapshotBarrier(this);
         items.erase(items.begin() + index);
     }
 
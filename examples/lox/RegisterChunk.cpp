@@ -0,0 +1,560 @@
+#include "RegisterChunk.h"
+
+#include <algorithm>
+
+#include "Chunk.h"
+#include "Superinstructions.h"
+
+namespace
+{
+    constexpr uint16_t MAX_REGISTER = RegisterChunk::CONSTANT_OPERAND - 1;
+
+    uint32_t readDWord(const Chunk& chunk, size_t offset)
+    {
+        return *reinterpret_cast<const uint32_t*>(&chunk.code[offset]);
+    }
+
+    size_t jumpTarget(const Chunk& chunk, size_t offset)
+    {
+        const uint16_t jump = static_cast<uint16_t>(chunk.code[offset + 1] | (chunk.code[offset + 2] << 8));
+        return static_cast<OpCode>(chunk.code[offset]) == OpCode::OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+    }
+
+    // How many values the instruction pops and pushes, or false when it can't be lowered.
+    bool stackEffect(const Chunk& chunk, size_t offset, int& pops, int& pushes)
+    {
+        pops = 0;
+        pushes = 0;
+        switch (static_cast<OpCode>(chunk.code[offset]))
+        {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_CONSTANT_LONG:
+        case OpCode::OP_NIL:
+        case OpCode::OP_TRUE:
+        case OpCode::OP_FALSE:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_GET_LOCAL_LONG:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_GET_GLOBAL_LONG:
+        case OpCode::OP_BUILD_LIST:
+            pushes = 1;
+            return true;
+        case OpCode::OP_POP:
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_DEFINE_GLOBAL_LONG:
+        case OpCode::OP_APPEND_LIST:
+        case OpCode::OP_RETURN:
+            pops = 1;
+            return true;
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_SET_LOCAL_LONG:
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL_LONG:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_LOOP:
+            return true;
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_NOT:
+        case OpCode::OP_INCREMENT:
+        case OpCode::OP_TO_STRING:
+            pops = 1;
+            pushes = 1;
+            return true;
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_LESS:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_MODULO:
+        case OpCode::OP_MIN:
+        case OpCode::OP_MAX:
+        case OpCode::OP_ADD_NUM:
+        case OpCode::OP_SUBTRACT_NUM:
+        case OpCode::OP_MULTIPLY_NUM:
+        case OpCode::OP_LESS_NUM:
+        case OpCode::OP_GREATER_NUM:
+        case OpCode::OP_MODULO_NUM:
+        case OpCode::OP_EQUAL_NUM:
+        case OpCode::OP_INDEX_SUBSCR:
+        case OpCode::OP_RANGE_IN_BOUNDS:
+            pops = 2;
+            pushes = 1;
+            return true;
+        case OpCode::OP_STORE_SUBSCR:
+            pops = 3;
+            pushes = 1;
+            return true;
+        case OpCode::OP_CALL:
+            pops = chunk.code[offset + 1] + 1;
+            pushes = 1;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    RegisterOp binaryOperator(OpCode instruction)
+    {
+        switch (instruction)
+        {
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_EQUAL_NUM:        return RegisterOp::EQUAL;
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_NUM:         return RegisterOp::LESS;
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_NUM:      return RegisterOp::GREATER;
+        case OpCode::OP_ADD:
+        case OpCode::OP_ADD_NUM:          return RegisterOp::ADD;
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_SUBTRACT_NUM:     return RegisterOp::SUBTRACT;
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_MULTIPLY_NUM:     return RegisterOp::MULTIPLY;
+        case OpCode::OP_DIVIDE:           return RegisterOp::DIVIDE;
+        case OpCode::OP_MODULO:
+        case OpCode::OP_MODULO_NUM:       return RegisterOp::MODULO;
+        case OpCode::OP_MIN:              return RegisterOp::MIN;
+        case OpCode::OP_MAX:              return RegisterOp::MAX;
+        case OpCode::OP_INDEX_SUBSCR:     return RegisterOp::INDEX_SUBSCR;
+        case OpCode::OP_RANGE_IN_BOUNDS:  return RegisterOp::RANGE_IN_BOUNDS;
+        default:                          return RegisterOp::COUNT;
+        }
+    }
+
+    RegisterOp unaryOperator(OpCode instruction)
+    {
+        switch (instruction)
+        {
+        case OpCode::OP_NEGATE:     return RegisterOp::NEGATE;
+        case OpCode::OP_NOT:        return RegisterOp::NOT;
+        case OpCode::OP_INCREMENT:  return RegisterOp::INCREMENT;
+        case OpCode::OP_TO_STRING:  return RegisterOp::TO_STRING;
+        default:                    return RegisterOp::COUNT;
+        }
+    }
+
+    // A value of the simulated stack. Pending values haven't been copied into their own
+    // register yet: they are a constant or a local that the next instruction can read directly.
+    struct StackValue
+    {
+        enum class Kind
+        {
+            InRegister,
+            Pending,
+            // Written by the last emitted instruction, whose destination can still change.
+            Result,
+        };
+
+        Kind kind = Kind::InRegister;
+        uint16_t operand = 0;
+        size_t instruction = 0;
+    };
+
+    struct PendingJump
+    {
+        size_t instruction;
+        size_t oldTarget;
+    };
+
+    class Lowering
+    {
+    public:
+        Lowering(Chunk& chunk, int arity)
+            : chunk(chunk)
+            , arity(arity)
+        {}
+
+        bool run();
+
+    private:
+        bool computeDepths();
+        bool lower(size_t offset);
+
+        void emit(RegisterOp op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0)
+        {
+            RegisterInstruction instruction;
+            instruction.op = op;
+            instruction.a = a;
+            instruction.b = b;
+            instruction.c = c;
+            code.push_back(instruction);
+            lines.push_back(line);
+        }
+
+        uint16_t top() const { return static_cast<uint16_t>(stack.size() - 1); }
+
+        // The operand an instruction uses to read the value at the given stack index.
+        uint16_t operandAt(size_t index) const
+        {
+            const StackValue& value = stack[index];
+            return value.kind == StackValue::Kind::Pending ? value.operand : static_cast<uint16_t>(index);
+        }
+
+        void materialize(size_t index)
+        {
+            StackValue& value = stack[index];
+            if (value.kind == StackValue::Kind::Pending)
+            {
+                emit(RegisterOp::MOVE, static_cast<uint16_t>(index), value.operand);
+            }
+            value.kind = StackValue::Kind::InRegister;
+        }
+
+        void materializeAll()
+        {
+            for (size_t index = 0; index < stack.size(); ++index)
+            {
+                materialize(index);
+            }
+        }
+
+        void pushResult()
+        {
+            stack.push_back({ StackValue::Kind::Result, 0, code.size() - 1 });
+        }
+
+        // True when the top value was written by the last emitted instruction.
+        bool topIsLastResult() const
+        {
+            return !stack.empty() && stack.back().kind == StackValue::Kind::Result && stack.back().instruction + 1 == code.size();
+        }
+
+        bool constantOperand(uint32_t constant, uint16_t& operand) const
+        {
+            if (constant > MAX_REGISTER) return false;
+            operand = static_cast<uint16_t>(constant | RegisterChunk::CONSTANT_OPERAND);
+            return true;
+        }
+
+        Chunk& chunk;
+        const int arity;
+
+        std::vector<size_t> starts;
+        // Stack depth before each instruction, -1 when it can't be reached.
+        std::vector<int> depths;
+        std::vector<bool> jumpTargets;
+        int maxDepth = 0;
+
+        std::vector<StackValue> stack;
+        std::vector<RegisterInstruction> code;
+        std::vector<int> lines;
+        std::vector<size_t> newIndices;
+        std::vector<PendingJump> jumps;
+        int line = 0;
+    };
+
+    bool Lowering::computeDepths()
+    {
+        const ChunkInstructions& bytes = chunk.code;
+        depths.assign(bytes.size() + 1, -1);
+        jumpTargets.assign(bytes.size() + 1, false);
+
+        for (size_t offset = 0; offset < bytes.size(); offset += instructionLength(chunk, offset))
+        {
+            starts.push_back(offset);
+        }
+
+        std::vector<size_t> worklist;
+        auto reach = [&](size_t offset, int depth)
+        {
+            if (offset >= bytes.size()) return false;
+            if (depths[offset] == -1)
+            {
+                depths[offset] = depth;
+                worklist.push_back(offset);
+                return true;
+            }
+            // Every path has to agree on the stack depth, or registers can't be assigned.
+            return depths[offset] == depth;
+        };
+
+        if (!reach(0, arity + 1)) return false;
+        while (!worklist.empty())
+        {
+            const size_t offset = worklist.back();
+            worklist.pop_back();
+
+            int pops = 0;
+            int pushes = 0;
+            if (!stackEffect(chunk, offset, pops, pushes)) return false;
+
+            const int depth = depths[offset] - pops;
+            if (depth < 0) return false;
+            maxDepth = std::max(maxDepth, std::max(depths[offset], depth + pushes));
+
+            const OpCode instruction = static_cast<OpCode>(bytes[offset]);
+            if (instruction == OpCode::OP_JUMP || instruction == OpCode::OP_JUMP_IF_FALSE || instruction == OpCode::OP_LOOP)
+            {
+                const size_t target = jumpTarget(chunk, offset);
+                jumpTargets[target] = true;
+                if (!reach(target, depth + pushes)) return false;
+            }
+            if (instruction != OpCode::OP_JUMP && instruction != OpCode::OP_LOOP && instruction != OpCode::OP_RETURN)
+            {
+                if (!reach(offset + instructionLength(chunk, offset), depth + pushes)) return false;
+            }
+        }
+
+        return maxDepth <= MAX_REGISTER;
+    }
+
+    bool Lowering::run()
+    {
+        if (chunk.code.empty() || !computeDepths()) return false;
+
+        newIndices.assign(chunk.code.size() + 1, 0);
+        bool reachable = false;
+        for (const size_t offset : starts)
+        {
+            if (depths[offset] == -1)
+            {
+                reachable = false;
+                continue;
+            }
+
+            // Every path into a jump target leaves all values in their registers.
+            if (jumpTargets[offset] || !reachable)
+            {
+                if (reachable) materializeAll();
+                stack.assign(static_cast<size_t>(depths[offset]), StackValue());
+            }
+            reachable = true;
+
+            newIndices[offset] = code.size();
+            line = chunk.lines[offset];
+            if (!lower(offset)) return false;
+
+            const OpCode instruction = static_cast<OpCode>(chunk.code[offset]);
+            if (instruction == OpCode::OP_JUMP || instruction == OpCode::OP_LOOP || instruction == OpCode::OP_RETURN)
+            {
+                reachable = false;
+            }
+        }
+
+        if (code.size() > MAX_REGISTER) return false;
+        for (const PendingJump& jump : jumps)
+        {
+            RegisterInstruction& instruction = code[jump.instruction];
+            const uint16_t target = static_cast<uint16_t>(newIndices[jump.oldTarget]);
+            switch (instruction.op)
+            {
+            case RegisterOp::JUMP:              instruction.a = target; break;
+            case RegisterOp::JUMP_IF_FALSE:     instruction.b = target; break;
+            default:                            instruction.c = target; break;
+            }
+        }
+
+        chunk.registers.code = std::move(code);
+        chunk.registers.lines = std::move(lines);
+        chunk.registers.registerCount = static_cast<uint16_t>(maxDepth);
+        return true;
+    }
+
+    bool Lowering::lower(size_t offset)
+    {
+        const OpCode instruction = static_cast<OpCode>(chunk.code[offset]);
+        const uint16_t destination = static_cast<uint16_t>(stack.size());
+
+        switch (instruction)
+        {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_CONSTANT_LONG:
+        {
+            const uint32_t constant = instruction == OpCode::OP_CONSTANT ? chunk.code[offset + 1] : readDWord(chunk, offset + 1);
+            uint16_t operand = 0;
+            if (!constantOperand(constant, operand)) return false;
+            stack.push_back({ StackValue::Kind::Pending, operand, 0 });
+            return true;
+        }
+        case OpCode::OP_NIL:
+        case OpCode::OP_TRUE:
+        case OpCode::OP_FALSE:
+        {
+            const Value literal = instruction == OpCode::OP_NIL ? Value() : Value(instruction == OpCode::OP_TRUE);
+            uint16_t operand = 0;
+            if (!constantOperand(chunk.addConstant(literal), operand)) return false;
+            stack.push_back({ StackValue::Kind::Pending, operand, 0 });
+            return true;
+        }
+        case OpCode::OP_POP:
+            stack.pop_back();
+            return true;
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_GET_LOCAL_LONG:
+        {
+            const uint32_t slot = instruction == OpCode::OP_GET_LOCAL ? chunk.code[offset + 1] : readDWord(chunk, offset + 1);
+            if (slot >= stack.size()) return false;
+            materialize(slot);
+            stack.push_back({ StackValue::Kind::Pending, static_cast<uint16_t>(slot), 0 });
+            return true;
+        }
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_SET_LOCAL_LONG:
+        {
+            const uint32_t slot = instruction == OpCode::OP_SET_LOCAL ? chunk.code[offset + 1] : readDWord(chunk, offset + 1);
+            if (slot >= stack.size()) return false;
+            // The graph compiler declares locals by assigning the value to its own slot.
+            if (slot == top()) return true;
+            materialize(slot);
+
+            // Values still reading the local have to be copied out before it changes.
+            bool aliased = false;
+            for (size_t index = slot + 1; index < stack.size() - 1; ++index)
+            {
+                if (stack[index].kind == StackValue::Kind::Pending && stack[index].operand == slot)
+                {
+                    materialize(index);
+                    aliased = true;
+                }
+            }
+
+            if (!aliased && topIsLastResult())
+            {
+                // Write the result straight into the local instead of copying it.
+                code.back().a = static_cast<uint16_t>(slot);
+            }
+            else
+            {
+                emit(RegisterOp::MOVE, static_cast<uint16_t>(slot), operandAt(stack.size() - 1));
+            }
+            stack.back() = { StackValue::Kind::Pending, static_cast<uint16_t>(slot), 0 };
+            return true;
+        }
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_GET_GLOBAL_LONG:
+        {
+            const uint32_t slot = instruction == OpCode::OP_GET_GLOBAL ? chunk.code[offset + 1] : readDWord(chunk, offset + 1);
+            emit(RegisterOp::GET_GLOBAL, destination, static_cast<uint16_t>(slot & 0xffff), static_cast<uint16_t>(slot >> 16));
+            pushResult();
+            return true;
+        }
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL_LONG:
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_DEFINE_GLOBAL_LONG:
+        {
+            const bool shortOperand = instruction == OpCode::OP_SET_GLOBAL || instruction == OpCode::OP_DEFINE_GLOBAL;
+            const uint32_t slot = shortOperand ? chunk.code[offset + 1] : readDWord(chunk, offset + 1);
+            const bool define = instruction == OpCode::OP_DEFINE_GLOBAL || instruction == OpCode::OP_DEFINE_GLOBAL_LONG;
+            emit(define ? RegisterOp::DEFINE_GLOBAL : RegisterOp::SET_GLOBAL, operandAt(top()),
+                 static_cast<uint16_t>(slot & 0xffff), static_cast<uint16_t>(slot >> 16));
+            if (define) stack.pop_back();
+            return true;
+        }
+        case OpCode::OP_BUILD_LIST:
+            emit(RegisterOp::BUILD_LIST, destination);
+            stack.push_back(StackValue());
+            return true;
+        case OpCode::OP_APPEND_LIST:
+        {
+            const uint16_t item = operandAt(top());
+            stack.pop_back();
+            materialize(top());
+            emit(RegisterOp::APPEND_LIST, top(), item);
+            return true;
+        }
+        case OpCode::OP_STORE_SUBSCR:
+        {
+            const StackValue itemValue = stack.back();
+            const uint16_t item = operandAt(top());
+            const uint16_t index = operandAt(top() - 1);
+            const uint16_t source = operandAt(top() - 2);
+            stack.resize(stack.size() - 3);
+            emit(RegisterOp::STORE_SUBSCR, source, index, item);
+            if (itemValue.kind == StackValue::Kind::Pending)
+            {
+                stack.push_back(itemValue);
+                return true;
+            }
+            // The item is in a register above the stack, which later pushes reuse.
+            emit(RegisterOp::MOVE, static_cast<uint16_t>(stack.size()), item);
+            stack.push_back(StackValue());
+            return true;
+        }
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+            materializeAll();
+            jumps.push_back({ code.size(), jumpTarget(chunk, offset) });
+            emit(RegisterOp::JUMP);
+            return true;
+        case OpCode::OP_JUMP_IF_FALSE:
+        {
+            const size_t target = jumpTarget(chunk, offset);
+            const size_t next = offset + instructionLength(chunk, offset);
+            // When both paths pop the condition straight away it never needs its own register.
+            const bool conditionDropped = static_cast<OpCode>(chunk.code[target]) == OpCode::OP_POP
+                && next < chunk.code.size() && static_cast<OpCode>(chunk.code[next]) == OpCode::OP_POP;
+
+            for (size_t index = 0; index + 1 < stack.size(); ++index)
+            {
+                materialize(index);
+            }
+
+            if (conditionDropped && topIsLastResult() && code.back().op == RegisterOp::LESS)
+            {
+                RegisterInstruction& less = code.back();
+                less.op = RegisterOp::JUMP_IF_NOT_LESS;
+                less.a = less.b;
+                less.b = less.c;
+                jumps.push_back({ code.size() - 1, target });
+                return true;
+            }
+
+            if (!conditionDropped) materialize(top());
+            jumps.push_back({ code.size(), target });
+            emit(RegisterOp::JUMP_IF_FALSE, operandAt(top()));
+            return true;
+        }
+        case OpCode::OP_CALL:
+        {
+            const uint8_t argCount = chunk.code[offset + 1];
+            const size_t callee = stack.size() - argCount - 1;
+            for (size_t index = callee; index < stack.size(); ++index)
+            {
+                materialize(index);
+            }
+            stack.resize(callee);
+            emit(RegisterOp::CALL, static_cast<uint16_t>(callee), argCount);
+            stack.push_back(StackValue());
+            return true;
+        }
+        case OpCode::OP_RETURN:
+            emit(RegisterOp::RETURN, operandAt(top()));
+            stack.pop_back();
+            return true;
+        default:
+            break;
+        }
+
+        const RegisterOp unary = unaryOperator(instruction);
+        if (unary != RegisterOp::COUNT)
+        {
+            const uint16_t operand = operandAt(top());
+            stack.pop_back();
+            emit(unary, static_cast<uint16_t>(stack.size()), operand);
+            pushResult();
+            return true;
+        }
+
+        const RegisterOp binary = binaryOperator(instruction);
+        if (binary != RegisterOp::COUNT)
+        {
+            const uint16_t right = operandAt(top());
+            const uint16_t left = operandAt(top() - 1);
+            stack.resize(stack.size() - 2);
+            emit(binary, static_cast<uint16_t>(stack.size()), left, right);
+            pushResult();
+            return true;
+        }
+
+        return false;
+    }
+}
+
+bool lowerToRegisters(Chunk& chunk, int arity)
+{
+    chunk.registers = RegisterChunk();
+    return Lowering(chunk, arity).run();
+}
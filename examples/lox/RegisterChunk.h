@@ -0,0 +1,79 @@
+#ifndef loxcpp_register_chunk_h
+#define loxcpp_register_chunk_h
+
+#include <memory>
+#include <vector>
+
+#include "Common.h"
+
+struct Chunk;
+struct JitCode;
+
+// Registers are the frame's stack slots: slot 0 is the callee, then the parameters, the
+// locals and the temporaries. Operands marked RK are either a register or, when
+// CONSTANT_OPERAND is set, an index into the constants of the function's chunk.
+enum class RegisterOp : uint8_t
+{
+    MOVE,               // a = RK(b)
+    GET_GLOBAL,         // a = globals[b | c << 16]
+    SET_GLOBAL,         // globals[b | c << 16] = RK(a)
+    DEFINE_GLOBAL,      // define globals[b | c << 16] = RK(a)
+    EQUAL,              // a = RK(b) == RK(c)
+    LESS,               // a = RK(b) < RK(c)
+    GREATER,            // a = RK(b) > RK(c)
+    ADD,                // a = RK(b) + RK(c)
+    SUBTRACT,           // a = RK(b) - RK(c)
+    MULTIPLY,           // a = RK(b) * RK(c)
+    DIVIDE,             // a = RK(b) / RK(c)
+    MODULO,             // a = fmod(RK(b), RK(c))
+    MIN,                // a = min(RK(b), RK(c))
+    MAX,                // a = max(RK(b), RK(c))
+    NEGATE,             // a = -RK(b)
+    NOT,                // a = !RK(b)
+    INCREMENT,          // a = RK(b) + 1
+    TO_STRING,          // a = string(RK(b))
+    BUILD_LIST,         // a = []
+    APPEND_LIST,        // a.append(RK(b))
+    INDEX_SUBSCR,       // a = RK(b)[RK(c)]
+    STORE_SUBSCR,       // RK(a)[RK(b)] = RK(c)
+    RANGE_IN_BOUNDS,    // a = RK(c) is a valid index of RK(b)
+    JUMP,               // go to instruction a
+    JUMP_IF_FALSE,      // if RK(a) is falsey, go to instruction b
+    JUMP_IF_NOT_LESS,   // if !(RK(a) < RK(b)), go to instruction c
+    CALL,               // a = a(a + 1, ..., a + b)
+    RETURN,             // return RK(a)
+
+    COUNT
+};
+
+struct RegisterInstruction
+{
+    RegisterOp op;
+    uint16_t a = 0;
+    uint16_t b = 0;
+    uint16_t c = 0;
+};
+
+struct RegisterChunk
+{
+    static constexpr uint16_t CONSTANT_OPERAND = 0x8000;
+
+    bool empty() const { return code.empty(); }
+
+    std::vector<RegisterInstruction> code;
+    std::vector<int> lines;
+    uint16_t registerCount = 0;
+
+    // Only used when lox is built with VLOX_JIT, see VM::hotJitCode().
+    bool jitEnabled = false;
+    bool jitFailed = false;
+    uint32_t hotness = 0;
+    std::shared_ptr<const JitCode> jit;
+};
+
+// Translates the stack bytecode of a finished function into chunk.registers. Functions that
+// use instructions the register interpreter doesn't support are left with empty register code
+// and keep running on the stack interpreter.
+bool lowerToRegisters(Chunk& chunk, int arity);
+
+#endif
@@ -0,0 +1,290 @@
+#include "Superinstructions.h"
+
+#include <initializer_list>
+#include <utility>
+
+#include "Compiler.h"
+#include "Object.h"
+
+namespace
+{
+    // Jump operands are always the last 2 bytes of the instruction.
+    int jumpOperandOffset(OpCode instruction)
+    {
+        switch (instruction)
+        {
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_LOOP:
+        case OpCode::OP_LESS_JUMP_IF_FALSE:
+            return 1;
+        case OpCode::OP_LESS_LOCALS_JUMP_IF_FALSE:
+        case OpCode::OP_RANGE_LOCALS_JUMP_IF_FALSE:
+            return 3;
+        default:
+            return -1;
+        }
+    }
+
+    size_t jumpTarget(const Chunk& chunk, size_t offset)
+    {
+        const OpCode instruction = static_cast<OpCode>(chunk.code[offset]);
+        const size_t operand = offset + jumpOperandOffset(instruction);
+        const uint16_t jump = static_cast<uint16_t>(chunk.code[operand] | (chunk.code[operand + 1] << 8));
+
+        return instruction == OpCode::OP_LOOP ? operand + 2 - jump : operand + 2 + jump;
+    }
+
+    // The fused instructions check their operand types themselves, so number-only
+    // operations can be matched like the generic ones.
+    OpCode genericVariant(OpCode instruction)
+    {
+        switch (instruction)
+        {
+        case OpCode::OP_ADD_NUM:      return OpCode::OP_ADD;
+        case OpCode::OP_SUBTRACT_NUM: return OpCode::OP_SUBTRACT;
+        case OpCode::OP_MULTIPLY_NUM: return OpCode::OP_MULTIPLY;
+        case OpCode::OP_LESS_NUM:     return OpCode::OP_LESS;
+        case OpCode::OP_GREATER_NUM:  return OpCode::OP_GREATER;
+        case OpCode::OP_MODULO_NUM:   return OpCode::OP_MODULO;
+        case OpCode::OP_EQUAL_NUM:    return OpCode::OP_EQUAL;
+        default:                      return instruction;
+        }
+    }
+
+    struct PendingJump
+    {
+        size_t operand;
+        size_t oldTarget;
+        bool backwards;
+    };
+
+    const std::pair<OpCode, OpCode> localOperators[] =
+    {
+        { OpCode::OP_ADD, OpCode::OP_ADD_LOCALS },
+        { OpCode::OP_SUBTRACT, OpCode::OP_SUBTRACT_LOCALS },
+        { OpCode::OP_MULTIPLY, OpCode::OP_MULTIPLY_LOCALS },
+        { OpCode::OP_LESS, OpCode::OP_LESS_LOCALS },
+    };
+}
+
+size_t instructionLength(const Chunk& chunk, size_t offset)
+{
+    switch (static_cast<OpCode>(chunk.code[offset]))
+    {
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_SET_LOCAL:
+    case OpCode::OP_GET_GLOBAL:
+    case OpCode::OP_DEFINE_GLOBAL:
+    case OpCode::OP_SET_GLOBAL:
+    case OpCode::OP_GET_UPVALUE:
+    case OpCode::OP_SET_UPVALUE:
+    case OpCode::OP_GET_PROPERTY:
+    case OpCode::OP_SET_PROPERTY:
+    case OpCode::OP_GET_PROPERTY_SLOT:
+    case OpCode::OP_CALL:
+    case OpCode::OP_CLASS:
+    case OpCode::OP_METHOD:
+    case OpCode::OP_POPN:
+    case OpCode::OP_INCREMENT_LOCAL:
+        return 2;
+    case OpCode::OP_JUMP:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_LOOP:
+    case OpCode::OP_INVOKE:
+    case OpCode::OP_ADD_LOCALS:
+    case OpCode::OP_SUBTRACT_LOCALS:
+    case OpCode::OP_MULTIPLY_LOCALS:
+    case OpCode::OP_LESS_LOCALS:
+    case OpCode::OP_LESS_JUMP_IF_FALSE:
+        return 3;
+    case OpCode::OP_CONSTANT_LONG:
+    case OpCode::OP_GET_LOCAL_LONG:
+    case OpCode::OP_SET_LOCAL_LONG:
+    case OpCode::OP_GET_GLOBAL_LONG:
+    case OpCode::OP_DEFINE_GLOBAL_LONG:
+    case OpCode::OP_SET_GLOBAL_LONG:
+    case OpCode::OP_GET_PROPERTY_LONG:
+    case OpCode::OP_SET_PROPERTY_LONG:
+    case OpCode::OP_CLASS_LONG:
+    case OpCode::OP_METHOD_LONG:
+    case OpCode::OP_DEBUG_BREAK:
+    case OpCode::OP_DEBUG_VALUE:
+    case OpCode::OP_LESS_LOCALS_JUMP_IF_FALSE:
+    case OpCode::OP_RANGE_LOCALS_JUMP_IF_FALSE:
+        return 5;
+    case OpCode::OP_INVOKE_LONG:
+        return 6;
+    case OpCode::OP_CLOSURE:
+    {
+        const ObjFunction* function = asFunction(chunk.constants.values[chunk.code[offset + 1]]);
+        return 2 + 2 * static_cast<size_t>(function->upvalueCount);
+    }
+    case OpCode::OP_CLOSURE_LONG:
+    {
+        const uint32_t constant = *reinterpret_cast<const uint32_t*>(&chunk.code[offset + 1]);
+        const ObjFunction* function = asFunction(chunk.constants.values[constant]);
+        return 5 + 2 * static_cast<size_t>(function->upvalueCount);
+    }
+    default:
+        return 1;
+    }
+
+    static_assert(static_cast<int>(OpCode::COUNT) == 85, "Missing operations in instructionLength");
+}
+
+void fuseSuperinstructions(Chunk& chunk)
+{
+    const ChunkInstructions& code = chunk.code;
+
+    std::vector<size_t> starts;
+    std::vector<bool> jumpTargets(code.size() + 1, false);
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset))
+    {
+        starts.push_back(offset);
+        if (jumpOperandOffset(static_cast<OpCode>(code[offset])) >= 0)
+        {
+            const size_t target = jumpTarget(chunk, offset);
+            if (target <= code.size()) jumpTargets[target] = true;
+        }
+    }
+
+    const size_t count = starts.size();
+    auto opAt = [&](size_t index)
+    {
+        return index < count ? genericVariant(static_cast<OpCode>(code[starts[index]])) : OpCode::COUNT;
+    };
+    auto operandAt = [&](size_t index) { return code[starts[index] + 1]; };
+    // Nothing may jump into the middle of a fused sequence, only to its first instruction.
+    auto matches = [&](size_t index, std::initializer_list<OpCode> pattern)
+    {
+        size_t current = index;
+        for (const OpCode instruction : pattern)
+        {
+            if (opAt(current) != instruction) return false;
+            if (current != index && jumpTargets[starts[current]]) return false;
+            ++current;
+        }
+        return true;
+    };
+
+    ChunkInstructions fused;
+    std::vector<int> lines;
+    fused.reserve(code.size());
+    lines.reserve(code.size());
+    std::vector<size_t> newOffsets(code.size() + 1, 0);
+    std::vector<PendingJump> jumps;
+
+    size_t index = 0;
+    while (index < count)
+    {
+        const size_t offset = starts[index];
+        const size_t start = fused.size();
+        const int line = chunk.lines[offset];
+        auto emit = [&](uint8_t byte)
+        {
+            fused.push_back(byte);
+            lines.push_back(line);
+        };
+        auto emitJump = [&](size_t jumpOffset)
+        {
+            jumps.push_back({ fused.size(), jumpTarget(chunk, jumpOffset), static_cast<OpCode>(code[jumpOffset]) == OpCode::OP_LOOP });
+            emit(0xff);
+            emit(0xff);
+        };
+
+        size_t consumed = 1;
+        if (matches(index, { OpCode::OP_GET_LOCAL, OpCode::OP_GET_LOCAL, OpCode::OP_LESS, OpCode::OP_JUMP_IF_FALSE, OpCode::OP_POP })
+            || matches(index, { OpCode::OP_GET_LOCAL, OpCode::OP_GET_LOCAL, OpCode::OP_RANGE_IN_BOUNDS, OpCode::OP_JUMP_IF_FALSE, OpCode::OP_POP }))
+        {
+            emit(OpByte(opAt(index + 2) == OpCode::OP_LESS ? OpCode::OP_LESS_LOCALS_JUMP_IF_FALSE : OpCode::OP_RANGE_LOCALS_JUMP_IF_FALSE));
+            emit(operandAt(index));
+            emit(operandAt(index + 1));
+            emitJump(starts[index + 3]);
+            consumed = 5;
+        }
+        else if (matches(index, { OpCode::OP_GET_LOCAL, OpCode::OP_INCREMENT, OpCode::OP_SET_LOCAL, OpCode::OP_POP })
+                 && operandAt(index) == operandAt(index + 2))
+        {
+            emit(OpByte(OpCode::OP_INCREMENT_LOCAL));
+            emit(operandAt(index));
+            consumed = 4;
+        }
+        else if (matches(index, { OpCode::OP_LESS, OpCode::OP_JUMP_IF_FALSE, OpCode::OP_POP }))
+        {
+            emit(OpByte(OpCode::OP_LESS_JUMP_IF_FALSE));
+            emitJump(starts[index + 1]);
+            consumed = 3;
+        }
+        else if (matches(index, { OpCode::OP_GET_LOCAL, OpCode::OP_POP }) || matches(index, { OpCode::OP_CONSTANT, OpCode::OP_POP }))
+        {
+            // Pushed and popped straight away, nothing to run
+            consumed = 2;
+        }
+        else if (matches(index, { OpCode::OP_POP, OpCode::OP_POP }))
+        {
+            consumed = 2;
+            while (consumed < UINT8_MAX && matches(index + consumed - 1, { OpCode::OP_POP, OpCode::OP_POP }))
+            {
+                ++consumed;
+            }
+            emit(OpByte(OpCode::OP_POPN));
+            emit(static_cast<uint8_t>(consumed));
+        }
+        else
+        {
+            for (const std::pair<OpCode, OpCode>& localOperator : localOperators)
+            {
+                if (matches(index, { OpCode::OP_GET_LOCAL, OpCode::OP_GET_LOCAL, localOperator.first }))
+                {
+                    emit(OpByte(localOperator.second));
+                    emit(operandAt(index));
+                    emit(operandAt(index + 1));
+                    consumed = 3;
+                    break;
+                }
+            }
+
+            if (consumed == 1)
+            {
+                const size_t length = instructionLength(chunk, offset);
+                const int jumpOperand = jumpOperandOffset(opAt(index));
+                for (size_t i = 0; i < length; ++i)
+                {
+                    if (static_cast<int>(i) == jumpOperand)
+                    {
+                        emitJump(offset);
+                        ++i;
+                        continue;
+                    }
+                    emit(code[offset + i]);
+                }
+            }
+        }
+
+        for (size_t i = index; i < index + consumed; ++i)
+        {
+            newOffsets[starts[i]] = start;
+        }
+        index += consumed;
+    }
+    newOffsets[code.size()] = fused.size();
+
+    // Code only ever shrinks, so every patched jump still fits in its 2 bytes.
+    for (const PendingJump& jump : jumps)
+    {
+        const size_t end = jump.operand + 2;
+        const size_t target = newOffsets[jump.oldTarget];
+        const size_t distance = jump.backwards ? end - target : target - end;
+
+        fused[jump.operand] = static_cast<uint8_t>(distance & 0xff);
+        fused[jump.operand + 1] = static_cast<uint8_t>((distance >> 8) & 0xff);
+    }
+
+    chunk.code = std::move(fused);
+    chunk.lines = std::move(lines);
+    chunk.inlineCaches.clear();
+    chunk.inlineCacheOffsets.clear();
+    chunk.quickening.clear();
+}
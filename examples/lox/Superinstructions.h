@@ -0,0 +1,12 @@
+#ifndef loxcpp_superinstructions_h
+#define loxcpp_superinstructions_h
+
+#include "Chunk.h"
+
+// Rewrites common instruction sequences of a finished chunk into single fused
+// instructions. Jump offsets and line information are updated to match.
+void fuseSuperinstructions(Chunk& chunk);
+
+size_t instructionLength(const Chunk& chunk, size_t offset);
+
+#endif
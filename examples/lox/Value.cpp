@@ -9,7 +9,7 @@
 
 void printValue(const Value& value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::BOOL:
         std::cout << (asBoolean(value) ? "true" : "false");
@@ -34,7 +34,7 @@ std::string_view doubleToString(double value, std::array<char, 24>& buffer)
 
 ObjString* valueAsString(const Value& value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::BOOL: return (asBoolean(value) ? takeString("true", 4) : takeString("false", 5));
     case ValueType::NIL: return takeString("nil", 3);
@@ -51,7 +51,7 @@ ObjString* valueAsString(const Value& value)
 
 std::string valueAsStr(const Value& value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::BOOL: return (asBoolean(value) ? "true" : "false");
     case ValueType::NIL: return "nil";
@@ -64,7 +64,7 @@ std::string valueAsStr(const Value& value)
 
 size_t sizeOf(const Value& value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::BOOL:
     case ValueType::NIL:
@@ -76,6 +76,17 @@ size_t sizeOf(const Value& value)
     return 0;
 }
 
+#ifdef NAN_BOXING
+
+bool Value::operator==(const Value& other) const
+{
+    // Compare numbers as doubles so NaN != NaN and 0 == -0, like the tagged encoding.
+    if (isNumber(*this) && isNumber(other)) return asNumber(*this) == asNumber(other);
+    return bits == other.bits;
+}
+
+#else
+
 bool Value::operator==(const Value& other) const
 {
     if (type != other.type) return false;
@@ -91,3 +102,5 @@ bool Value::operator==(const Value& other) const
         default:                return false; // Unreachable.
     }
 }
+
+#endif
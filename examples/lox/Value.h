@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <cstring>
 
 #include "Common.h"
 
@@ -17,6 +19,74 @@ enum class ValueType : uint8_t
 struct Obj;
 struct ObjString;
 
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles. Every other value lives inside the
+// payload of a quiet NaN: nil and booleans use small tags and objects set the
+// sign bit and keep their 48-bit address in the low bits.
+static_assert(sizeof(void*) == sizeof(uint64_t), "NaN boxing requires 64-bit pointers.");
+
+constexpr uint64_t SIGN_BIT = 0x8000000000000000ull;
+constexpr uint64_t QNAN = 0x7ffc000000000000ull;
+
+constexpr uint64_t TAG_NIL = 1;
+constexpr uint64_t TAG_FALSE = 2;
+constexpr uint64_t TAG_TRUE = 3;
+
+constexpr uint64_t NIL_VAL = QNAN | TAG_NIL;
+constexpr uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+constexpr uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+
+struct Value
+{
+    Value()
+        : bits(NIL_VAL)
+    {}
+
+    explicit Value(bool value)
+        : bits(value ? TRUE_VAL : FALSE_VAL)
+    {}
+
+    explicit Value(double value)
+    {
+        std::memcpy(&bits, &value, sizeof(double));
+    }
+
+    explicit Value(Obj* obj)
+        : bits(SIGN_BIT | QNAN | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(obj)))
+    {}
+
+    uint64_t bits;
+
+    bool operator==(const Value& other) const;
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t), "NaN-boxed values must fit in 8 bytes.");
+
+inline bool isNumber(const Value& value) { return (value.bits & QNAN) != QNAN; }
+inline bool isObject(const Value& value) { return (value.bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+inline bool isNil(const Value& value) { return value.bits == NIL_VAL; }
+inline bool isBoolean(const Value& value) { return (value.bits | 1) == TRUE_VAL; }
+
+inline bool asBoolean(const Value& value) { return value.bits == TRUE_VAL; }
+inline double asNumber(const Value& value)
+{
+    double number;
+    std::memcpy(&number, &value.bits, sizeof(double));
+    return number;
+}
+inline Obj* asObject(const Value& value) { return reinterpret_cast<Obj*>(static_cast<uintptr_t>(value.bits & ~(SIGN_BIT | QNAN))); }
+
+inline ValueType valueType(const Value& value)
+{
+    if (isNumber(value)) return ValueType::NUMBER;
+    if (isObject(value)) return ValueType::OBJ;
+    if (isNil(value)) return ValueType::NIL;
+    return ValueType::BOOL;
+}
+
+#else
+
 union TypeUnion
 {
     TypeUnion()
@@ -76,6 +146,10 @@ inline bool isNumber(const Value& value) { return value.type == ValueType::NUMBE
 inline bool isObject(const Value& value) { return value.type == ValueType::OBJ; }
 inline bool isNil(const Value& value) { return value.type == ValueType::NIL; }
 
+inline ValueType valueType(const Value& value) { return value.type; }
+
+#endif
+
 struct ValueArray 
 {
     std::vector<Value> values;
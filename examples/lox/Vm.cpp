@@ -7,14 +7,66 @@
 #include <cassert>
 #include <cstdarg>
 #include <cmath>
+#include <system_error>
 #include <time.h>
 
 #include "Debug.h"
+#include "Jit.h"
 #include "Natives.h"
 #include "VMUtils.h"
 
+// Labels as values are a GCC/Clang extension, other compilers use the switch dispatch.
+#if defined(VLOX_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define VLOX_USE_COMPUTED_GOTO
+#endif
+
 constexpr int GC_HEAP_GROW_FACTOR = 2;
 
+namespace
+{
+    // Where markObject() puts gray objects while the marker thread, or a snapshot the script
+    // takes during a concurrent marking, blackens objects. Null means grayNodes.
+    thread_local std::vector<Obj*>* markingStack = nullptr;
+
+    // Quickening runs from many handlers. These take the frame by value, so once the compiler
+    // stops inlining them the dispatch loop can still keep its frame pointer in a register.
+    size_t instructionOffsetIn(const CallFrame* frame)
+    {
+        return static_cast<size_t>(frame->ip - 1 - frame->closure->function->chunk.code.data());
+    }
+
+    void quickenInstruction(CallFrame* frame, OpCode specialized)
+    {
+        frame->closure->function->chunk.quicken(instructionOffsetIn(frame), specialized);
+    }
+
+    // Puts the generic instruction back and rewinds, so the next dispatch runs it instead.
+    void deoptimizeInstruction(CallFrame* frame, OpCode generic)
+    {
+        frame->closure->function->chunk.deoptimize(instructionOffsetIn(frame), generic);
+        frame->ip--;
+    }
+
+    // Caches are created the first time their instruction runs.
+    InlineCache& inlineCacheIn(const CallFrame* frame)
+    {
+        ObjFunction* function = frame->closure->function;
+        const size_t offset = instructionOffsetIn(frame);
+        if (InlineCache* cache = function->chunk.findInlineCache(offset))
+            return *cache;
+        // Adding one can move the others while a concurrent marker reads them.
+        snapshotBarrier(function);
+        return function->chunk.addInlineCache(offset);
+    }
+
+    // The inline caches belong to the function that is running.
+    void cacheBarrier(ObjFunction* function, const InlineCacheEntry& entry)
+    {
+        writeBarrier(function, entry.klass);
+        writeBarrier(function, entry.method);
+    }
+}
+
 ScopedGcRoot::ScopedGcRoot(VM& vm, Value value)
     : vm(vm)
 {
@@ -51,7 +103,7 @@ InterpretResult VM::interpret(const std::string& source)
             { "init", 0, [](int argCount, Value* args, VM* vm)
                 {
                     ObjInstance* this_ = asInstance(args[0]);
-                    this_->fields.set(copyString("PI", 2), Value(3.14159265358979323846));
+                    this_->setField(copyString("PI", 2), Value(3.14159265358979323846));
                     return Value(this_);
                 }
             },
@@ -99,14 +151,69 @@ InterpretResult VM::interpret(const std::string& source)
     return result;
 }
 
+VM::NestingScope::NestingScope(VM& vm)
+    : vm(vm)
+{
+    vm.nativeNesting++;
+}
+
+VM::NestingScope::~NestingScope()
+{
+    if (--vm.nativeNesting == 0)
+        vm.tenureYoungObjects();
+}
+
 void VM::addObject(Obj* obj, size_t allocationSize)
 {
-    if (bytesAllocated + allocationSize > nextGC)
-        collectGarbage();
+    if (gcPhase != GcPhase::IDLE)
+    {
+        if (bytesAllocated >= nextGcStep)
+            collectGarbageStep();
+    }
+    // Only the old generation counts towards a full collection, young garbage never gets that far.
+    else if (bytesAllocated - youngBytes + allocationSize > nextGC)
+    {
+        if (concurrentMarking || gcPauseBudget > std::chrono::nanoseconds::zero())
+            startCollection();
+        else
+            collectGarbage();
+    }
+
+    if (gcPhase != GcPhase::MARKING && youngBytes + allocationSize > NURSERY_SIZE)
+        collectYoungGarbage();
 
     obj->allocationSize = allocationSize;
-    objects.push_back(obj);
     bytesAllocated += allocationSize;
+
+    // New objects are gray while a collection is marking, so whatever they hold gets traced.
+    // A concurrent marking only traces the heap it started from, they are black for it.
+    if (gcPhase == GcPhase::MARKING)
+    {
+        obj->isMarked = true;
+        if (concurrentMarkingActive)
+            obj->scanState.store(ScanState::SCANNED, std::memory_order_relaxed);
+        else
+            grayNodes.push_back(obj);
+    }
+
+    // Objects made outside of run() belong to the host, like compiled scripts and natives.
+    if (nativeNesting == 0)
+    {
+        obj->isOld = true;
+        objects.push_back(obj);
+    }
+    else
+    {
+        youngObjects.push_back(obj);
+        youngBytes += allocationSize;
+    }
+}
+
+void VM::freeObject(Obj* obj)
+{
+    const size_t size = obj->allocationSize;
+    obj->~Obj();
+    heap.deallocate(obj, size);
 }
 
 void VM::freeAllObjects()
@@ -115,14 +222,22 @@ void VM::freeAllObjects()
     const size_t before = bytesAllocated;
 #endif
 
-    for (Obj* obj : objects)
+    joinMarker();
+    for (GCObjList* generation : { &objects, &youngObjects })
     {
-        assert(bytesAllocated >= obj->allocationSize);
-        bytesAllocated -= obj->allocationSize;
-        delete obj;
+        for (Obj* obj : *generation)
+        {
+            assert(bytesAllocated >= obj->allocationSize);
+            bytesAllocated -= obj->allocationSize;
+            freeObject(obj);
+        }
+        generation->clear();
     }
-
-    objects.clear();
+    youngBytes = 0;
+    rememberedSet.clear();
+    rememberedValues.clear();
+    grayNodes.clear();
+    gcPhase = GcPhase::IDLE;
 
 #ifdef DEBUG_LOG_GC
     std::cout << "   collected " << (before - bytesAllocated) <<
@@ -134,28 +249,383 @@ void VM::collectGarbage()
 {
     if (!canCollectGarbage) return;
 
+    const GcClock::time_point start = GcClock::now();
+    // A collection in progress is finished first, what it marked may have died since.
+    if (gcPhase == GcPhase::MARKING)
+    {
+        joinMarker();
+        traceReferences();
+        finishMarking();
+    }
+    if (gcPhase == GcPhase::SWEEPING)
+    {
+        sweepUntil(GcClock::time_point::max());
+        finishCollection();
+    }
+
+    beginCollection();
+    traceReferences();
+    finishMarking();
+    sweepUntil(GcClock::time_point::max());
+    finishCollection();
+    recordGcPause(start);
+}
+
+void VM::collectYoungGarbage()
+{
+    if (!canCollectGarbage) return;
+    if (nativeNesting == 0)
+    {
+        collectGarbage();
+        return;
+    }
+    // The marks belong to the full collection until it is done marking.
+    if (gcPhase == GcPhase::MARKING)
+    {
+        collectGarbageStep();
+        return;
+    }
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- young gc begin" << std::endl;
+    const size_t before = bytesAllocated;
+#endif
+
+    const GcClock::time_point start = GcClock::now();
+
+    // Tracing stops at old objects. The ones written since the last collection are the only
+    // old objects that can point back into the young generation.
+    collectingYoung = true;
+    markRoots();
+    for (Value& value : rememberedValues)
+        markValue(value);
+    for (Obj* object : rememberedSet)
+    {
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    rememberedSet.clear();
+    rememberedValues.clear();
+
+    traceReferences();
+    collectingYoung = false;
+    // Only young strings can have died, which spares a walk over the whole string table.
+    for (Obj* object : youngObjects)
+    {
+        if (!object->isMarked && object->type == ObjType::STRING)
+            strings.remove(static_cast<ObjString*>(object));
+    }
+    sweepYoung();
+    youngCollections++;
+    countGcPause(GcClock::now() - start);
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- young gc end" << std::endl;
+    std::cout << "   collected " << (before - bytesAllocated) <<
+        " bytes (from " << before << " to " << bytesAllocated << ") next at " << nextGC << std::endl;
+#endif
+}
+
+void VM::startCollection()
+{
+    if (!canCollectGarbage) return;
+
+    const GcClock::time_point start = GcClock::now();
+    beginCollection();
+    if (concurrentMarking)
+        startMarker();
+    nextGcStep = bytesAllocated + GC_STEP_SIZE;
+    recordGcPause(start);
+}
+
+void VM::collectGarbageStep()
+{
+    if (!canCollectGarbage) return;
+
+    const GcClock::time_point start = GcClock::now();
+    // A script that allocates faster than the steps keep up gets the rest done in one pause.
+    const bool overdue = bytesAllocated > nextGC * GC_HEAP_GROW_FACTOR;
+    const GcClock::time_point deadline = overdue ? GcClock::time_point::max() : start + gcPauseBudget;
+    if (markerThread.joinable())
+    {
+        // The marker runs on its own, until it is done a step only looks at it. An overdue
+        // one waits for it.
+        if (!overdue && !markerDone.load(std::memory_order_acquire))
+        {
+            nextGcStep = bytesAllocated + GC_STEP_SIZE;
+            return;
+        }
+        joinMarker();
+        traceReferences();
+        finishMarking();
+        if (gcPauseBudget == std::chrono::nanoseconds::zero())
+        {
+            sweepUntil(GcClock::time_point::max());
+            finishCollection();
+        }
+    }
+    else if (gcPhase == GcPhase::MARKING)
+    {
+        if (markUntil(deadline))
+            finishMarking();
+    }
+    else if (sweepUntil(deadline))
+    {
+        finishCollection();
+    }
+    nextGcStep = bytesAllocated + GC_STEP_SIZE;
+    recordGcPause(start);
+}
+
+void VM::beginCollection()
+{
 #ifdef DEBUG_LOG_GC
     std::cout << "-- gc begin" << std::endl;
-    const size_t before = bytesAllocated;
 #endif
 
+    // The young generation is collected along with the old one. Everything is traced, which
+    // makes the remembered objects redundant.
+    tenureYoungObjects();
+    currentGcMaxPause = std::chrono::nanoseconds::zero();
+
     if (externalMarkingFunc)
         externalMarkingFunc();
+    markRoots();
+    gcPhase = GcPhase::MARKING;
+}
+
+bool VM::markUntil(GcClock::time_point deadline)
+{
+    while (!grayNodes.empty())
+    {
+        // The clock is only read every few objects.
+        for (size_t i = 0; i < GC_STEP_OBJECTS && !grayNodes.empty(); ++i)
+        {
+            Obj* object = grayNodes.back();
+            grayNodes.pop_back();
+            blackenObject(object);
+        }
+        if (GcClock::now() >= deadline)
+            break;
+    }
+    return grayNodes.empty();
+}
 
+void VM::finishMarking()
+{
+    // Stores into the roots have no barrier, so they are scanned again.
+    if (externalMarkingFunc)
+        externalMarkingFunc();
     markRoots();
+    for (Value& value : rememberedValues)
+        markValue(value);
     traceReferences();
     strings.removeWhite();
-    sweep();
 
-    nextGC = std::max(bytesAllocated * GC_HEAP_GROW_FACTOR, MINIMUM_GC_THRESHOLD);
+    // The objects allocated since the collection began survive it, but they are still young.
+    for (Obj* object : youngObjects)
+    {
+        object->isMarked = false;
+        object->scanState.store(ScanState::UNSCANNED, std::memory_order_relaxed);
+    }
+    // A remembered object may have died since its barrier ran.
+    rememberedSet.erase(std::remove_if(rememberedSet.begin(), rememberedSet.end(), [](Obj* object) { return !object->isMarked; }),
+        rememberedSet.end());
+
+    gcPhase = GcPhase::SWEEPING;
+    sweepIndex = 0;
+    sweepSurvivors = 0;
+    sweepEnd = objects.size();
+}
+
+bool VM::sweepUntil(GcClock::time_point deadline)
+{
+    // Survivors slide down over the freed entries, keeping their allocation order. The objects
+    // promoted since the marking finished come after sweepEnd and are left alone.
+    while (sweepIndex < sweepEnd)
+    {
+        const size_t stepEnd = std::min(sweepEnd, sweepIndex + GC_STEP_OBJECTS);
+        for (; sweepIndex < stepEnd; ++sweepIndex)
+        {
+            Obj* object = objects[sweepIndex];
+            if (object->isMarked)
+            {
+                object->isMarked = false;
+                object->scanState.store(ScanState::UNSCANNED, std::memory_order_relaxed);
+                objects[sweepSurvivors++] = object;
+            }
+            else
+            {
+                assert(bytesAllocated >= object->allocationSize);
+                bytesAllocated -= object->allocationSize;
+                freeObject(object);
+            }
+        }
+        if (GcClock::now() >= deadline)
+            break;
+    }
+    if (sweepIndex < sweepEnd)
+        return false;
+
+    objects.erase(objects.begin() + sweepSurvivors, objects.begin() + sweepEnd);
+    return true;
+}
+
+void VM::finishCollection()
+{
+    gcPhase = GcPhase::IDLE;
+    fullCollections++;
+
+    const size_t oldBytes = bytesAllocated - youngBytes;
+    nextGC = std::max(oldBytes * GC_HEAP_GROW_FACTOR, MINIMUM_GC_THRESHOLD);
+    // The allocations until the next collection can reuse that much of the empty slabs.
+    heap.releaseEmptySlabs(nextGC - oldBytes);
 
 #ifdef DEBUG_LOG_GC
     std::cout << "-- gc end" << std::endl;
-    std::cout << "   collected " << (before - bytesAllocated) <<
-        " bytes (from " << before << " to " << bytesAllocated << ") next at " << nextGC << std::endl;
+    std::cout << "   " << bytesAllocated << " bytes left, next at " << nextGC << std::endl;
 #endif
 }
 
+void VM::recordGcPause(GcClock::time_point start)
+{
+    const std::chrono::nanoseconds pause = GcClock::now() - start;
+    countGcPause(pause);
+    currentGcMaxPause = std::max(currentGcMaxPause, pause);
+    if (gcPhase == GcPhase::IDLE)
+        lastGcMaxPause = currentGcMaxPause;
+}
+
+void VM::countGcPause(std::chrono::nanoseconds pause)
+{
+    gcPauseStats.pauses++;
+    gcPauseStats.total += pause;
+    gcPauseStats.longest = std::max(gcPauseStats.longest, pause);
+}
+
+void VM::startMarker()
+{
+    markerDone.store(false, std::memory_order_relaxed);
+    concurrentMarkingActive = true;
+    try
+    {
+        markerThread = std::thread(&VM::markConcurrently, this);
+    }
+    catch (const std::system_error&)
+    {
+        // Without a thread the marking is done in this pause.
+        concurrentMarkingActive = false;
+        traceReferences();
+    }
+}
+
+void VM::markConcurrently()
+{
+    markingStack = &grayNodes;
+    for (;;)
+    {
+        while (!grayNodes.empty())
+        {
+            Obj* object = grayNodes.back();
+            grayNodes.pop_back();
+            // The script may have scanned it already, before changing it.
+            ScanState expected = ScanState::UNSCANNED;
+            if (object->scanState.compare_exchange_strong(expected, ScanState::SCANNING, std::memory_order_acquire))
+            {
+                blackenObject(object);
+                object->scanState.store(ScanState::SCANNED, std::memory_order_release);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(snapshotGraysMutex);
+        if (snapshotGrays.empty())
+            break;
+        grayNodes.swap(snapshotGrays);
+    }
+    markingStack = nullptr;
+    markerDone.store(true, std::memory_order_release);
+}
+
+void VM::joinMarker()
+{
+    if (!markerThread.joinable()) return;
+
+    markerThread.join();
+    concurrentMarkingActive = false;
+    // The snapshots taken after the marker was done are traced by the remark.
+    grayNodes.insert(grayNodes.end(), snapshotGrays.begin(), snapshotGrays.end());
+    snapshotGrays.clear();
+}
+
+void VM::snapshotObject(Obj* object)
+{
+    ScanState expected = ScanState::UNSCANNED;
+    if (!object->scanState.compare_exchange_strong(expected, ScanState::SCANNING, std::memory_order_acquire))
+    {
+        // The marker is reading it, the change has to wait until it's done.
+        while (object->scanState.load(std::memory_order_acquire) != ScanState::SCANNED)
+            std::this_thread::yield();
+        return;
+    }
+
+    markingStack = &scriptGrays;
+    blackenObject(object);
+    markingStack = nullptr;
+    object->scanState.store(ScanState::SCANNED, std::memory_order_release);
+
+    if (!scriptGrays.empty())
+    {
+        std::lock_guard<std::mutex> lock(snapshotGraysMutex);
+        snapshotGrays.insert(snapshotGrays.end(), scriptGrays.begin(), scriptGrays.end());
+        scriptGrays.clear();
+    }
+}
+
+void VM::tenureYoungObjects()
+{
+    for (Obj* object : youngObjects)
+    {
+        object->isOld = true;
+        objects.push_back(object);
+    }
+    youngObjects.clear();
+    youngBytes = 0;
+
+    for (Obj* object : rememberedSet)
+        object->isRemembered = false;
+    rememberedSet.clear();
+    rememberedValues.clear();
+}
+
+void VM::recordWrite(Obj* owner, Obj* stored)
+{
+    // A concurrent marking has the snapshot barrier instead.
+    if (gcPhase == GcPhase::MARKING && !concurrentMarkingActive && owner->isMarked)
+        markObject(stored);
+
+    // Outside of run() there is nothing young to point to.
+    if (owner->isOld && !owner->isRemembered && !stored->isOld && nativeNesting > 0)
+    {
+        owner->isRemembered = true;
+        rememberedSet.push_back(owner);
+    }
+}
+
+void VM::recordAppend(Obj* owner, Obj* stored)
+{
+    if (gcPhase == GcPhase::MARKING && !concurrentMarkingActive && owner->isMarked)
+        markObject(stored);
+
+    if (owner->isOld && !stored->isOld)
+        rememberedValues.push_back(Value(stored));
+}
+
+void VM::rememberValue(const Value& value)
+{
+    if (isObject(value) && !asObject(value)->isOld)
+        rememberedValues.push_back(value);
+}
+
 void VM::markRoots()
 {
     for (Value& value : temporaryRoots)
@@ -192,31 +662,31 @@ void VM::traceReferences()
     }
 }
 
-void VM::sweep()
+void VM::sweepYoung()
 {
-    GCObjList::iterator it = objects.begin();
-    while (it != objects.end())
+    for (Obj* object : youngObjects)
     {
-        Obj* object = *it;
         if (object->isMarked)
         {
             object->isMarked = false;
-            ++it;
+            object->isOld = true;
+            objects.push_back(object);
         }
         else
         {
             assert(bytesAllocated >= object->allocationSize);
             bytesAllocated -= object->allocationSize;
-            delete object;
-            it = objects.erase(it);
+            freeObject(object);
         }
     }
+    youngObjects.clear();
+    youngBytes = 0;
 }
 
 void VM::markObject(Obj* object)
 {
     if (object == nullptr) return;
-    if (object->isMarked) return;
+    if (object->isMarked || (collectingYoung && object->isOld)) return;
 
 #ifdef DEBUG_LOG_GC
     std::cout << object << " mark ";
@@ -226,7 +696,10 @@ void VM::markObject(Obj* object)
 
     object->isMarked = true;
 
-    grayNodes.push_back(object);
+    if (markingStack)
+        markingStack->push_back(object);
+    else
+        grayNodes.push_back(object);
 }
 
 void VM::markValue(Value& value)
@@ -305,6 +778,14 @@ void VM::blackenObject(Obj* object)
         ObjFunction* function = static_cast<ObjFunction*>(object);
         markObject(function->name);
         markArray(function->chunk.constants);
+        for (InlineCache& cache : function->chunk.inlineCaches)
+        {
+            for (uint8_t i = 0; i < cache.count; ++i)
+            {
+                markObject(cache.entries[i].klass);
+                markValue(cache.entries[i].method);
+            }
+        }
         break;
     }
     case ObjType::CLOSURE:
@@ -331,13 +812,14 @@ void VM::blackenObject(Obj* object)
         markObject(klass->name);
         markValue(klass->initializer);
         klass->methods.mark();
+        klass->markShapes(*this);
         break;
     }
     case ObjType::INSTANCE:
     {
         ObjInstance* instance = static_cast<ObjInstance*>(object);
         markObject(instance->klass);
-        instance->fields.mark();
+        instance->markFields(*this);
         break;
     }
     }
@@ -347,8 +829,16 @@ void VM::blackenObject(Obj* object)
 
 InterpretResult VM::run(int depth, bool allowPause)
 {
+    const NestingScope nesting(*this);
+    // Only nested calls get this deep, and they start on a frame that hasn't run yet.
+    if (nativeNesting > NATIVE_NESTING_MAX)
+    {
+        frameCount--;
+        runtimeError("Stack overflow.");
+        return InterpretResult::INTERPRET_RUNTIME_ERROR;
+    }
+
     CallFrame* frame = &frames[frameCount - 1];
-    uint32_t stopCheckCountdown = 256;
 
     auto readByte = [&]() -> uint8_t { return *frame->ip++; };
     auto readShort = [&]() -> uint16_t
@@ -368,16 +858,18 @@ InterpretResult VM::run(int depth, bool allowPause)
     auto readLongConstant = [&]() -> Value { return frame->closure->function->chunk.constants.values[readDWord()]; };
     auto readString = [&]() -> ObjString* { return asString(readConstant()); };
     auto readStringLong = [&]() -> ObjString* { return asString(readLongConstant()); };
-
-    for (;;)
+    // These must run before the instruction operands are read.
+    auto instructionOffset = [&]() -> size_t { return instructionOffsetIn(frame); };
+    auto currentInlineCache = [&]() -> InlineCache&
     {
-        if (--stopCheckCountdown == 0)
-        {
-            stopCheckCountdown = 256;
-            if (stopRequested.load(std::memory_order_relaxed))
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-        }
+        return inlineCacheIn(frame);
+    };
+    auto quicken = [&](OpCode specialized) { quickenInstruction(frame, specialized); };
+    auto deoptimize = [&](OpCode generic) { deoptimizeInstruction(frame, generic); };
+
 #ifdef DEBUG_TRACE_EXECUTION
+    auto traceInstruction = [&]()
+    {
         std::cout << "          ";
         for (Value* slot = &stack[0]; slot < stackTop; slot++)
         {
@@ -386,219 +878,276 @@ InterpretResult VM::run(int depth, bool allowPause)
             std::cout << " ]";
         }
         std::cout << std::endl;
-        disassembleInstruction(frame->closure->function->chunk, 
+        disassembleInstruction(frame->closure->function->chunk,
             static_cast<size_t>(frame->ip - &frame->closure->function->chunk.code[0]));
+    };
+#define TRACE_INSTRUCTION() traceInstruction()
+#else
+#define TRACE_INSTRUCTION()
+#endif
+
+    // Stop requests are only polled on backward jumps and calls, every other instruction
+    // makes forward progress towards one of those or towards the end of the script.
+#define POLL_STOP_REQUEST() \
+    if (stopRequested.load(std::memory_order_relaxed)) return InterpretResult::INTERPRET_RUNTIME_ERROR
+
+    // A nested run() (natives calling back into the VM, toString overrides) can't pause
+    // by itself, so it leaves the pause pending for the instruction that started it.
+#define CHECK_PENDING_PAUSE() \
+    if (allowPause && debugPausePending) { debugPausePending = false; return InterpretResult::INTERPRET_PAUSED; }
+
+    // Functions lowered to registers run to completion as soon as they are called.
+#define ENTER_CALLED_FRAME() \
+    frame = &frames[frameCount - 1]; \
+    if (!frame->closure->function->chunk.registers.empty()) \
+    { \
+        const InterpretResult registerResult = runRegisters(); \
+        if (registerResult != InterpretResult::INTERPRET_OK) return registerResult; \
+        frame = &frames[frameCount - 1]; \
+    }
+
+    OpCode instruction;
+
+#ifdef VLOX_USE_COMPUTED_GOTO
+    // Must follow the OpCode declaration order
+    static void* dispatchTable[] =
+    {
+        &&op_OP_CONSTANT, &&op_OP_CONSTANT_LONG, &&op_OP_NIL, &&op_OP_TRUE, &&op_OP_FALSE, &&op_OP_POP,
+        &&op_OP_GET_LOCAL, &&op_OP_SET_LOCAL, &&op_OP_GET_LOCAL_LONG, &&op_OP_SET_LOCAL_LONG,
+        &&op_OP_GET_GLOBAL, &&op_OP_DEFINE_GLOBAL, &&op_OP_SET_GLOBAL,
+        &&op_OP_GET_GLOBAL_LONG, &&op_OP_DEFINE_GLOBAL_LONG, &&op_OP_SET_GLOBAL_LONG,
+        &&op_OP_GET_UPVALUE, &&op_OP_SET_UPVALUE,
+        &&op_OP_SET_PROPERTY, &&op_OP_SET_PROPERTY_LONG, &&op_OP_GET_PROPERTY, &&op_OP_GET_PROPERTY_LONG,
+        &&op_OP_EQUAL, &&op_OP_MATCH, &&op_OP_GREATER, &&op_OP_LESS, &&op_OP_NEGATE,
+        &&op_OP_ADD, &&op_OP_SUBTRACT, &&op_OP_MULTIPLY, &&op_OP_MIN, &&op_OP_MAX, &&op_OP_DIVIDE, &&op_OP_MODULO,
+        &&op_OP_INCREMENT, &&op_OP_BUILD_RANGE, &&op_OP_BUILD_LIST, &&op_OP_APPEND_LIST,
+        &&op_OP_BUILD_MAP, &&op_OP_INSERT_MAP, &&op_OP_MAP_IN_BOUNDS, &&op_OP_MAP_KEY_AT, &&op_OP_MAP_VALUE_AT,
+        &&op_OP_INDEX_SUBSCR, &&op_OP_STORE_SUBSCR, &&op_OP_RANGE_IN_BOUNDS,
+        &&op_OP_IS_NIL, &&op_OP_TO_STRING, &&op_OP_NOT, &&op_OP_PRINT,
+        &&op_OP_JUMP, &&op_OP_JUMP_IF_FALSE, &&op_OP_LOOP,
+        &&op_OP_CALL, &&op_OP_INVOKE, &&op_OP_INVOKE_LONG, &&op_OP_CLOSURE, &&op_OP_CLOSURE_LONG,
+        &&op_OP_CLOSE_UPVALUE, &&op_OP_RETURN,
+        &&op_OP_CLASS, &&op_OP_CLASS_LONG, &&op_OP_METHOD, &&op_OP_METHOD_LONG,
+        &&op_OP_DEBUG_BREAK, &&op_OP_DEBUG_VALUE,
+        &&op_OP_POPN, &&op_OP_INCREMENT_LOCAL,
+        &&op_OP_ADD_LOCALS, &&op_OP_SUBTRACT_LOCALS, &&op_OP_MULTIPLY_LOCALS, &&op_OP_LESS_LOCALS,
+        &&op_OP_LESS_JUMP_IF_FALSE, &&op_OP_LESS_LOCALS_JUMP_IF_FALSE, &&op_OP_RANGE_LOCALS_JUMP_IF_FALSE,
+        &&op_OP_ADD_NUM, &&op_OP_SUBTRACT_NUM, &&op_OP_MULTIPLY_NUM, &&op_OP_LESS_NUM, &&op_OP_GREATER_NUM,
+        &&op_OP_ADD_STRING, &&op_OP_INDEX_LIST, &&op_OP_GET_PROPERTY_SLOT, &&op_OP_MODULO_NUM, &&op_OP_EQUAL_NUM,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == static_cast<size_t>(OpCode::COUNT),
+        "Missing operations in the dispatch table");
+
+    // Each handler jumps straight to the next one, so every opcode gets its own indirect branch.
+#define CASE(op) op_##op: case OpCode::op
+#define DISPATCH() \
+    { \
+        TRACE_INSTRUCTION(); \
+        instruction = static_cast<OpCode>(readByte()); \
+        goto *dispatchTable[static_cast<uint8_t>(instruction)]; \
+    }
+#else
+#define CASE(op) case OpCode::op
+#define DISPATCH() continue
 #endif
 
-        const OpCode instruction = static_cast<OpCode>(readByte());
-        switch (instruction )
+    // The caller pushed a frame for a function that runs on registers.
+    if (!frame->closure->function->chunk.registers.empty())
+    {
+        const InterpretResult result = runRegisters();
+        if (result != InterpretResult::INTERPRET_OK || frameCount == 0 || frameCount == static_cast<size_t>(depth))
+        {
+            return result;
+        }
+        frame = &frames[frameCount - 1];
+    }
+
+    for (;;)
+    {
+        TRACE_INSTRUCTION();
+
+        instruction = static_cast<OpCode>(readByte());
+        switch (instruction)
         {
-            case OpCode::OP_CONSTANT:
+            CASE(OP_CONSTANT):
             {
                 const Value constant = readConstant();
                 push(constant);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_CONSTANT_LONG:
+            CASE(OP_CONSTANT_LONG):
             {
                 const Value constant = readLongConstant();
                 push(constant);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_NIL: push(Value()); break;
-            case OpCode::OP_TRUE: push(Value(true)); break;
-            case OpCode::OP_FALSE: push(Value(false)); break;
-            case OpCode::OP_POP: pop(); break;
-            case OpCode::OP_GET_LOCAL:
+            CASE(OP_NIL): push(Value()); DISPATCH();
+            CASE(OP_TRUE): push(Value(true)); DISPATCH();
+            CASE(OP_FALSE): push(Value(false)); DISPATCH();
+            CASE(OP_POP): pop(); DISPATCH();
+            CASE(OP_GET_LOCAL):
             {
                 const uint8_t slot = readByte();
                 push(frame->slots[slot]);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_LOCAL:
+            CASE(OP_SET_LOCAL):
             {
                 const uint8_t slot = readByte();
                 frame->slots[slot] = peek(0);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_GET_LOCAL_LONG:
+            CASE(OP_GET_LOCAL_LONG):
             {
                 const uint8_t slot = readDWord();
                 push(frame->slots[slot]);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_LOCAL_LONG:
+            CASE(OP_SET_LOCAL_LONG):
             {
                 const uint8_t slot = readDWord();
                 frame->slots[slot] = peek(0);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_GET_GLOBAL:
+            CASE(OP_GET_GLOBAL):
             {
-                ObjString* name = readString();
-                Value value;
-                if (!globals.get(name, &value))
+                const uint8_t slot = readByte();
+                if (!globals.isDefined(slot))
                 {
-                    runtimeError("Undefined variable '%s'.", name->chars.c_str());
+                    runtimeError("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
-                break;
+                push(globals.getValue(slot));
+                DISPATCH();
             }
-            case OpCode::OP_GET_UPVALUE:
+            CASE(OP_GET_UPVALUE):
             {
                 const uint8_t slot = readByte();
                 push(*frame->closure->upvalues[slot]->location);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_UPVALUE:
+            CASE(OP_SET_UPVALUE):
             {
                 const uint8_t slot = readByte();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                writeBarrier(upvalue, peek(0));
+                *upvalue->location = peek(0);
+                DISPATCH();
             }
-            case OpCode::OP_DEFINE_GLOBAL:
+            CASE(OP_DEFINE_GLOBAL):
             {
-                ObjString* name = readString();
-                globals.set(name, peek(0));
+                const uint8_t slot = readByte();
+                globals.define(slot, peek(0));
                 pop();
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_GLOBAL:
+            CASE(OP_SET_GLOBAL):
             {
-                ObjString* name = readString();
-                if (globals.set(name, peek(0)))
+                const uint8_t slot = readByte();
+                if (!globals.isDefined(slot))
                 {
-                    globals.remove(name);
-                    runtimeError("Undefined variable '%s'.", name->chars.c_str());
+                    runtimeError("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                globals.assign(slot, peek(0));
+                DISPATCH();
             }
-            case OpCode::OP_GET_GLOBAL_LONG:
+            CASE(OP_GET_GLOBAL_LONG):
             {
-                ObjString* name = readStringLong();
-                Value value;
-                if (!globals.get(name, &value))
+                const uint32_t slot = readDWord();
+                if (!globals.isDefined(slot))
                 {
-                    runtimeError("Undefined variable '%s'.", name->chars.c_str());
+                    runtimeError("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
-                break;
+                push(globals.getValue(slot));
+                DISPATCH();
             }
-            case OpCode::OP_DEFINE_GLOBAL_LONG:
+            CASE(OP_DEFINE_GLOBAL_LONG):
             {
-                ObjString* name = readStringLong();
-                globals.set(name, peek(0));
+                const uint32_t slot = readDWord();
+                globals.define(slot, peek(0));
                 pop();
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_GLOBAL_LONG:
+            CASE(OP_SET_GLOBAL_LONG):
             {
-                ObjString* name = readStringLong();
-                if (globals.set(name, peek(0)))
+                const uint32_t slot = readDWord();
+                if (!globals.isDefined(slot))
                 {
-                    globals.remove(name);
-                    runtimeError("Undefined variable '%s'.", name->chars.c_str());
+                    runtimeError("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                globals.assign(slot, peek(0));
+                DISPATCH();
             }
-            case OpCode::OP_GET_PROPERTY:
+            CASE(OP_GET_PROPERTY):
             {
+                InlineCache& cache = currentInlineCache();
                 if (!isInstance(peek(0)))
                 {
                     runtimeError("Only instances have properties.");
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjInstance* instance = asInstance(peek(0));
-                ObjString* name = readString();
-
-                Value value;
-                if (instance->fields.get(name, &value))
-                {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (bindMethod(instance, name))
-                {
-                    break;
-                }
-
-                pop(); // Instance.
-                push(Value()); // Nil
-                break;
+                const Shape* shape = asInstance(peek(0))->shape;
+                const bool monomorphicField = shape && !cache.megamorphic && cache.count == 1
+                    && cache.entries[0].shape == shape && cache.entries[0].slot >= 0;
+                quicken(monomorphicField ? OpCode::OP_GET_PROPERTY_SLOT : OpCode::OP_GET_PROPERTY);
+                getProperty(asInstance(peek(0)), readString(), cache);
+                DISPATCH();
             }
-            case OpCode::OP_GET_PROPERTY_LONG:
+            CASE(OP_GET_PROPERTY_LONG):
             {
+                InlineCache& cache = currentInlineCache();
                 if (!isInstance(peek(0)))
                 {
                     runtimeError("Only instances have properties.");
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjInstance* instance = asInstance(peek(0));
-                ObjString* name = readStringLong();
-
-                Value value;
-                if (instance->fields.get(name, &value))
-                {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (bindMethod(instance, name))
-                {
-                    break;
-                }
-
-                pop(); // Instance.
-                push(Value()); // Nil
-                break;
+                getProperty(asInstance(peek(0)), readStringLong(), cache);
+                DISPATCH();
             }
-            case OpCode::OP_SET_PROPERTY:
+            CASE(OP_SET_PROPERTY):
             {
+                InlineCache& cache = currentInlineCache();
                 if (!isInstance(peek(1)))
                 {
                     runtimeError("Only instances have fields.");
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjInstance* instance = asInstance(peek(1));
-                instance->fields.set(readString(), peek(0));
+                setProperty(asInstance(peek(1)), readString(), peek(0), cache);
                 const Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_PROPERTY_LONG:
+            CASE(OP_SET_PROPERTY_LONG):
             {
+                InlineCache& cache = currentInlineCache();
                 if (!isInstance(peek(1)))
                 {
                     runtimeError("Only instances have fields.");
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjInstance* instance = asInstance(peek(1));
-                instance->fields.set(readStringLong(), peek(0));
+                setProperty(asInstance(peek(1)), readStringLong(), peek(0), cache);
                 const Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_EQUAL:
+            CASE(OP_EQUAL):
             {
+                quicken(isNumber(peek(0)) && isNumber(peek(1)) ? OpCode::OP_EQUAL_NUM : OpCode::OP_EQUAL);
                 const Value b = pop();
                 const Value a = pop();
                 push(Value(a == b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MATCH:
+            CASE(OP_MATCH):
             {
                 const Value pattern = pop();
                 const Value value = pop();
@@ -610,139 +1159,97 @@ InterpretResult VM::run(int depth, bool allowPause)
                 {
                     push(Value(value == pattern));
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_GREATER:
+            CASE(OP_GREATER):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(a > b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_LESS:
+            CASE(OP_LESS):
             {
+                quicken(isNumber(peek(0)) && isNumber(peek(1)) ? OpCode::OP_LESS_NUM : OpCode::OP_LESS);
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(a < b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_NEGATE:
+            CASE(OP_NEGATE):
             {
                 if (!isNumber(peek(0)))
                 {
                     runtimeError("Operand must be a number");
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                push(Value(-asNumber(pop()))); break;
+                push(Value(-asNumber(pop()))); DISPATCH();
             }
-            case OpCode::OP_ADD:
+            CASE(OP_ADD):
             {
-                if (isString(peek(0)) && isString(peek(1)))
-                {
-                    concatenate();
-                }
-                else if (isNumber(peek(0)) && isNumber(peek(1)))
-                {
-                    const double b = asNumber(pop());
-                    const double a = asNumber(pop());
-                    push(Value(a + b));
-                }
-                else if (isList(peek(0)) && isList(peek(1)))
-                {
-                    ObjList* b = asList(peek(0));
-                    ObjList* a = asList(peek(1));
-
-                    ObjList* concat = newList();
-                    concat->items.reserve(a->items.size() + b->items.size());
-                    std::copy(a->items.begin(), a->items.end(), std::back_inserter(concat->items));
-                    std::copy(b->items.begin(), b->items.end(), std::back_inserter(concat->items));
-
-                    pop();
-                    pop();
-                    push(Value(concat));
-                }
-                else if (isString(peek(0)))
-                {
-                    ObjString* a = asString(peek(0));
-                    ObjString* val = valueToStringWithOverrides(peek(1));
-                    push(Value(val));
-                    ObjString* result = ::concatenate(val, a);
-
-                    pop();
-                    pop();
-                    pop();
-                    push(Value(result));
-                }
-                else if (isString(peek(1)))
-                {
-                    ObjString* b = asString(peek(1));
-                    ObjString* val = valueToStringWithOverrides(peek(0));
-                    push(Value(val));
-                    ObjString* result = ::concatenate(b, val);
-
-                    pop();
-                    pop();
-                    pop();
-                    push(Value(result));
-                }
+                if (isNumber(peek(0)) && isNumber(peek(1)))
+                    quicken(OpCode::OP_ADD_NUM);
+                else if (isString(peek(0)) && isString(peek(1)))
+                    quicken(OpCode::OP_ADD_STRING);
                 else
-                {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                    quicken(OpCode::OP_ADD);
+
+                if (!add()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_SUBTRACT:
+            CASE(OP_SUBTRACT):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(a - b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MULTIPLY:
+            CASE(OP_MULTIPLY):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(a * b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MIN:
+            CASE(OP_MIN):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(std::min(a, b)));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MAX:
+            CASE(OP_MAX):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(std::max(a, b)));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_DIVIDE:
+            CASE(OP_DIVIDE):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(a / b));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MODULO:
+            CASE(OP_MODULO):
             {
+                quicken(isNumber(peek(0)) && isNumber(peek(1)) ? OpCode::OP_MODULO_NUM : OpCode::OP_MODULO);
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double b = asNumber(pop());
                 const double a = asNumber(pop());
                 push(Value(std::fmod(a, b)));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_INCREMENT:
+            CASE(OP_INCREMENT):
             {
                 if (!isNumber(peek(0)))
                 {
@@ -751,22 +1258,22 @@ InterpretResult VM::run(int depth, bool allowPause)
                 }
                 const double a = asNumber(pop());
                 push(Value(a + 1));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_BUILD_RANGE:
+            CASE(OP_BUILD_RANGE):
             {
                 if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
                 const double max = asNumber(pop());
                 const double min = asNumber(pop());
                 push(Value(newRange(min, max)));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_BUILD_LIST:
+            CASE(OP_BUILD_LIST):
             {
                 push(Value(newList()));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_APPEND_LIST:
+            CASE(OP_APPEND_LIST):
             {
                 // Stack before: [..., list, item] and after: [..., list].
                 const Value item = pop();
@@ -776,14 +1283,14 @@ InterpretResult VM::run(int depth, bool allowPause)
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
                 asList(peek(0))->append(item);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_BUILD_MAP:
+            CASE(OP_BUILD_MAP):
             {
                 push(Value(newMap()));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_INSERT_MAP:
+            CASE(OP_INSERT_MAP):
             {
                 // Stack before: [..., map, key, value] and after: [..., map].
                 const Value value = pop();
@@ -794,9 +1301,9 @@ InterpretResult VM::run(int depth, bool allowPause)
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
                 asMap(peek(0))->set(key, value);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MAP_IN_BOUNDS:
+            CASE(OP_MAP_IN_BOUNDS):
             {
                 const Value index = pop();
                 const Value map = pop();
@@ -807,10 +1314,10 @@ InterpretResult VM::run(int depth, bool allowPause)
                 }
                 const int idx = static_cast<int>(asNumber(index));
                 push(Value(idx >= 0 && static_cast<size_t>(idx) < asMap(map)->size()));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_MAP_KEY_AT:
-            case OpCode::OP_MAP_VALUE_AT:
+            CASE(OP_MAP_KEY_AT):
+            CASE(OP_MAP_VALUE_AT):
             {
                 const Value index = pop();
                 const Value map = pop();
@@ -824,304 +1331,120 @@ InterpretResult VM::run(int depth, bool allowPause)
                 if (!entry)
                 {
                     push(Value());
-                    break;
+                    DISPATCH();
                 }
                 push(instruction == OpCode::OP_MAP_KEY_AT ? entry->key : entry->value);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_INDEX_SUBSCR:
+            CASE(OP_INDEX_SUBSCR):
             {
-                // stack is: [...,source,index] and after: [item]
-                Value index = pop();
-                Value source = pop();
-
-                if (isMap(source))
-                {
-                    Value value;
-                    push(asMap(source)->get(index, &value) ? value : Value());
-                    break;
-                }
-
-                if (isInstance(source))
-                {
-                    if (!isString(index))
-                    {
-                        runtimeError("Fields can only be accessed by strings.");
-                        return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjInstance* instance = asInstance(source);
-                    ObjString* name = asString(index);
-
-                    Value value;
-                    if (instance->fields.get(name, &value))
-                    {
-                        push(value);
-                        break;
-                    }
-
-                    push(source); // Bound method pops an instance and pushes the item
-                    if (bindMethod(instance, name))
-                    {
-                        break;
-                    }
-
-                    push(Value()); // Nil
-                    break;
-                }
-                if (!isNumber(index))
-                {
-                    runtimeError("Index is not a number.");
-                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                }
-
-                const int idx = static_cast<int>(asNumber(index));
+                quicken(isList(peek(1)) && isNumber(peek(0)) ? OpCode::OP_INDEX_LIST : OpCode::OP_INDEX_SUBSCR);
 
-                if (isList(source))
-                {
-                    ObjList* list = asList(source);
-                    if (list->isInBounds(idx))
-                    {
-                        push(Value(list->getValue(idx)));
-                    }
-                    else
-                    {
-                        push(Value());
-                    }
-                }
-                else if (isRange(source))
-                {
-                    ObjRange* range = asRange(source);
-                    if (range->isInBounds(idx))
-                    {
-                        push(Value(range->getValue(idx)));
-                    }
-                    else
-                    {
-                        push(Value());
-                    }
-                }
-                else if (isString(source))
-                {
-                    ObjString* string = asString(source);
-                    if (idx >= 0 && idx < string->length)
-                    {
-                        const char c = string->chars[idx];
-                        ObjString* character = takeString(&c, 1);
-                        push(Value(character));
-                    }
-                    else
-                    {
-                        push(Value());
-                    }
-                }
-                else
-                {
-                    runtimeError("Invalid range type.");
-                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                if (!indexSubscript()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                DISPATCH();
             }
-            case OpCode::OP_STORE_SUBSCR:
+            CASE(OP_STORE_SUBSCR):
             {
-                // stack is: [...,source,index,item] and after: [item]
-                // We can have: instance and string, or range|list|string and number
-                Value item = pop();
-                Value index = pop();
-                Value source = pop();
-
-                if (isMap(source))
-                {
-                    asMap(source)->set(index, item);
-                    push(item);
-                    break;
-                }
-
-                if (isInstance(source))
-                {
-                    if (!isString(index))
-                    {
-                        runtimeError("Fields can only be accessed by strings.");
-                        return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjInstance* instance = asInstance(source);
-                    ObjString* name = asString(index);
-
-                    instance->fields.set(name, item);
-                    push(item);
-                }
-                else
-                {
-                    if (!isNumber(index))
-                    {
-                        runtimeError("List index is not a number.");
-                        return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    const int idx = static_cast<int>(asNumber(index));
-
-                    if (isList(source))
-                    {
-                        ObjList* list = asList(source);
-
-                        // TODO: Maybe just reserve more space in the list?
-                        if (!list->isInBounds(idx))
-                        {
-                            runtimeError("Invalid list index.");
-                            return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                        }
-
-                        list->setValue(idx, item);
-                        push(item);
-                    }
-                    else if (isString(source))
-                    {
-                        if(!isString(item))
-                        {
-                            runtimeError("You can only assign characters.");
-                            return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                        }
-
-                        ObjString* str = asString(source);
-                        ObjString* character = asString(item);
-
-                        if (character->chars.length() != 1)
-                        {
-                            runtimeError("Invalid string length.");
-                            return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                        }
-
-                        if (idx >= 0 && idx < str->length)
-                        {
-                            str->chars[idx] = character->chars[0];
-                            push(Value(copyString(character->chars.c_str(), 1)));
-                        }
-                        else
-                        {
-                            runtimeError("Invalid string index.");
-                            return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                        }
-                    }
-                    else
-                    {
-                        runtimeError("Cannot store value.");
-                        return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                    }
-                }
-                break;
+                if (!storeSubscript()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                DISPATCH();
             }
-            case OpCode::OP_RANGE_IN_BOUNDS:
+            CASE(OP_RANGE_IN_BOUNDS):
             {
                 // stack is: [...,source,index] and after: [true|false]
-                if (!isNumber(peek(0)))
-                {
-                    runtimeError("List index is not a number.");
-                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                }
-
-                const int idx = static_cast<int>(asNumber(pop()));
-                const Value item = pop();
-
-                if (isRange(item))
-                {
-                    ObjRange* range = asRange(item);
-                    push(Value(range->isInBounds(idx)));
-                }
-                else if (isList(item))
-                {
-                    ObjList* list = asList(item);
-                    push(Value(list->isInBounds(idx)));
-                }
-                else if (isString(item))
-                {
-                    ObjString* string = asString(item);
-                    const bool isInRange = idx >= 0 && idx < string->length;
-                    push(Value(isInRange));
-                }
-                else
-                {
-                    runtimeError("Invalid range type.");
-                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                bool inBounds = false;
+                if (!isInBounds(peek(1), peek(0), inBounds)) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                pop();
+                pop();
+                push(Value(inBounds));
+                DISPATCH();
             }
-            case OpCode::OP_NOT:
+            CASE(OP_NOT):
             {
                 push(Value(isFalsey(pop())));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_IS_NIL:
+            CASE(OP_IS_NIL):
             {
                 push(Value(isNil(pop())));
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_TO_STRING:
+            CASE(OP_TO_STRING):
             {
                 ObjString* result = valueToStringWithOverrides(peek(0));
                 pop();
                 push(Value(result));
-                break;
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_PRINT:
+            CASE(OP_PRINT):
             {
                 const Value value = peek(0);
                 printValueWithOverrides(value);
                 pop();
                 std::cout << '\n';
-                break;
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_JUMP:
+            CASE(OP_JUMP):
             {
                 const uint16_t offset = readShort();
                 frame->ip += offset;
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_JUMP_IF_FALSE:
+            CASE(OP_JUMP_IF_FALSE):
             {
                 const uint16_t offset = readShort();
                 if(isFalsey(peek(0))) frame->ip += offset;
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_LOOP:
+            CASE(OP_LOOP):
             {
                 const uint16_t offset = readShort();
                 frame->ip -= offset;
-                break;
+                POLL_STOP_REQUEST();
+                DISPATCH();
             }
-            case OpCode::OP_CALL:
+            CASE(OP_CALL):
             {
+                POLL_STOP_REQUEST();
                 const uint8_t argCount = readByte();
                 if (!callValue(peek(argCount), argCount))
                 {
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount - 1];
-                break;
+                ENTER_CALLED_FRAME();
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_INVOKE:
+            CASE(OP_INVOKE):
             {
+                POLL_STOP_REQUEST();
+                InlineCache& cache = currentInlineCache();
                 ObjString* method = readString();
                 const uint8_t argCount = readByte();
-                if (!invoke(method, argCount))
+                if (!invoke(method, argCount, cache))
                 {
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount - 1];
-                break;
+                ENTER_CALLED_FRAME();
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_INVOKE_LONG:
+            CASE(OP_INVOKE_LONG):
             {
+                POLL_STOP_REQUEST();
+                InlineCache& cache = currentInlineCache();
                 ObjString* method = readStringLong();
                 const uint8_t argCount = readByte();
-                if (!invoke(method, argCount))
+                if (!invoke(method, argCount, cache))
                 {
                     return InterpretResult::INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount - 1];
-                break;
+                ENTER_CALLED_FRAME();
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
             }
-            case OpCode::OP_CLOSURE:
+            CASE(OP_CLOSURE):
             {
                 ObjFunction* function = asFunction(readConstant());
                 ObjClosure* closure = newClosure(function);
@@ -1130,18 +1453,14 @@ InterpretResult VM::run(int depth, bool allowPause)
                 {
                     const uint8_t isLocal = readByte();
                     const uint8_t index = readByte();
-                    if (isLocal)
-                    {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    }
-                    else
-                    {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+                    ObjUpvalue* upvalue = isLocal ? captureUpvalue(frame->slots + index) : frame->closure->upvalues[index];
+                    // Capturing allocates, the closure can be old by now.
+                    writeBarrier(closure, upvalue);
+                    closure->upvalues[i] = upvalue;
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_CLOSURE_LONG:
+            CASE(OP_CLOSURE_LONG):
             {
                 ObjFunction* function = asFunction(readLongConstant());
                 ObjClosure* closure = newClosure(function);
@@ -1150,22 +1469,18 @@ InterpretResult VM::run(int depth, bool allowPause)
                 {
                     const uint8_t isLocal = readByte();
                     const uint8_t index = readByte();
-                    if (isLocal)
-                    {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    }
-                    else
-                    {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+                    ObjUpvalue* upvalue = isLocal ? captureUpvalue(frame->slots + index) : frame->closure->upvalues[index];
+                    // Capturing allocates, the closure can be old by now.
+                    writeBarrier(closure, upvalue);
+                    closure->upvalues[i] = upvalue;
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE):
                 closeUpvalues(stackTop - 1);
                 pop();
-                break;
-            case OpCode::OP_RETURN:
+                DISPATCH();
+            CASE(OP_RETURN):
             {
                 const Value result = pop();
                 closeUpvalues(frame->slots);
@@ -1184,21 +1499,21 @@ InterpretResult VM::run(int depth, bool allowPause)
                 {
                     return InterpretResult::INTERPRET_OK;
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_CLASS:
+            CASE(OP_CLASS):
                 push(Value(newClass(readString())));
-                break;
-            case OpCode::OP_CLASS_LONG:
+                DISPATCH();
+            CASE(OP_CLASS_LONG):
                 push(Value(newClass(readStringLong())));
-                break;
-            case OpCode::OP_METHOD:
+                DISPATCH();
+            CASE(OP_METHOD):
                 defineMethod(readString());
-                break;
-            case OpCode::OP_METHOD_LONG:
+                DISPATCH();
+            CASE(OP_METHOD_LONG):
                 defineMethod(readStringLong());
-                break;
-            case OpCode::OP_DEBUG_BREAK:
+                DISPATCH();
+            CASE(OP_DEBUG_BREAK):
             {
                 const uint32_t probeId = readDWord();
                 if (debugHandler && debugHandler->WantsBreakpoints() && debugHandler->OnBreakpoint(probeId, *this))
@@ -1207,38 +1522,639 @@ InterpretResult VM::run(int depth, bool allowPause)
                         return InterpretResult::INTERPRET_PAUSED;
                     debugPausePending = true;
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_DEBUG_VALUE:
+            CASE(OP_DEBUG_VALUE):
             {
                 const uint32_t probeId = readDWord();
                 if (debugHandler && debugHandler->WantsValues())
+                {
+                    // The debugger keeps the values it sees.
+                    rememberValue(peek(0));
                     debugHandler->OnValue(probeId, peek(0));
-                break;
+                }
+                DISPATCH();
             }
-        }
-        if (allowPause && debugPausePending)
-        {
-            debugPausePending = false;
-            return InterpretResult::INTERPRET_PAUSED;
-        }
-        static_assert(static_cast<int>(OpCode::COUNT) == 66, "Missing operations in the VM");
-    }
-}
-
-std::vector<VmDebugCallFrame> VM::getDebugCallStack() const
-{
-    std::vector<VmDebugCallFrame> result;
-    result.reserve(frameCount);
-    for (size_t index = frameCount; index > 0; --index)
-    {
-        const CallFrame& frame = frames[index - 1];
-        const ObjFunction* function = frame.closure ? frame.closure->function : nullptr;
-        VmDebugCallFrame snapshot;
+            CASE(OP_POPN):
+            {
+                const uint8_t count = readByte();
+                stackTop -= count;
+                DISPATCH();
+            }
+            CASE(OP_INCREMENT_LOCAL):
+            {
+                Value& local = frame->slots[readByte()];
+                if (!isNumber(local))
+                {
+                    runtimeError("Can only increment numbers");
+                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                }
+                local = Value(asNumber(local) + 1);
+                DISPATCH();
+            }
+            CASE(OP_ADD_LOCALS):
+            {
+                const Value a = frame->slots[readByte()];
+                const Value b = frame->slots[readByte()];
+                if (isNumber(a) && isNumber(b))
+                {
+                    push(Value(asNumber(a) + asNumber(b)));
+                    DISPATCH();
+                }
 
-        snapshot.function = function;
+                push(a);
+                push(b);
+                if (!add()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                CHECK_PENDING_PAUSE();
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_LOCALS):
+            {
+                const Value a = frame->slots[readByte()];
+                const Value b = frame->slots[readByte()];
+                if (!isNumber(a) || !isNumber(b))
+                {
+                    push(a);
+                    push(b);
+                    validateBinaryOperator();
+                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                }
+                push(Value(asNumber(a) - asNumber(b)));
+                DISPATCH();
+            }
+            CASE(OP_MULTIPLY_LOCALS):
+            {
+                const Value a = frame->slots[readByte()];
+                const Value b = frame->slots[readByte()];
+                if (!isNumber(a) || !isNumber(b))
+                {
+                    push(a);
+                    push(b);
+                    validateBinaryOperator();
+                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                }
+                push(Value(asNumber(a) * asNumber(b)));
+                DISPATCH();
+            }
+            CASE(OP_LESS_LOCALS):
+            {
+                const Value a = frame->slots[readByte()];
+                const Value b = frame->slots[readByte()];
+                if (!isNumber(a) || !isNumber(b))
+                {
+                    push(a);
+                    push(b);
+                    validateBinaryOperator();
+                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                }
+                push(Value(asNumber(a) < asNumber(b)));
+                DISPATCH();
+            }
+            // The fused branches leave the condition on the stack only when they jump,
+            // the taken path pops it just like the OP_POP they replace.
+            CASE(OP_LESS_JUMP_IF_FALSE):
+            {
+                if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                const double b = asNumber(pop());
+                const double a = asNumber(pop());
+                const uint16_t offset = readShort();
+                if (!(a < b))
+                {
+                    push(Value(false));
+                    frame->ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(OP_LESS_LOCALS_JUMP_IF_FALSE):
+            {
+                const Value a = frame->slots[readByte()];
+                const Value b = frame->slots[readByte()];
+                const uint16_t offset = readShort();
+                if (!isNumber(a) || !isNumber(b))
+                {
+                    push(a);
+                    push(b);
+                    validateBinaryOperator();
+                    return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                }
+                if (!(asNumber(a) < asNumber(b)))
+                {
+                    push(Value(false));
+                    frame->ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(OP_RANGE_LOCALS_JUMP_IF_FALSE):
+            {
+                const Value source = frame->slots[readByte()];
+                const Value index = frame->slots[readByte()];
+                const uint16_t offset = readShort();
+                bool inBounds = false;
+                if (!isInBounds(source, index, inBounds)) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                if (!inBounds)
+                {
+                    push(Value(false));
+                    frame->ip += offset;
+                }
+                DISPATCH();
+            }
+            // Emitted for statically typed pins, and ADD, LESS, EQUAL and MODULO are also quickened
+            // from the generic instructions. Typed pins still accept nil, so every number variant keeps
+            // a guard. A quickened variant goes back to the generic instruction when it fails, which
+            // handles the other types or reports the error. SUBTRACT, MULTIPLY and GREATER only come
+            // from typed pins, so there is nothing to go back to and they report the same error the
+            // generic instruction would.
+            CASE(OP_ADD_NUM):
+            {
+                if (!isNumber(peek(0)) || !isNumber(peek(1)))
+                {
+                    deoptimize(OpCode::OP_ADD);
+                    DISPATCH();
+                }
 
-        if (function && !function->chunk.code.empty() && frame.ip)
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) + b);
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_NUM):
+            {
+                if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) - b);
+                DISPATCH();
+            }
+            CASE(OP_MULTIPLY_NUM):
+            {
+                if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) * b);
+                DISPATCH();
+            }
+            CASE(OP_LESS_NUM):
+            {
+                if (!isNumber(peek(0)) || !isNumber(peek(1)))
+                {
+                    deoptimize(OpCode::OP_LESS);
+                    DISPATCH();
+                }
+
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) < b);
+                DISPATCH();
+            }
+            CASE(OP_GREATER_NUM):
+            {
+                if (!validateBinaryOperator()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) > b);
+                DISPATCH();
+            }
+            CASE(OP_ADD_STRING):
+            {
+                if (!isString(peek(0)) || !isString(peek(1)))
+                {
+                    deoptimize(OpCode::OP_ADD);
+                    DISPATCH();
+                }
+
+                concatenate();
+                DISPATCH();
+            }
+            CASE(OP_INDEX_LIST):
+            {
+                if (!isList(peek(1)) || !isNumber(peek(0)))
+                {
+                    deoptimize(OpCode::OP_INDEX_SUBSCR);
+                    DISPATCH();
+                }
+
+                const int idx = static_cast<int>(asNumber(pop()));
+                ObjList* list = asList(peek(0));
+                peek(0) = list->isInBounds(idx) ? Value(list->getValue(idx)) : Value();
+                DISPATCH();
+            }
+            CASE(OP_GET_PROPERTY_SLOT):
+            {
+                // Quickened from a GET_PROPERTY whose cache only ever saw one shape with the name as a field.
+                const InlineCacheEntry& entry = currentInlineCache().entries[0];
+                if (!isInstance(peek(0)) || asInstance(peek(0))->shape != entry.shape)
+                {
+                    deoptimize(OpCode::OP_GET_PROPERTY);
+                    DISPATCH();
+                }
+
+                readByte();
+                inlineCacheStats.hits++;
+                peek(0) = asInstance(peek(0))->slots[entry.slot];
+                DISPATCH();
+            }
+            CASE(OP_MODULO_NUM):
+            {
+                if (!isNumber(peek(0)) || !isNumber(peek(1)))
+                {
+                    deoptimize(OpCode::OP_MODULO);
+                    DISPATCH();
+                }
+
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(std::fmod(asNumber(a), b));
+                DISPATCH();
+            }
+            CASE(OP_EQUAL_NUM):
+            {
+                if (!isNumber(peek(0)) || !isNumber(peek(1)))
+                {
+                    deoptimize(OpCode::OP_EQUAL);
+                    DISPATCH();
+                }
+
+                const double b = asNumber(pop());
+                Value& a = peek(0);
+                a = Value(asNumber(a) == b);
+                DISPATCH();
+            }
+        }
+        static_assert(static_cast<int>(OpCode::COUNT) == 85, "Missing operations in the VM");
+    }
+
+#undef TRACE_INSTRUCTION
+#undef POLL_STOP_REQUEST
+#undef CHECK_PENDING_PAUSE
+#undef ENTER_CALLED_FRAME
+#undef CASE
+#undef DISPATCH
+}
+
+InterpretResult VM::runRegisters()
+{
+    const NestingScope nesting(*this);
+    if (nativeNesting > NATIVE_NESTING_MAX)
+    {
+        frameCount--;
+        runtimeError("Stack overflow.");
+        return InterpretResult::INTERPRET_RUNTIME_ERROR;
+    }
+
+    if (!enterRegisterFrame()) return InterpretResult::INTERPRET_RUNTIME_ERROR;
+
+    Chunk& functionChunk = frames[frameCount - 1].closure->function->chunk;
+#ifdef VLOX_JIT
+    if (const JitCode* jit = hotJitCode(functionChunk))
+    {
+        return static_cast<InterpretResult>(jit->run(this, frames[frameCount - 1].slots, 0, &stopRequested));
+    }
+#endif
+
+    return executeRegisters<false>(functionChunk.registers.code.data());
+}
+
+bool VM::enterRegisterFrame()
+{
+    const CallFrame& frame = frames[frameCount - 1];
+    Value* const registersEnd = frame.slots + frame.closure->function->chunk.registers.registerCount;
+
+    // The stack helpers used by some instructions push up to 3 values above the registers.
+    if (registersEnd + 3 > stack.data() + STACK_MAX)
+    {
+        frameCount--;
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    // Registers past the arguments can still hold values from earlier calls.
+    for (Value* slot = stackTop; slot < registersEnd; ++slot)
+    {
+        *slot = Value();
+    }
+    stackTop = registersEnd;
+    return true;
+}
+
+template <bool SINGLE_STEP>
+InterpretResult VM::executeRegisters(const RegisterInstruction* ip)
+{
+    // Calls between register functions switch these over instead of recursing, only the frames
+    // above entryFrames were entered by this loop and return into it.
+    const size_t entryFrames = frameCount;
+    CallFrame* frame;
+    Chunk* functionChunk;
+    const Value* constants;
+    Value* registers;
+    Value* registersEnd;
+    const RegisterInstruction* code;
+
+    auto loadFrame = [&]()
+    {
+        frame = &frames[frameCount - 1];
+        functionChunk = &frame->closure->function->chunk;
+        constants = functionChunk->constants.values.data();
+        registers = frame->slots;
+        registersEnd = registers + functionChunk->registers.registerCount;
+        code = functionChunk->registers.code.data();
+    };
+    loadFrame();
+
+    // The result is in the callee register, the registers above it are dead now.
+    auto finishCall = [&](Value* callee)
+    {
+        for (Value* slot = callee + 1; slot < registersEnd; ++slot)
+        {
+            *slot = Value();
+        }
+        stackTop = registersEnd;
+    };
+    // The callee pushed its result where it was called from.
+    auto returnToCaller = [&]()
+    {
+        loadFrame();
+        ip = frame->registerIp;
+        finishCall(stackTop - 1);
+    };
+
+    auto operand = [&](uint16_t value) -> const Value&
+    {
+        return (value & RegisterChunk::CONSTANT_OPERAND) ? constants[value & ~RegisterChunk::CONSTANT_OPERAND] : registers[value];
+    };
+
+    // runtimeError() reads the line of the current instruction from the frame.
+#define SAVE_IP() frame->registerIp = ip
+
+#define REGISTER_ERROR(...) \
+    { \
+        SAVE_IP(); \
+        runtimeError(__VA_ARGS__); \
+        return InterpretResult::INTERPRET_RUNTIME_ERROR; \
+    }
+
+#define POLL_STOP_REQUEST() \
+    if (stopRequested.load(std::memory_order_relaxed)) return InterpretResult::INTERPRET_RUNTIME_ERROR
+
+#define NUMBER_OPERATION(expression) \
+    { \
+        const Value& left = operand(instruction.b); \
+        const Value& right = operand(instruction.c); \
+        if (!isNumber(left) || !isNumber(right)) REGISTER_ERROR("Operands must be numbers."); \
+        const double a = asNumber(left); \
+        const double b = asNumber(right); \
+        registers[instruction.a] = Value(expression); \
+        break; \
+    }
+
+    for (;;)
+    {
+        const RegisterInstruction& instruction = *ip++;
+        switch (instruction.op)
+        {
+        case RegisterOp::MOVE:
+            registers[instruction.a] = operand(instruction.b);
+            break;
+        case RegisterOp::GET_GLOBAL:
+        {
+            const uint32_t slot = instruction.b | (static_cast<uint32_t>(instruction.c) << 16);
+            if (!globals.isDefined(slot)) REGISTER_ERROR("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
+            registers[instruction.a] = globals.getValue(slot);
+            break;
+        }
+        case RegisterOp::SET_GLOBAL:
+        {
+            const uint32_t slot = instruction.b | (static_cast<uint32_t>(instruction.c) << 16);
+            if (!globals.isDefined(slot)) REGISTER_ERROR("Undefined variable '%s'.", globals.getName(slot)->chars.c_str());
+            globals.assign(slot, operand(instruction.a));
+            break;
+        }
+        case RegisterOp::DEFINE_GLOBAL:
+            globals.define(instruction.b | (static_cast<uint32_t>(instruction.c) << 16), operand(instruction.a));
+            break;
+        case RegisterOp::EQUAL:
+            registers[instruction.a] = Value(operand(instruction.b) == operand(instruction.c));
+            break;
+        case RegisterOp::LESS:      NUMBER_OPERATION(a < b)
+        case RegisterOp::GREATER:   NUMBER_OPERATION(a > b)
+        case RegisterOp::SUBTRACT:  NUMBER_OPERATION(a - b)
+        case RegisterOp::MULTIPLY:  NUMBER_OPERATION(a * b)
+        case RegisterOp::DIVIDE:    NUMBER_OPERATION(a / b)
+        case RegisterOp::MODULO:    NUMBER_OPERATION(std::fmod(a, b))
+        case RegisterOp::MIN:       NUMBER_OPERATION(std::min(a, b))
+        case RegisterOp::MAX:       NUMBER_OPERATION(std::max(a, b))
+        case RegisterOp::ADD:
+        {
+            const Value& left = operand(instruction.b);
+            const Value& right = operand(instruction.c);
+            if (isNumber(left) && isNumber(right))
+            {
+                registers[instruction.a] = Value(asNumber(left) + asNumber(right));
+                break;
+            }
+
+            SAVE_IP();
+            push(left);
+            push(right);
+            if (!add()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+            registers[instruction.a] = pop();
+            break;
+        }
+        case RegisterOp::NEGATE:
+        {
+            const Value& value = operand(instruction.b);
+            if (!isNumber(value)) REGISTER_ERROR("Operand must be a number");
+            registers[instruction.a] = Value(-asNumber(value));
+            break;
+        }
+        case RegisterOp::NOT:
+            registers[instruction.a] = Value(isFalsey(operand(instruction.b)));
+            break;
+        case RegisterOp::INCREMENT:
+        {
+            const Value& value = operand(instruction.b);
+            if (!isNumber(value)) REGISTER_ERROR("Can only increment numbers");
+            registers[instruction.a] = Value(asNumber(value) + 1);
+            break;
+        }
+        case RegisterOp::TO_STRING:
+        {
+            SAVE_IP();
+            ObjString* result = valueToStringWithOverrides(operand(instruction.b));
+            registers[instruction.a] = Value(result);
+            break;
+        }
+        case RegisterOp::BUILD_LIST:
+            registers[instruction.a] = Value(newList());
+            break;
+        case RegisterOp::APPEND_LIST:
+        {
+            if (!isList(registers[instruction.a])) REGISTER_ERROR("Can only append list literal items to a list.");
+            asList(registers[instruction.a])->append(operand(instruction.b));
+            break;
+        }
+        case RegisterOp::INDEX_SUBSCR:
+        {
+            SAVE_IP();
+            push(operand(instruction.b));
+            push(operand(instruction.c));
+            if (!indexSubscript()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+            registers[instruction.a] = pop();
+            break;
+        }
+        case RegisterOp::STORE_SUBSCR:
+        {
+            SAVE_IP();
+            push(operand(instruction.a));
+            push(operand(instruction.b));
+            push(operand(instruction.c));
+            if (!storeSubscript()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+            pop();
+            break;
+        }
+        case RegisterOp::RANGE_IN_BOUNDS:
+        {
+            SAVE_IP();
+            bool inBounds = false;
+            if (!isInBounds(operand(instruction.b), operand(instruction.c), inBounds)) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+            registers[instruction.a] = Value(inBounds);
+            break;
+        }
+        case RegisterOp::JUMP:
+            if (code + instruction.a < ip)
+            {
+                POLL_STOP_REQUEST();
+#ifdef VLOX_JIT
+                // Hot loops move to the compiled code at the loop header.
+                if (const JitCode* jit = hotJitCode(*functionChunk))
+                {
+                    const auto result = static_cast<InterpretResult>(jit->run(this, registers, instruction.a, &stopRequested));
+                    if (SINGLE_STEP || result != InterpretResult::INTERPRET_OK || frameCount < entryFrames) { return result; }
+                    returnToCaller();
+                    break;
+                }
+#endif
+            }
+            ip = code + instruction.a;
+            break;
+        case RegisterOp::JUMP_IF_FALSE:
+            if (isFalsey(operand(instruction.a))) ip = code + instruction.b;
+            break;
+        case RegisterOp::JUMP_IF_NOT_LESS:
+        {
+            const Value& left = operand(instruction.a);
+            const Value& right = operand(instruction.b);
+            if (!isNumber(left) || !isNumber(right)) REGISTER_ERROR("Operands must be numbers.");
+            if (!(asNumber(left) < asNumber(right))) ip = code + instruction.c;
+            break;
+        }
+        case RegisterOp::CALL:
+        {
+            POLL_STOP_REQUEST();
+            SAVE_IP();
+            Value* callee = registers + instruction.a;
+            const uint8_t argCount = static_cast<uint8_t>(instruction.b);
+            const size_t callerFrames = frameCount;
+
+            stackTop = callee + argCount + 1;
+            if (!callValue(*callee, argCount)) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+            if (frameCount > callerFrames)
+            {
+                Chunk& calledChunk = frames[frameCount - 1].closure->function->chunk;
+                if (SINGLE_STEP || calledChunk.registers.empty())
+                {
+                    const InterpretResult result = calledChunk.registers.empty()
+                        ? run(static_cast<int>(callerFrames), false)
+                        : runRegisters();
+                    if (result != InterpretResult::INTERPRET_OK) { return result; }
+                }
+                else
+                {
+                    if (!enterRegisterFrame()) { return InterpretResult::INTERPRET_RUNTIME_ERROR; }
+#ifdef VLOX_JIT
+                    if (const JitCode* jit = hotJitCode(calledChunk))
+                    {
+                        const auto result = static_cast<InterpretResult>(jit->run(this, frames[frameCount - 1].slots, 0, &stopRequested));
+                        if (result != InterpretResult::INTERPRET_OK) { return result; }
+                        finishCall(callee);
+                        break;
+                    }
+#endif
+                    // Register functions call each other without nesting this loop.
+                    loadFrame();
+                    ip = code;
+                    break;
+                }
+            }
+
+            finishCall(callee);
+            break;
+        }
+        case RegisterOp::RETURN:
+        {
+            const Value result = operand(instruction.a);
+            closeUpvalues(registers);
+            frameCount--;
+            if (frameCount == 0)
+            {
+                // Same as the stack interpreter, only the script closure is left.
+                stackTop = registers + 1;
+                return InterpretResult::INTERPRET_OK;
+            }
+
+            stackTop = registers;
+            push(result);
+            if (SINGLE_STEP || frameCount < entryFrames) { return InterpretResult::INTERPRET_OK; }
+            returnToCaller();
+            break;
+        }
+        default:
+            REGISTER_ERROR("Unknown register instruction.");
+        }
+
+        if constexpr (SINGLE_STEP) return InterpretResult::INTERPRET_OK;
+    }
+
+    static_assert(static_cast<int>(RegisterOp::COUNT) == 28, "Missing operations in executeRegisters");
+
+#undef SAVE_IP
+#undef REGISTER_ERROR
+#undef POLL_STOP_REQUEST
+#undef NUMBER_OPERATION
+}
+
+// Counts calls and loop iterations, and compiles the function once it gets hot. While a debugger
+// wants breakpoints or values, compiled code isn't entered and functions stay on the interpreter.
+const JitCode* VM::hotJitCode(Chunk& chunk)
+{
+    RegisterChunk& registers = chunk.registers;
+    if (!registers.jitEnabled) return nullptr;
+    if (debugHandler && (debugHandler->WantsBreakpoints() || debugHandler->WantsValues())) return nullptr;
+    if (registers.jit) return registers.jit.get();
+    if (registers.jitFailed || ++registers.hotness < JIT_THRESHOLD) return nullptr;
+
+    registers.jit = compileJit(chunk, &VM::runJitStep);
+    registers.jitFailed = !registers.jit;
+    return registers.jit.get();
+}
+
+int VM::runJitStep(VM* vm, const RegisterInstruction* instruction)
+{
+    return static_cast<int>(vm->executeRegisters<true>(instruction));
+}
+
+std::vector<VmDebugCallFrame> VM::getDebugCallStack() const
+{
+    std::vector<VmDebugCallFrame> result;
+    result.reserve(frameCount);
+    for (size_t index = frameCount; index > 0; --index)
+    {
+        const CallFrame& frame = frames[index - 1];
+        const ObjFunction* function = frame.closure ? frame.closure->function : nullptr;
+        VmDebugCallFrame snapshot;
+
+        snapshot.function = function;
+
+        if (function && !function->chunk.code.empty() && frame.ip)
             snapshot.instructionOffset = static_cast<size_t>(frame.ip - function->chunk.code.data());
 
         result.push_back(std::move(snapshot));
@@ -1265,9 +2181,11 @@ inline void VM::runtimeError(const char* format, ...)
     {
         const CallFrame& frame = frames[i];
         const ObjFunction* function = frame.closure->function;
-        const size_t instruction = frame.ip - &function->chunk.code[0] - 1;
+        const int line = frame.registerIp
+            ? function->chunk.registers.lines[frame.registerIp - function->chunk.registers.code.data() - 1]
+            : function->chunk.lines[frame.ip - &function->chunk.code[0] - 1];
 
-        std::cerr << "[line " << function->chunk.lines[instruction] << "] in ";
+        std::cerr << "[line " << line << "] in ";
         if (function->name == nullptr)
         {
             std::cerr << "script" << std::endl;
@@ -1301,6 +2219,8 @@ void VM::defineNativeClass(const char* name, std::vector<NativeMethodDef>&& meth
         push(Value(copyString(method.name, (int)strlen(method.name))));
         push(Value(newNative(method.arity, method.function, true)));
 
+        writeBarrier(asClass(stack[1]), peek(1));
+        writeBarrier(asClass(stack[1]), peek(0));
         if (strcmp(method.name, "init") == 0)
             asClass(stack[1])->initializer = peek(0);
         else
@@ -1326,6 +2246,280 @@ bool VM::validateBinaryOperator()
     return true;
 }
 
+bool VM::add()
+{
+    if (isString(peek(0)) && isString(peek(1)))
+    {
+        concatenate();
+    }
+    else if (isNumber(peek(0)) && isNumber(peek(1)))
+    {
+        const double b = asNumber(pop());
+        const double a = asNumber(pop());
+        push(Value(a + b));
+    }
+    else if (isList(peek(0)) && isList(peek(1)))
+    {
+        ObjList* b = asList(peek(0));
+        ObjList* a = asList(peek(1));
+
+        ObjList* concat = newList();
+        concat->items.reserve(a->items.size() + b->items.size());
+        std::copy(a->items.begin(), a->items.end(), std::back_inserter(concat->items));
+        std::copy(b->items.begin(), b->items.end(), std::back_inserter(concat->items));
+
+        pop();
+        pop();
+        push(Value(concat));
+    }
+    else if (isString(peek(0)))
+    {
+        ObjString* a = asString(peek(0));
+        ObjString* val = valueToStringWithOverrides(peek(1));
+        push(Value(val));
+        ObjString* result = ::concatenate(val, a);
+
+        pop();
+        pop();
+        pop();
+        push(Value(result));
+    }
+    else if (isString(peek(1)))
+    {
+        ObjString* b = asString(peek(1));
+        ObjString* val = valueToStringWithOverrides(peek(0));
+        push(Value(val));
+        ObjString* result = ::concatenate(b, val);
+
+        pop();
+        pop();
+        pop();
+        push(Value(result));
+    }
+    else
+    {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+
+    return true;
+}
+
+bool VM::indexSubscript()
+{
+    // stack is: [...,source,index] and after: [item]
+    Value index = pop();
+    Value source = pop();
+
+    if (isMap(source))
+    {
+        Value value;
+        push(asMap(source)->get(index, &value) ? value : Value());
+        return true;
+    }
+
+    if (isInstance(source))
+    {
+        if (!isString(index))
+        {
+            runtimeError("Fields can only be accessed by strings.");
+            return false;
+        }
+
+        ObjInstance* instance = asInstance(source);
+        ObjString* name = asString(index);
+
+        Value value;
+        if (instance->getField(name, &value))
+        {
+            push(value);
+            return true;
+        }
+
+        push(source); // Bound method pops an instance and pushes the item
+        if (bindMethod(instance, name))
+        {
+            return true;
+        }
+
+        push(Value()); // Nil
+        return true;
+    }
+    if (!isNumber(index))
+    {
+        runtimeError("Index is not a number.");
+        return false;
+    }
+
+    const int idx = static_cast<int>(asNumber(index));
+
+    if (isList(source))
+    {
+        ObjList* list = asList(source);
+        if (list->isInBounds(idx))
+        {
+            push(Value(list->getValue(idx)));
+        }
+        else
+        {
+            push(Value());
+        }
+    }
+    else if (isRange(source))
+    {
+        ObjRange* range = asRange(source);
+        if (range->isInBounds(idx))
+        {
+            push(Value(range->getValue(idx)));
+        }
+        else
+        {
+            push(Value());
+        }
+    }
+    else if (isString(source))
+    {
+        ObjString* string = asString(source);
+        if (idx >= 0 && idx < string->length)
+        {
+            const char c = string->chars[idx];
+            ObjString* character = takeString(&c, 1);
+            push(Value(character));
+        }
+        else
+        {
+            push(Value());
+        }
+    }
+    else
+    {
+        runtimeError("Invalid range type.");
+        return false;
+    }
+    return true;
+}
+
+bool VM::storeSubscript()
+{
+    // stack is: [...,source,index,item] and after: [item]
+    // We can have: instance and string, or range|list|string and number
+    Value item = pop();
+    Value index = pop();
+    Value source = pop();
+
+    if (isMap(source))
+    {
+        asMap(source)->set(index, item);
+        push(item);
+        return true;
+    }
+
+    if (isInstance(source))
+    {
+        if (!isString(index))
+        {
+            runtimeError("Fields can only be accessed by strings.");
+            return false;
+        }
+
+        ObjInstance* instance = asInstance(source);
+        ObjString* name = asString(index);
+
+        instance->setField(name, item);
+        push(item);
+    }
+    else
+    {
+        if (!isNumber(index))
+        {
+            runtimeError("List index is not a number.");
+            return false;
+        }
+
+        const int idx = static_cast<int>(asNumber(index));
+
+        if (isList(source))
+        {
+            ObjList* list = asList(source);
+
+            // TODO: Maybe just reserve more space in the list?
+            if (!list->isInBounds(idx))
+            {
+                runtimeError("Invalid list index.");
+                return false;
+            }
+
+            list->setValue(idx, item);
+            push(item);
+        }
+        else if (isString(source))
+        {
+            if(!isString(item))
+            {
+                runtimeError("You can only assign characters.");
+                return false;
+            }
+
+            ObjString* str = asString(source);
+            ObjString* character = asString(item);
+
+            if (character->chars.length() != 1)
+            {
+                runtimeError("Invalid string length.");
+                return false;
+            }
+
+            if (idx >= 0 && idx < str->length)
+            {
+                str->chars[idx] = character->chars[0];
+                push(Value(copyString(character->chars.c_str(), 1)));
+            }
+            else
+            {
+                runtimeError("Invalid string index.");
+                return false;
+            }
+        }
+        else
+        {
+            runtimeError("Cannot store value.");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VM::isInBounds(const Value& source, const Value& index, bool& inBounds)
+{
+    if (!isNumber(index))
+    {
+        runtimeError("List index is not a number.");
+        return false;
+    }
+
+    const int idx = static_cast<int>(asNumber(index));
+
+    if (isRange(source))
+    {
+        inBounds = asRange(source)->isInBounds(idx);
+    }
+    else if (isList(source))
+    {
+        inBounds = asList(source)->isInBounds(idx);
+    }
+    else if (isString(source))
+    {
+        inBounds = idx >= 0 && idx < asString(source)->length;
+    }
+    else
+    {
+        runtimeError("Invalid range type.");
+        return false;
+    }
+
+    return true;
+}
+
 void VM::concatenate()
 {
     ObjString* b = asString(peek(0));
@@ -1372,6 +2566,7 @@ bool VM::call(ObjClosure* closure, uint8_t argCount)
     frame->closure = closure;
     frame->ip = &closure->function->chunk.code[0];
     frame->slots = stackTop - argCount - 1;
+    frame->registerIp = nullptr;
     return true;
 }
 
@@ -1452,7 +2647,7 @@ bool VM::invoke(ObjString* name, uint8_t argCount)
     ObjInstance* instance = asInstance(receiver);
 
     Value value;
-    if (instance->fields.get(name, &value))
+    if (instance->getField(name, &value))
     {
         stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
@@ -1461,6 +2656,138 @@ bool VM::invoke(ObjString* name, uint8_t argCount)
     return invokeFromClass(instance->klass, name, argCount);
 }
 
+bool VM::invoke(ObjString* name, uint8_t argCount, InlineCache& cache)
+{
+    const Value receiver = peek(argCount);
+
+    if (!isInstance(receiver))
+    {
+        runtimeError("Only instances have methods.");
+        return false;
+    }
+
+    ObjInstance* instance = asInstance(receiver);
+    const Shape* shape = instance->shape;
+    if (!shape || cache.megamorphic)
+    {
+        inlineCacheStats.megamorphic++;
+        return invoke(name, argCount);
+    }
+
+    InlineCacheEntry resolved;
+    if (const InlineCacheEntry* entry = cache.find(shape))
+    {
+        inlineCacheStats.hits++;
+        resolved = *entry;
+    }
+    else
+    {
+        inlineCacheStats.misses++;
+        resolved = { shape, nullptr, shape->findSlot(name), instance->klass, Value() };
+        if (resolved.slot < 0 && !instance->klass->methods.get(name, &resolved.method))
+        {
+            runtimeError("Undefined property '%s'.", name->chars.c_str());
+            return false;
+        }
+        cacheBarrier(frames[frameCount - 1].closure->function, resolved);
+        cache.add(resolved);
+    }
+
+    if (resolved.slot >= 0)
+    {
+        const Value field = instance->slots[resolved.slot];
+        stackTop[-argCount - 1] = field;
+        return callValue(field, argCount);
+    }
+
+    return callValue(resolved.method, argCount);
+}
+
+void VM::getProperty(ObjInstance* instance, ObjString* name, InlineCache& cache)
+{
+    const Shape* shape = instance->shape;
+    if (!shape || cache.megamorphic)
+    {
+        inlineCacheStats.megamorphic++;
+        Value value;
+        if (instance->getField(name, &value))
+        {
+            peek(0) = value;
+            return;
+        }
+        bindMethod(instance, name);
+        return;
+    }
+
+    const InlineCacheEntry* entry = cache.find(shape);
+    InlineCacheEntry resolved;
+    if (entry)
+    {
+        inlineCacheStats.hits++;
+    }
+    else
+    {
+        inlineCacheStats.misses++;
+        resolved = { shape, nullptr, shape->findSlot(name), instance->klass, Value() };
+        if (resolved.slot < 0 && !instance->klass->methods.get(name, &resolved.method))
+        {
+            peek(0) = Value(); // Nil
+            return;
+        }
+        cacheBarrier(frames[frameCount - 1].closure->function, resolved);
+        cache.add(resolved);
+        entry = &resolved;
+    }
+
+    if (entry->slot >= 0)
+    {
+        peek(0) = instance->slots[entry->slot];
+        return;
+    }
+
+    // The instance stays on the stack while the bound method is allocated.
+    Value method = entry->method;
+    ObjBoundMethod* bound = newBoundMethod(Value(instance), method);
+    peek(0) = Value(bound);
+}
+
+void VM::setProperty(ObjInstance* instance, ObjString* name, const Value& value, InlineCache& cache)
+{
+    Shape* shape = instance->shape;
+    if (!shape || cache.megamorphic)
+    {
+        inlineCacheStats.megamorphic++;
+        instance->setField(name, value);
+        return;
+    }
+
+    if (const InlineCacheEntry* entry = cache.find(shape))
+    {
+        inlineCacheStats.hits++;
+        writeBarrier(instance, value);
+        if (entry->nextShape)
+        {
+            instance->shape = entry->nextShape;
+            instance->slots.push_back(value);
+        }
+        else
+        {
+            instance->slots[entry->slot] = value;
+        }
+        return;
+    }
+
+    inlineCacheStats.misses++;
+    instance->setField(name, value);
+    if (instance->shape)
+    {
+        Shape* nextShape = instance->shape != shape ? instance->shape : nullptr;
+        const InlineCacheEntry added = { shape, nextShape, instance->shape->findSlot(name), instance->klass, Value() };
+        cacheBarrier(frames[frameCount - 1].closure->function, added);
+        cache.add(added);
+    }
+}
+
 bool VM::bindMethod(ObjInstance* instance, ObjString* name)
 {
     Value method;
@@ -1513,6 +2840,7 @@ void VM::closeUpvalues(Value* last)
     while (openUpvalues != nullptr && openUpvalues->location >= last)
     {
         ObjUpvalue* upvalue = openUpvalues;
+        writeBarrier(upvalue, *upvalue->location);
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
         openUpvalues = upvalue->next;
@@ -1523,6 +2851,8 @@ void VM::defineMethod(ObjString* name)
 {
     const Value method = peek(0);
     ObjClass* klass = asClass(peek(1));
+    writeBarrier(klass, name);
+    writeBarrier(klass, method);
     if (name->length == 4 && name->chars == "init")
     {
         klass->initializer = method;
@@ -2,15 +2,18 @@
 #define loxcpp_vm_h
 
 #include <vector>
-#include <list>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <string>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 #include "Chunk.h"
 #include "Value.h"
 #include "HashTable.h"
+#include "Memory.h"
 #include "Object.h"
 #include "Compiler.h"
 
@@ -51,6 +54,22 @@ private:
     std::atomic<bool> wantsValues{ false };
 };
 
+struct InlineCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Accesses that skipped the caches: megamorphic sites and dictionary-mode instances.
+    uint64_t megamorphic = 0;
+};
+
+// Every time the collector stopped the script, young collections included.
+struct GcPauseStats
+{
+    uint64_t pauses = 0;
+    std::chrono::nanoseconds total{ 0 };
+    std::chrono::nanoseconds longest{ 0 };
+};
+
 using InstructonPointer = uint8_t*;
 
 struct CallFrame
@@ -58,6 +77,8 @@ struct CallFrame
     ObjClosure* closure = nullptr;
     InstructonPointer ip = nullptr;
     Value* slots = nullptr;
+    // Only set while the function runs on the register interpreter.
+    const RegisterInstruction* registerIp = nullptr;
 };
 
 struct NativeMethodDef
@@ -73,7 +94,8 @@ class VM
 {
 public:
 
-    using GCObjList = std::list<Obj*>;
+    // Managed objects of one generation, in allocation order. Swept by compacting it in place.
+    using GCObjList = std::vector<Obj*>;
 
     VM();
     VM(VM const&) = delete;
@@ -93,15 +115,31 @@ public:
     InterpretResult interpret(const std::string& source);
 
     Table& stringTable() { return strings; }
-    Table& globalTable() { return globals; }
+    GlobalTable& globalTable() { return globals; }
 
     // Memory. TODO: Separate from the VM
+    HeapAllocator& getHeap() { return heap; }
     void addObject(Obj* obj, size_t allocationSize);
+    void freeObject(Obj* obj);
     void freeAllObjects();
+    // Marks from every root, the external marking function included, and sweeps both generations.
+    // A collection that is still going on is finished first.
     void collectGarbage();
+    // Only sweeps the objects allocated since the last collection, promoting the survivors.
+    // Outside of run() every object is already old, so this is a full collection there. While a
+    // full collection is marking, this takes one of its steps instead.
+    void collectYoungGarbage();
     void markRoots();
     void traceReferences();
-    void sweep();
+    void sweepYoung();
+    // Slow paths of the write barriers.
+    void recordWrite(Obj* owner, Obj* stored);
+    void recordAppend(Obj* owner, Obj* stored);
+    // Young collections don't call the external marking function. A host that keeps a value
+    // created by running code must pass it here, until the value is promoted it is a root.
+    void rememberValue(const Value& value);
+    // Slow path of the snapshot barrier: scans the object before the script changes it.
+    void snapshotObject(Obj* object);
     void markObject(Obj* object);
     void markValue(Value& value);
     void markArray(ValueArray& valArray);
@@ -122,9 +160,25 @@ public:
     size_t getFrameCount() const { return frameCount; }
     size_t getStackSize() const { return static_cast<size_t>(stackTop - stack.data()); }
     size_t getAllocatedBytes() const { return bytesAllocated; }
+    uint64_t getYoungCollectionCount() const { return youngCollections; }
+    uint64_t getFullCollectionCount() const { return fullCollections; }
+    // With a budget, the full collections that allocations start mark and sweep in steps of
+    // about that long between allocations. Zero, the default, does all of it in one pause.
+    void setGcPauseBudget(std::chrono::nanoseconds budget) { gcPauseBudget = budget; }
+    std::chrono::nanoseconds getGcPauseBudget() const { return gcPauseBudget; }
+    // Longest pause of the last finished full collection, its root scan and final remark included.
+    std::chrono::nanoseconds getLastGcMaxPause() const { return lastGcMaxPause; }
+    // Full collections that allocations start mark on a helper thread while the script runs.
+    // Only the root scan and the final remark stop it, the sweep still follows the pause budget.
+    void setConcurrentMarking(bool enabled) { concurrentMarking = enabled; }
+    bool isConcurrentMarkingEnabled() const { return concurrentMarking; }
+    const GcPauseStats& getGcPauseStats() const { return gcPauseStats; }
+    void resetGcPauseStats() { gcPauseStats = {}; }
     std::vector<VmDebugCallFrame> getDebugCallStack() const;
     void setDebugHandler(VmDebugHandler* handler) { debugHandler = handler; }
     VmDebugHandler* getDebugHandler() const { return debugHandler; }
+    const InlineCacheStats& getInlineCacheStats() const { return inlineCacheStats; }
+    void resetInlineCacheStats() { inlineCacheStats = {}; }
     void requestStop() { stopRequested.store(true, std::memory_order_relaxed); }
     void clearStopRequest() { stopRequested.store(false, std::memory_order_relaxed); }
 
@@ -137,13 +191,67 @@ public:
 private:
     friend class ScopedGcRoot;
 
+    // Counts the run() and runRegisters() calls on the native stack. Leaving the outermost one
+    // promotes the young generation: the host may keep any of those objects in its own roots.
+    class NestingScope
+    {
+    public:
+        explicit NestingScope(VM& vm);
+        ~NestingScope();
+
+    private:
+        VM& vm;
+    };
+
+    enum class GcPhase
+    {
+        IDLE,
+        MARKING,
+        SWEEPING
+    };
+
+    using GcClock = std::chrono::steady_clock;
+
+    void tenureYoungObjects();
+    void startCollection();
+    void collectGarbageStep();
+    void beginCollection();
+    // Blackens gray objects until there are none left or the deadline passes.
+    bool markUntil(GcClock::time_point deadline);
+    // The final remark, it runs in one pause.
+    void finishMarking();
+    bool sweepUntil(GcClock::time_point deadline);
+    void finishCollection();
+    void recordGcPause(GcClock::time_point start);
+    void countGcPause(std::chrono::nanoseconds pause);
+    // The marker thread owns grayNodes until it is joined.
+    void startMarker();
+    void markConcurrently();
+    void joinMarker();
+
     void runtimeError(const char* format, ...);
     bool validateBinaryOperator();
     void concatenate();
+    bool add();
+    bool isInBounds(const Value& source, const Value& index, bool& inBounds);
+    bool indexSubscript();
+    bool storeSubscript();
+
+    InterpretResult runRegisters();
+    // Sets up the registers of the frame that was just called, false on a stack overflow.
+    bool enterRegisterFrame();
+    // Runs the innermost frame from ip, or only the instruction at ip for the JIT.
+    template <bool SINGLE_STEP>
+    InterpretResult executeRegisters(const RegisterInstruction* ip);
+    const JitCode* hotJitCode(Chunk& chunk);
+    static int runJitStep(VM* vm, const RegisterInstruction* instruction);
 
     bool call(ObjClosure* closure, uint8_t argCount);
     bool invokeFromClass(ObjClass* klass, ObjString* name, uint8_t argCount);
     bool invoke(ObjString* name, uint8_t argCount);
+    bool invoke(ObjString* name, uint8_t argCount, InlineCache& cache);
+    void getProperty(ObjInstance* instance, ObjString* name, InlineCache& cache);
+    void setProperty(ObjInstance* instance, ObjString* name, const Value& value, InlineCache& cache);
     bool bindMethod(ObjInstance* instance, ObjString* name);
     ObjUpvalue* captureUpvalue(Value* local);
     void closeUpvalues(Value* last);
@@ -157,28 +265,70 @@ private:
 
     static constexpr size_t STACK_MAX = 256;
     static constexpr size_t FRAMES_MAX = 255;
+    // Switching between the stack and register interpreters, and natives calling back into the
+    // VM, nest run() calls on the native stack. Deeper than this is reported as a stack overflow
+    // before a thread with a small stack can crash.
+    static constexpr size_t NATIVE_NESTING_MAX = 64;
     static constexpr size_t MINIMUM_GC_THRESHOLD = 1024 * 1024;
-
+    // Bytes allocated by running code before a young collection.
+    static constexpr size_t NURSERY_SIZE = 256 * 1024;
+    // Bytes allocated between two steps of a full collection that has a pause budget.
+    static constexpr size_t GC_STEP_SIZE = 64 * 1024;
+    // Objects a step marks or sweeps between two looks at the clock.
+    static constexpr size_t GC_STEP_OBJECTS = 64;
+    // Calls plus loop iterations before a register function is compiled.
+    static constexpr uint32_t JIT_THRESHOLD = 1000;
+
+    // Declared first so it outlives everything that could still point into it.
+    HeapAllocator heap;
     std::array<CallFrame, FRAMES_MAX> frames;
     size_t frameCount;
+    size_t nativeNesting = 0;
     std::array<Value, STACK_MAX> stack;
     GCObjList objects;
+    GCObjList youngObjects;
+    std::vector<Obj*> rememberedSet;
+    std::vector<Value> rememberedValues;
     ObjUpvalue* openUpvalues; // Maybe this could also be a list?
     Value* stackTop;
     Table strings;
-    Table globals;
+    GlobalTable globals;
     Compiler compiler;
     bool nativesDefined = false;
     bool canCollectGarbage = true;
+    bool collectingYoung = false;
     VmDebugHandler* debugHandler = nullptr;
     bool debugPausePending = false;
     std::atomic<bool> stopRequested{ false };
+    InlineCacheStats inlineCacheStats;
 
     ExternalMarkingFunc externalMarkingFunc;
     std::vector<Obj*> grayNodes;
     std::vector<Value> temporaryRoots;
     size_t bytesAllocated = 0;
+    size_t youngBytes = 0;
     size_t nextGC = MINIMUM_GC_THRESHOLD;
+    uint64_t youngCollections = 0;
+    uint64_t fullCollections = 0;
+
+    GcPhase gcPhase = GcPhase::IDLE;
+    std::chrono::nanoseconds gcPauseBudget{ 0 };
+    std::chrono::nanoseconds currentGcMaxPause{ 0 };
+    std::chrono::nanoseconds lastGcMaxPause{ 0 };
+    size_t nextGcStep = 0;
+    // Progress of the sweep over the old generation.
+    size_t sweepIndex = 0;
+    size_t sweepSurvivors = 0;
+    size_t sweepEnd = 0;
+    GcPauseStats gcPauseStats;
+
+    bool concurrentMarking = false;
+    std::thread markerThread;
+    std::atomic<bool> markerDone{ false };
+    // Gray objects found by the snapshots the script took, handed over to the marker.
+    std::mutex snapshotGraysMutex;
+    std::vector<Obj*> snapshotGrays;
+    std::vector<Obj*> scriptGrays;
 };
 
 class ScopedGcRoot